@@ -5,159 +5,475 @@
 #include <atomic>
 #include <mutex>
 #include <semaphore>
+#include <condition_variable>
 #include <unordered_map>
+#include <vector>
+#include <memory>
+#include <algorithm>
 
 #include "storage_interface.h"
 #include "utils/socket.h"
+#include "utils/crc32c.h"
 
 namespace cs2313 {
 
     struct disk_client_transaction {
         std::binary_semaphore sig_wake_;
         char *writeback_data_;
+        size_t writeback_size_;
+        bool checksum_; // the reply carries checksums of the writeback data
+        bool corrupt_; // the data did not match its checksums, on either side
+        bool rejected_; // the drive answered IO_INSTR_ADDR_ERROR
 
-        explicit disk_client_transaction(char *writeback_data = nullptr) :
+        explicit disk_client_transaction(char *writeback_data = nullptr, const size_t writeback_size = 0, const bool checksum = false) :
             sig_wake_(0),
-            writeback_data_(writeback_data) {}
+            writeback_data_(writeback_data),
+            writeback_size_(writeback_size),
+            checksum_(checksum),
+            corrupt_(false),
+            rejected_(false) {}
 
         disk_client_transaction(const disk_client_transaction &) = delete;
 
         disk_client_transaction &operator=(const disk_client_transaction &) = delete;
     };
 
+    enum disk_client_routing {
+        DISK_CLIENT_ROUTE_TID, // round-robin by transaction id
+        DISK_CLIENT_ROUTE_LEAST_OUTSTANDING
+    };
+
+    struct disk_client_connection {
+        client_socket_handle socket_;
+        std::mutex write_mutex_;
+        std::thread handler_thread_;
+        std::atomic<uint32_t> outstanding_;
+        uint32_t queue_depth_; // outstanding requests allowed by the drive (0: no limit)
+
+        std::unordered_map<int, disk_client_transaction *> waiting_list_;
+        std::mutex list_mutex_;
+        std::condition_variable slot_cv_;
+
+        disk_client_connection(const std::string &server_addr, const uint16_t server_port) :
+            socket_(server_addr, server_port),
+            outstanding_(0),
+            queue_depth_(0) {}
+
+        disk_client_connection(const disk_client_connection &) = delete;
+
+        disk_client_connection &operator=(const disk_client_connection &) = delete;
+    };
+
     class disk_client : public storage_interface {
 
     public:
-        disk_client(const std::string &server_addr, const uint16_t server_port) :
+        disk_client(const std::string &server_addr, const uint16_t server_port,
+                    const uint32_t connections = 1,
+                    const disk_client_routing routing = DISK_CLIENT_ROUTE_TID) :
             tid_counter_(0),
-            client_socket_(server_addr, server_port),
+            routing_(routing),
+            checksums_(false),
             handler_loop_(false),
             initiative_shutdown_(false) {
 
-            client_socket_.send(IO_INSTR_GET_DESC);
-            client_socket_.send(tid_counter_);
-            ++tid_counter_;
+            for (uint32_t i = 0; i < std::max(connections, 1u); ++i)
+                connections_.emplace_back(std::make_unique<disk_client_connection>(server_addr, server_port));
+
+            // A drive that does not know IO_INSTR_GET_CAPS drops it, so whether the first reply is the
+            // capabilities or already the description tells the drive generation apart
+            client_socket_handle &socket = connections_[0]->socket_;
+            socket.send(IO_INSTR_GET_CAPS);
+            socket.send(tid_step());
+            socket.send(IO_INSTR_GET_DESC);
+            socket.send(tid_step());
+
+            io_instr instr;
+            uint32_t tid;
+            socket.recv(instr);
+            socket.recv(tid);
+            capabilities_ = io_capabilities{0, 0, 0, 0, 0};
+            if (instr == IO_INSTR_GET_CAPS) {
+                socket.recv(capabilities_);
+                socket.recv(instr);
+                socket.recv(tid);
+            }
+            socket.recv(description_);
+
+            for (auto &c: connections_)
+                c->queue_depth_ = capabilities_.max_queue_depth;
+            if (supports(IO_FEATURE_BATCH_COMPLETIONS))
+                enable_batch_completions();
+            checksums_ = supports(IO_FEATURE_CHECKSUM_TABLE);
+        }
+
+        io_capabilities capabilities() const {
+            return capabilities_;
+        }
+
+        bool supports(const uint32_t feature) const {
+            return (capabilities_.features & feature) == feature;
+        }
 
-            char discard[sizeof(io_instr) + sizeof(tid_counter_)];
-            client_socket_.recv_raw(discard, sizeof(io_instr) + sizeof(tid_counter_));
-            client_socket_.recv(description_);
+        // Sends a CRC-32C of every sector with written data and has them checked by the drive, and
+        // checks those the drive sends with read data. Damaged requests are retried, then fail.
+        // On by default against a drive storing checksums with the data; this also covers the transfer
+        // to a drive computing them on the fly. False if the drive knows no checksums
+        bool enable_checksums() {
+            checksums_ = supports(IO_FEATURE_CHECKSUMS);
+            return checksums_;
         }
 
         void start_handler() {
             if (!handler_loop_.load()) {
                 handler_loop_.store(true);
-                handler_thread_ = std::thread(&disk_client::response_handler, this); // TODO except
+                for (auto &c: connections_)
+                    c->handler_thread_ = std::thread(&disk_client::response_handler, this, c.get()); // TODO except
             }
         }
 
         // TODO timeout & heartbeat
 
         void read(const uint64_t sector_addr, char *data) override {
+            with_retries([&] {
+                uint32_t tid = tid_step();
+                disk_client_connection &connection = route(tid);
+                disk_client_transaction transaction(data, description_.bytes_per_sector, checksums_);
+                waiting_list_add(connection, tid, &transaction);
+                {
+                    std::lock_guard<std::mutex> lock(connection.write_mutex_);
+                    send_header(connection.socket_, checksummed(IO_INSTR_READ), tid);
+                    connection.socket_.send(sector_addr);
+                }
+                return wait_reply(transaction);
+            });
+        }
+
+        void write(const uint64_t sector_addr, const char *data) override {
+            uint32_t sum = checksums_ ? crc32c(data, description_.bytes_per_sector) : 0;
+            with_retries([&] {
+                uint32_t tid = tid_step();
+                disk_client_connection &connection = route(tid);
+                disk_client_transaction transaction;
+                waiting_list_add(connection, tid, &transaction);
+                {
+                    std::lock_guard<std::mutex> lock(connection.write_mutex_);
+                    send_header(connection.socket_, checksummed(IO_INSTR_WRITE), tid);
+                    connection.socket_.send(sector_addr);
+                    connection.socket_.send_raw(data, description_.bytes_per_sector);
+                    if (checksums_)
+                        connection.socket_.send(sum);
+                }
+                return wait_reply(transaction);
+            });
+        }
+
+        void read_range(const uint64_t sector_addr, const uint64_t sectors, char *data) override {
+            if (!supports(IO_FEATURE_RANGE)) {
+                storage_interface::read_range(sector_addr, sectors, data);
+                return;
+            }
+            split_transfer(sector_addr, sectors, [&](const uint64_t addr, const uint64_t n, const uint64_t offset) {
+                read_range_request(addr, n, data + offset);
+            });
+        }
+
+        void write_range(const uint64_t sector_addr, const uint64_t sectors, const char *data) override {
+            if (!supports(IO_FEATURE_RANGE)) {
+                storage_interface::write_range(sector_addr, sectors, data);
+                return;
+            }
+            split_transfer(sector_addr, sectors, [&](const uint64_t addr, const uint64_t n, const uint64_t offset) {
+                write_range_request(addr, n, data + offset);
+            });
+        }
+
+        void discard(const uint64_t sector_addr, const uint64_t sectors) override {
+            if (!supports(IO_FEATURE_TRIM))
+                return; // a hint only
             uint32_t tid = tid_step();
-            disk_client_transaction transaction(data);
-            waiting_list_add(tid, &transaction); //
+            disk_client_connection &connection = route(tid);
+            disk_client_transaction transaction;
+            waiting_list_add(connection, tid, &transaction);
             {
-                std::lock_guard<std::mutex> lock(socket_write_mutex_);
-                client_socket_.send(IO_INSTR_READ);
-                client_socket_.send(tid);
-                client_socket_.send(sector_addr);
+                std::lock_guard<std::mutex> lock(connection.write_mutex_);
+                send_header(connection.socket_, IO_INSTR_TRIM, tid);
+                connection.socket_.send(sector_addr);
+                connection.socket_.send(sectors);
             }
-            transaction.sig_wake_.acquire();
+            wait_reply(transaction);
         }
 
-        void write(const uint64_t sector_addr, const char *data) override {
+        void flush(const uint64_t sector_addr, const uint64_t sectors) override {
+            if (!supports(IO_FEATURE_FLUSH))
+                return; // the drive acknowledges writes once they are durable
             uint32_t tid = tid_step();
+            disk_client_connection &connection = route(tid);
             disk_client_transaction transaction;
-            waiting_list_add(tid, &transaction); //
+            waiting_list_add(connection, tid, &transaction);
             {
-                std::lock_guard<std::mutex> lock(socket_write_mutex_);
-                client_socket_.send(IO_INSTR_WRITE);
-                client_socket_.send(tid);
-                client_socket_.send(sector_addr);
-                client_socket_.send_raw(data, description_.bytes_per_sector);
+                std::lock_guard<std::mutex> lock(connection.write_mutex_);
+                connection.socket_.send(IO_INSTR_FLUSH);
+                connection.socket_.send(tid);
+                connection.socket_.send(sector_addr);
+                connection.socket_.send(sectors);
             }
             transaction.sig_wake_.acquire();
         }
 
         void shutdown() override {
             uint32_t tid = tid_step();
+            disk_client_connection &connection = *connections_[0];
             disk_client_transaction transaction;
-            waiting_list_add(tid, &transaction); //
+            waiting_list_add(connection, tid, &transaction);
             {
-                std::lock_guard<std::mutex> lock(socket_write_mutex_);
+                std::lock_guard<std::mutex> lock(connection.write_mutex_);
                 initiative_shutdown_.store(true);
-                client_socket_.send(IO_INSTR_SHUTDOWN);
-                client_socket_.send(tid);
+                connection.socket_.send(IO_INSTR_SHUTDOWN);
+                connection.socket_.send(tid);
             }
             transaction.sig_wake_.acquire();
         }
 
+        // Queued requests carry the priority of the issuing thread when it is not the default
+        void send_header(client_socket_handle &socket, const io_instr instr, const uint32_t tid) const {
+            if (current_io_priority == IO_PRIORITY_NORMAL || !supports(IO_FEATURE_PRIORITY)) {
+                socket.send(instr);
+                socket.send(tid);
+            } else {
+                socket.send(static_cast<io_instr>(instr | IO_INSTR_PRIORITY_FLAG));
+                socket.send(tid);
+                socket.send(current_io_priority);
+            }
+        }
+
         disk_description get_description() override {
             return description_;
         }
 
+        drive_stats get_stats() {
+            if (!supports(IO_FEATURE_STATS))
+                return drive_stats{};
+            uint32_t tid = tid_step();
+            disk_client_connection &connection = route(tid);
+            drive_stats stats;
+            disk_client_transaction transaction(reinterpret_cast<char *>(&stats), sizeof(drive_stats));
+            waiting_list_add(connection, tid, &transaction);
+            {
+                std::lock_guard<std::mutex> lock(connection.write_mutex_);
+                connection.socket_.send(IO_INSTR_GET_STATS);
+                connection.socket_.send(tid);
+            }
+            transaction.sig_wake_.acquire();
+            return stats;
+        }
+
         ~disk_client() override {
             if (handler_loop_.load()) {
                 handler_loop_.store(false);
-                if (handler_thread_.joinable())
-                    handler_thread_.join();
+                for (auto &c: connections_)
+                    c->socket_.interrupt();
+                for (auto &c: connections_)
+                    if (c->handler_thread_.joinable())
+                        c->handler_thread_.join();
             }
         }
 
     private:
-        uint32_t tid_counter_;
-        std::mutex counter_mutex_;
+        std::atomic<uint32_t> tid_counter_;
 
         uint32_t tid_step() {
-            std::lock_guard<std::mutex> lock(counter_mutex_);
-            uint32_t tid = tid_counter_;
-            ++tid_counter_;
-            return tid;
+            return tid_counter_.fetch_add(1, std::memory_order_relaxed);
         }
 
-        std::unordered_map<int, disk_client_transaction *> waiting_list_;
-        std::mutex list_mutex_;
+        // Every connection owns its socket, waiting list and completion thread,
+        // so transactions on different connections never contend on a lock
+        std::vector<std::unique_ptr<disk_client_connection> > connections_;
+        disk_client_routing routing_;
 
-        void waiting_list_add(const uint32_t tid, disk_client_transaction *transaction) {
-            std::lock_guard<std::mutex> lock(list_mutex_);
-            waiting_list_[tid] = transaction;
+        disk_client_connection &route(const uint32_t tid) {
+            if (connections_.size() == 1)
+                return *connections_[0];
+            if (routing_ == DISK_CLIENT_ROUTE_LEAST_OUTSTANDING) {
+                disk_client_connection *ret = connections_[0].get();
+                uint32_t min_outstanding = ret->outstanding_.load(std::memory_order_relaxed);
+                for (auto &c: connections_) {
+                    uint32_t outstanding = c->outstanding_.load(std::memory_order_relaxed);
+                    if (outstanding < min_outstanding) {
+                        ret = c.get();
+                        min_outstanding = outstanding;
+                    }
+                }
+                return *ret;
+            }
+            return *connections_[tid % connections_.size()];
         }
 
-        client_socket_handle client_socket_;
-        std::mutex socket_write_mutex_;
+        // Waits for a free slot if the drive limits the queue depth
+        static void waiting_list_add(disk_client_connection &connection, const uint32_t tid, disk_client_transaction *transaction) {
+            std::unique_lock<std::mutex> lock(connection.list_mutex_);
+            if (connection.queue_depth_)
+                connection.slot_cv_.wait(lock, [&] {
+                    return connection.outstanding_.load(std::memory_order_relaxed) < connection.queue_depth_;
+                });
+            connection.waiting_list_[tid] = transaction;
+            connection.outstanding_.fetch_add(1, std::memory_order_relaxed);
+        }
 
         disk_description description_;
+        io_capabilities capabilities_;
+
+        // Lets the drive acknowledge the writes of one head visit in a single frame; before the handler runs
+        void enable_batch_completions() {
+            for (auto &c: connections_) {
+                uint32_t tid = tid_step();
+                c->socket_.send(IO_INSTR_COMPLETE_BATCH);
+                c->socket_.send(tid);
+
+                char discard[sizeof(io_instr) + sizeof(tid)];
+                c->socket_.recv_raw(discard, sizeof(io_instr) + sizeof(tid));
+            }
+        }
+
+        bool checksums_;
+        static constexpr int CHECKSUM_ATTEMPTS = 3;
+
+        io_instr checksummed(const io_instr instr) const {
+            return checksums_ ? static_cast<io_instr>(instr | IO_INSTR_CHECKSUM_FLAG) : instr;
+        }
+
+        // A damaged transfer is most likely a one-off on the wire; a sector that stays damaged is not
+        template<typename F>
+        static void with_retries(F attempt) {
+            for (int i = 1; !attempt(); ++i)
+                if (i == CHECKSUM_ATTEMPTS)
+                    throw except(ERROR_DISK_CHECKSUM_MISMATCH, "Sector data does not match its checksum");
+        }
+
+        // false if the data was damaged on the way
+        static bool wait_reply(disk_client_transaction &transaction) {
+            transaction.sig_wake_.acquire();
+            if (transaction.rejected_)
+                throw except(ERROR_DISK_ADDR_INVALID, "Invalid disk address");
+            return !transaction.corrupt_;
+        }
+
+        // Pieces no larger than the drive takes in one request
+        template<typename F>
+        void split_transfer(const uint64_t sector_addr, const uint64_t sectors, F f) const {
+            const uint64_t max = capabilities_.max_transfer_sectors ? capabilities_.max_transfer_sectors : sectors;
+            for (uint64_t done = 0; done < sectors;) {
+                const uint64_t n = std::min(max, sectors - done);
+                f(sector_addr + done, n, done * description_.bytes_per_sector);
+                done += n;
+            }
+        }
+
+        void read_range_request(const uint64_t sector_addr, const uint64_t sectors, char *data) {
+            with_retries([&] {
+                uint32_t tid = tid_step();
+                disk_client_connection &connection = route(tid);
+                disk_client_transaction transaction(data, sectors * description_.bytes_per_sector, checksums_);
+                waiting_list_add(connection, tid, &transaction);
+                {
+                    std::lock_guard<std::mutex> lock(connection.write_mutex_);
+                    send_header(connection.socket_, checksummed(IO_INSTR_READ_RANGE), tid);
+                    connection.socket_.send(sector_addr);
+                    connection.socket_.send(sectors);
+                }
+                return wait_reply(transaction);
+            });
+        }
+
+        void write_range_request(const uint64_t sector_addr, const uint64_t sectors, const char *data) {
+            std::vector<uint32_t> sums(checksums_ ? sectors : 0);
+            if (checksums_)
+                crc32c_sectors(data, sectors, description_.bytes_per_sector, sums.data());
+            with_retries([&] {
+                uint32_t tid = tid_step();
+                disk_client_connection &connection = route(tid);
+                disk_client_transaction transaction;
+                waiting_list_add(connection, tid, &transaction);
+                {
+                    std::lock_guard<std::mutex> lock(connection.write_mutex_);
+                    send_header(connection.socket_, checksummed(IO_INSTR_WRITE_RANGE), tid);
+                    connection.socket_.send(sector_addr);
+                    connection.socket_.send(sectors);
+                    connection.socket_.send_raw(data, sectors * description_.bytes_per_sector);
+                    if (checksums_)
+                        connection.socket_.send_raw(reinterpret_cast<const char *>(sums.data()), sectors * sizeof(uint32_t));
+                }
+                return wait_reply(transaction);
+            });
+        }
 
         std::atomic<bool> handler_loop_;
-        std::thread handler_thread_;
 
         std::atomic<bool> initiative_shutdown_;
 
-        void response_handler() {
+        static void complete_batch(disk_client_connection *connection) {
+            uint32_t count;
+            connection->socket_.recv(count);
+            std::vector<uint32_t> tids(count);
+            connection->socket_.recv_raw(reinterpret_cast<char *>(tids.data()), count * sizeof(uint32_t));
+            std::lock_guard<std::mutex> lock(connection->list_mutex_);
+            for (uint32_t tid: tids) {
+                auto it = connection->waiting_list_.find(tid);
+                if (it == connection->waiting_list_.end())
+                    continue;
+                it->second->sig_wake_.release();
+                connection->waiting_list_.erase(it);
+                connection->outstanding_.fetch_sub(1, std::memory_order_relaxed);
+            }
+            connection->slot_cv_.notify_all();
+        }
+
+        void verify(client_socket_handle &socket, disk_client_transaction &transaction) const {
+            const uint64_t sectors = transaction.writeback_size_ / description_.bytes_per_sector;
+            std::vector<uint32_t> sums(sectors);
+            socket.recv_raw(reinterpret_cast<char *>(sums.data()), sectors * sizeof(uint32_t));
+            for (uint64_t i = 0; i < sectors; ++i)
+                if (crc32c(transaction.writeback_data_ + i * description_.bytes_per_sector, description_.bytes_per_sector) != sums[i])
+                    transaction.corrupt_ = true;
+        }
+
+        void response_handler(disk_client_connection *connection) {
+            client_socket_handle &socket = connection->socket_;
             while (handler_loop_.load(std::memory_order_acquire)) {
                 try {
                     uint8_t instr;
                     uint32_t tid;
-                    client_socket_.recv(instr);
-                    client_socket_.recv(tid);
+                    socket.recv(instr);
+                    socket.recv(tid);
+                    if (instr == IO_INSTR_COMPLETE_BATCH) {
+                        complete_batch(connection);
+                        continue;
+                    }
                     disk_client_transaction *transaction = nullptr; //
 
                     {
-                        std::lock_guard<std::mutex> lock(list_mutex_);
-                        auto it = waiting_list_.find(tid);
-                        if (it != waiting_list_.end()) {
+                        std::lock_guard<std::mutex> lock(connection->list_mutex_);
+                        auto it = connection->waiting_list_.find(tid);
+                        if (it != connection->waiting_list_.end()) {
                             transaction = it->second;
-                            waiting_list_.erase(it);
+                            connection->waiting_list_.erase(it);
+                            connection->outstanding_.fetch_sub(1, std::memory_order_relaxed);
+                            connection->slot_cv_.notify_one();
                         }
                     }
 
                     if (transaction) {
-                        if (instr == IO_INSTR_READ)
-                            client_socket_.recv_raw(transaction->writeback_data_, description_.bytes_per_sector);
+                        if (instr == IO_INSTR_READ || instr == IO_INSTR_READ_RANGE || instr == IO_INSTR_GET_STATS)
+                            socket.recv_raw(transaction->writeback_data_, transaction->writeback_size_);
+                        if (instr == IO_INSTR_ADDR_ERROR)
+                            transaction->rejected_ = true;
+                        else if (instr == IO_INSTR_CHECKSUM_ERROR)
+                            transaction->corrupt_ = true;
+                        else if (transaction->checksum_)
+                            verify(socket, *transaction);
                         transaction->sig_wake_.release();
                     }
                 } catch (except &e) {
-                    if (e.error_code() == ERROR_SOCKET_CLOSED_BY_REMOTE) {
+                    if (e.error_code() == ERROR_SOCKET_CLOSED_BY_REMOTE || e.error_code() == ERROR_SOCKET_TERMINATED) {
                         if (initiative_shutdown_.load(std::memory_order_acquire))
                             return;
                         // todo warn disconnection
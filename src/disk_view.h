@@ -13,8 +13,11 @@ namespace cs2313 {
         public:
             storage_proxy() = delete;
 
+            // Typed accesses are file system structures (metadata) and overtake raw file data
+
             template<typename T>
             operator T() const {
+                io_priority_scope meta(IO_PRIORITY_META);
                 T temp;
                 disk_.read(addr_, reinterpret_cast<char *>(&temp));
                 return temp;
@@ -22,6 +25,7 @@ namespace cs2313 {
 
             template<typename T>
             storage_proxy &operator=(const T &val) {
+                io_priority_scope meta(IO_PRIORITY_META);
                 disk_.write(addr_, reinterpret_cast<const char *>(&val));
                 return *this;
             }
@@ -47,6 +51,23 @@ namespace cs2313 {
             return {disk_, addr};
         }
 
+        // Raw file data of consecutive blocks, in one request
+        void read_range(const uint64_t addr, const uint64_t blocks, char *data) const {
+            disk_.read_range(addr, blocks, data);
+        }
+
+        void write_range(const uint64_t addr, const uint64_t blocks, const char *data) const {
+            disk_.write_range(addr, blocks, data);
+        }
+
+        void discard(const uint64_t addr, const uint64_t blocks) const {
+            disk_.discard(addr, blocks);
+        }
+
+        void flush() const {
+            disk_.flush(0, 0);
+        }
+
     private:
         storage_interface &disk_;
     };
@@ -0,0 +1,355 @@
+#ifndef DRIVE_BACKEND_H
+#define DRIVE_BACKEND_H
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "utils/except.h"
+
+namespace cs2313 {
+
+    enum drive_io_backend {
+        DRIVE_BACKEND_MMAP,
+        DRIVE_BACKEND_PREAD,
+        DRIVE_BACKEND_URING
+    };
+
+    // Transaction buffers are aligned so that they can be handed to O_DIRECT I/O as they are
+    static constexpr size_t DRIVE_DATA_ALIGN = 0x1000;
+
+    inline char *drive_data_alloc(const size_t size) {
+        return static_cast<char *>(::operator new[](size, std::align_val_t(DRIVE_DATA_ALIGN)));
+    }
+
+    inline void drive_data_free(char *data) {
+        if (data)
+            ::operator delete[](data, std::align_val_t(DRIVE_DATA_ALIGN));
+    }
+
+    struct drive_io {
+        bool write_;
+        uint64_t offset_, size_; // in bytes of the image file
+        char *data_;
+    };
+
+    class drive_backend {
+    public:
+        virtual void read(uint64_t offset, uint64_t size, char *data) = 0;
+
+        virtual void write(uint64_t offset, uint64_t size, const char *data) = 0;
+
+        // Serves a batch picked by the scheduler; the effect is the same as running it in order
+        virtual void transfer(const std::vector<drive_io> &batch) {
+            for (auto &io: batch) {
+                if (io.write_)
+                    write(io.offset_, io.size_, io.data_);
+                else
+                    read(io.offset_, io.size_, io.data_);
+            }
+        }
+
+        // Makes everything written to the range so far durable
+        virtual void flush(uint64_t offset, uint64_t size) = 0;
+
+        // Direct view of the whole image, or nullptr if the backend does not map it
+        virtual char *mapped() { return nullptr; }
+
+        virtual ~drive_backend() = default;
+    };
+
+    class mmap_drive_backend : public drive_backend {
+    public:
+        mmap_drive_backend(const int fd, const uint64_t size) : size_(size) {
+            data_ = static_cast<char *>(mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+            if (data_ == MAP_FAILED)
+                throw except(errno, ERROR_VIRTUAL_DRIVE_MMAP, "Failed to map virtual drive file to memory");
+        }
+
+        void read(const uint64_t offset, const uint64_t size, char *data) override {
+            memcpy(data, data_ + offset, size);
+        }
+
+        void write(const uint64_t offset, const uint64_t size, const char *data) override {
+            memcpy(data_ + offset, data, size);
+        }
+
+        void flush(const uint64_t offset, const uint64_t size) override {
+            const uint64_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+            const uint64_t begin = offset & ~page_mask, end = std::min((offset + size + page_mask) & ~page_mask, size_);
+            if (msync(data_ + begin, end - begin, MS_SYNC) != 0)
+                throw except(errno, ERROR_VIRTUAL_DRIVE_IO, "Virtual drive file sync failed");
+        }
+
+        char *mapped() override { return data_; }
+
+        ~mmap_drive_backend() override {
+            munmap(data_, size_);
+        }
+
+    private:
+        char *data_;
+        uint64_t size_;
+    };
+
+    class pread_drive_backend : public drive_backend {
+    public:
+        explicit pread_drive_backend(const int fd) : fd_(fd) {}
+
+        void read(const uint64_t offset, const uint64_t size, char *data) override {
+            pread_all(fd_, offset, size, data);
+        }
+
+        void write(const uint64_t offset, const uint64_t size, const char *data) override {
+            pwrite_all(fd_, offset, size, data);
+        }
+
+        void flush(const uint64_t, const uint64_t) override { // fdatasync covers the whole file
+            datasync(fd_);
+        }
+
+        static void datasync(const int fd) {
+            while (fdatasync(fd) != 0)
+                if (errno != EINTR)
+                    throw except(errno, ERROR_VIRTUAL_DRIVE_IO, "Virtual drive file sync failed");
+        }
+
+        static void pread_all(const int fd, const uint64_t offset, const uint64_t size, char *data) {
+            uint64_t done = 0;
+            while (done < size) {
+                ssize_t ret = pread(fd, data + done, size - done, static_cast<off_t>(offset + done));
+                if (ret < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    throw except(errno, ERROR_VIRTUAL_DRIVE_IO, "Virtual drive file read failed");
+                }
+                if (ret == 0) { // beyond the end of a file that has not grown yet
+                    memset(data + done, 0, size - done);
+                    return;
+                }
+                done += ret;
+            }
+        }
+
+        static void pwrite_all(const int fd, const uint64_t offset, const uint64_t size, const char *data) {
+            uint64_t done = 0;
+            while (done < size) {
+                ssize_t ret = pwrite(fd, data + done, size - done, static_cast<off_t>(offset + done));
+                if (ret < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    throw except(errno, ERROR_VIRTUAL_DRIVE_IO, "Virtual drive file write failed");
+                }
+                done += ret;
+            }
+        }
+
+    private:
+        int fd_;
+    };
+
+    // io_uring through the raw syscalls (no liburing dependency). A batch is submitted with a single
+    // io_uring_enter; sector-sized transfers go through registered bounce slots, larger ones use the
+    // (aligned) transaction buffers directly. The file is reopened with O_DIRECT when sectors are
+    // large enough to satisfy its alignment, bypassing the page cache entirely.
+    class uring_drive_backend : public drive_backend {
+    public:
+        uring_drive_backend(const int fd, const char *path, const uint64_t bytes_per_sector) :
+            fd_(fd),
+            direct_fd_(-1),
+            slot_size_(std::max<uint64_t>(bytes_per_sector, DRIVE_DATA_ALIGN)),
+            registered_(false) {
+
+            if (bytes_per_sector % DRIVE_DATA_ALIGN == 0) {
+                direct_fd_ = open(path, O_RDWR | O_DIRECT);
+                if (direct_fd_ >= 0)
+                    fd_ = direct_fd_; // otherwise (e.g. tmpfs) stay buffered
+            }
+
+            io_uring_params params{};
+            ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params));
+            if (ring_fd_ < 0) {
+                int err = errno;
+                if (direct_fd_ >= 0)
+                    close(direct_fd_);
+                throw except(err, ERROR_VIRTUAL_DRIVE_BACKEND, "Failed to set up io_uring");
+            }
+            entries_ = params.sq_entries;
+
+            sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap)
+                sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+            sq_ring_ = static_cast<char *>(mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                ring_fd_, IORING_OFF_SQ_RING));
+            cq_ring_ = single_mmap
+                           ? sq_ring_
+                           : static_cast<char *>(mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                      ring_fd_, IORING_OFF_CQ_RING));
+            sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+            sqes_ = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                     ring_fd_, IORING_OFF_SQES));
+            if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+                int err = errno;
+                close(ring_fd_);
+                if (direct_fd_ >= 0)
+                    close(direct_fd_);
+                throw except(err, ERROR_VIRTUAL_DRIVE_BACKEND, "Failed to map io_uring queues");
+            }
+
+            sq_tail_ = reinterpret_cast<unsigned *>(sq_ring_ + params.sq_off.tail);
+            sq_mask_ = *reinterpret_cast<unsigned *>(sq_ring_ + params.sq_off.ring_mask);
+            sq_array_ = reinterpret_cast<unsigned *>(sq_ring_ + params.sq_off.array);
+            cq_head_ = reinterpret_cast<unsigned *>(cq_ring_ + params.cq_off.head);
+            cq_tail_ = reinterpret_cast<unsigned *>(cq_ring_ + params.cq_off.tail);
+            cq_mask_ = *reinterpret_cast<unsigned *>(cq_ring_ + params.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe *>(cq_ring_ + params.cq_off.cqes);
+
+            slots_ = drive_data_alloc(slot_size_ * entries_);
+            std::vector<iovec> iov(entries_);
+            for (unsigned i = 0; i < entries_; ++i)
+                iov[i] = {slots_ + i * slot_size_, slot_size_};
+            registered_ = syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, iov.data(), entries_) == 0;
+        }
+
+        void read(const uint64_t offset, const uint64_t size, char *data) override {
+            transfer({{false, offset, size, data}});
+        }
+
+        void write(const uint64_t offset, const uint64_t size, const char *data) override {
+            transfer({{true, offset, size, const_cast<char *>(data)}});
+        }
+
+        void flush(const uint64_t, const uint64_t) override { // fdatasync covers the whole file
+            pread_drive_backend::datasync(fd_);
+        }
+
+        void transfer(const std::vector<drive_io> &batch) override {
+            // Requests in one submission run concurrently, so a chunk is cut short
+            // whenever a request would conflict with a write already in it
+            size_t begin = 0;
+            while (begin < batch.size()) {
+                size_t end = begin + 1;
+                while (end < batch.size() && end - begin < entries_ && !conflicts(batch, begin, end))
+                    ++end;
+                submit(batch, begin, end);
+                begin = end;
+            }
+        }
+
+        ~uring_drive_backend() override {
+            drive_data_free(slots_);
+            munmap(sqes_, sqes_size_);
+            if (cq_ring_ != sq_ring_)
+                munmap(cq_ring_, cq_ring_size_);
+            munmap(sq_ring_, sq_ring_size_);
+            close(ring_fd_);
+            if (direct_fd_ >= 0)
+                close(direct_fd_);
+        }
+
+    private:
+        static constexpr unsigned QUEUE_DEPTH = 64;
+
+        int fd_, direct_fd_, ring_fd_;
+        unsigned entries_;
+        uint64_t slot_size_;
+        char *slots_;
+        bool registered_;
+
+        char *sq_ring_, *cq_ring_;
+        size_t sq_ring_size_, cq_ring_size_, sqes_size_;
+        io_uring_sqe *sqes_;
+        unsigned *sq_tail_, *sq_array_, sq_mask_;
+        unsigned *cq_head_, *cq_tail_, cq_mask_;
+        io_uring_cqe *cqes_;
+
+        static bool conflicts(const std::vector<drive_io> &batch, const size_t begin, const size_t index) {
+            const drive_io &io = batch[index];
+            for (size_t i = begin; i < index; ++i)
+                if ((io.write_ || batch[i].write_)
+                    && batch[i].offset_ < io.offset_ + io.size_ && io.offset_ < batch[i].offset_ + batch[i].size_)
+                    return true;
+            return false;
+        }
+
+        bool use_slot(const drive_io &io) const { return registered_ && io.size_ <= slot_size_; }
+
+        void submit(const std::vector<drive_io> &batch, const size_t begin, const size_t end) {
+            unsigned count = end - begin;
+            unsigned tail = *sq_tail_;
+            for (size_t i = begin; i < end; ++i) {
+                const drive_io &io = batch[i];
+                unsigned index = tail & sq_mask_;
+                io_uring_sqe *sqe = &sqes_[index];
+                memset(sqe, 0, sizeof(io_uring_sqe));
+                sqe->fd = fd_;
+                sqe->off = io.offset_;
+                sqe->len = io.size_;
+                sqe->user_data = i;
+                if (use_slot(io)) {
+                    char *slot = slots_ + (i - begin) * slot_size_;
+                    if (io.write_)
+                        memcpy(slot, io.data_, io.size_);
+                    sqe->opcode = io.write_ ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+                    sqe->addr = reinterpret_cast<uint64_t>(slot);
+                    sqe->buf_index = i - begin;
+                } else {
+                    sqe->opcode = io.write_ ? IORING_OP_WRITE : IORING_OP_READ;
+                    sqe->addr = reinterpret_cast<uint64_t>(io.data_);
+                }
+                sq_array_[index] = index;
+                ++tail;
+            }
+            __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+            unsigned submitted = 0, completed = 0;
+            while (completed < count) {
+                int ret = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd_, count - submitted, count - completed,
+                                                   IORING_ENTER_GETEVENTS, nullptr, 0));
+                if (ret < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    throw except(errno, ERROR_VIRTUAL_DRIVE_IO, "io_uring submission failed");
+                }
+                submitted += ret;
+
+                unsigned head = *cq_head_;
+                while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+                    const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+                    complete(batch[cqe.user_data], cqe.res, cqe.user_data - begin);
+                    ++head;
+                    ++completed;
+                }
+                __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            }
+        }
+
+        void complete(const drive_io &io, const int res, const size_t slot_index) {
+            if (res < 0)
+                throw except(-res, ERROR_VIRTUAL_DRIVE_IO, "Virtual drive file I/O failed");
+            const uint64_t done = res;
+            if (io.write_) {
+                if (done < io.size_) // short write, finish it synchronously
+                    pread_drive_backend::pwrite_all(fd_, io.offset_ + done, io.size_ - done, io.data_ + done);
+            } else {
+                if (use_slot(io))
+                    memcpy(io.data_, slots_ + slot_index * slot_size_, std::min(done, io.size_));
+                if (done < io.size_)
+                    pread_drive_backend::pread_all(fd_, io.offset_ + done, io.size_ - done, io.data_ + done);
+            }
+        }
+    };
+
+}
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef DRIVE_CACHE_H
+#define DRIVE_CACHE_H
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+namespace cs2313 {
+
+    enum drive_sector_state : uint8_t {
+        DRIVE_SECTOR_INVALID,
+        DRIVE_SECTOR_CLEAN,
+        DRIVE_SECTOR_DIRTY // buffered write, not on the media yet
+    };
+
+    struct drive_track {
+        uint64_t cylinder_;
+        std::vector<uint8_t> state_;
+        std::vector<char> data_; // empty if the cache only models timing
+        uint64_t dirty_;
+    };
+
+    // On-drive buffer of whole tracks (one per cylinder), kept in LRU order. Writes may be buffered in
+    // it up to write_buffer_sectors; tracks holding buffered writes are never evicted, they have to be
+    // destaged first. With hold_data off only the sector states are kept, for the latency model
+    class drive_track_cache {
+    public:
+        drive_track_cache(const uint64_t tracks, const uint64_t write_buffer_sectors,
+                          const uint64_t sectors_per_track, const uint64_t bytes_per_sector, const bool hold_data) :
+            tracks_(tracks),
+            write_buffer_sectors_(write_buffer_sectors),
+            sectors_per_track_(sectors_per_track),
+            bytes_per_sector_(bytes_per_sector),
+            hold_data_(hold_data),
+            dirty_(0) {}
+
+        bool enabled() const { return tracks_ != 0; }
+
+        bool buffering() const { return tracks_ != 0 && write_buffer_sectors_ != 0; }
+
+        uint64_t dirty() const { return dirty_; }
+
+        bool contains(const uint64_t cylinder, const uint64_t sector, const uint64_t sectors) {
+            drive_track *track = find(cylinder);
+            if (!track)
+                return false;
+            for (uint64_t i = sector; i < sector + sectors; ++i)
+                if (track->state_[i] == DRIVE_SECTOR_INVALID)
+                    return false;
+            return true;
+        }
+
+        // Only for sectors known to be cached
+        void read(const uint64_t cylinder, const uint64_t sector, const uint64_t sectors, char *data) {
+            drive_track *track = find(cylinder);
+            if (hold_data_)
+                memcpy(data, track->data_.data() + sector * bytes_per_sector_, sectors * bytes_per_sector_);
+        }
+
+        // Caches a track just read from the media; sectors with buffered writes are newer and kept
+        void fill(const uint64_t cylinder, const char *data) {
+            drive_track *track = find_or_insert(cylinder);
+            if (!track)
+                return;
+            for (uint64_t i = 0; i < sectors_per_track_; ++i) {
+                if (track->state_[i] == DRIVE_SECTOR_DIRTY)
+                    continue;
+                track->state_[i] = DRIVE_SECTOR_CLEAN;
+                if (hold_data_)
+                    memcpy(track->data_.data() + i * bytes_per_sector_, data + i * bytes_per_sector_, bytes_per_sector_);
+            }
+        }
+
+        // Buffers a write; false if the write buffer has no room for it
+        bool write(const uint64_t cylinder, const uint64_t sector, const uint64_t sectors, const char *data) {
+            if (!buffering() || dirty_ + sectors > write_buffer_sectors_)
+                return false;
+            drive_track *track = find_or_insert(cylinder);
+            if (!track)
+                return false;
+            for (uint64_t i = sector; i < sector + sectors; ++i) {
+                if (track->state_[i] != DRIVE_SECTOR_DIRTY) {
+                    track->state_[i] = DRIVE_SECTOR_DIRTY;
+                    ++track->dirty_;
+                    ++dirty_;
+                }
+            }
+            if (hold_data_)
+                memcpy(track->data_.data() + sector * bytes_per_sector_, data, sectors * bytes_per_sector_);
+            return true;
+        }
+
+        // A write that went straight to the media: the cached copy, if any, is brought up to date
+        void update(const uint64_t cylinder, const uint64_t sector, const uint64_t sectors, const char *data) {
+            drive_track *track = find(cylinder);
+            if (!track)
+                return;
+            set_state(*track, sector, sectors, DRIVE_SECTOR_CLEAN);
+            if (hold_data_)
+                memcpy(track->data_.data() + sector * bytes_per_sector_, data, sectors * bytes_per_sector_);
+        }
+
+        // Drops the sectors, buffered writes included (TRIM, or a write around the cache)
+        void invalidate(const uint64_t cylinder, const uint64_t sector, const uint64_t sectors) {
+            drive_track *track = find(cylinder);
+            if (track)
+                set_state(*track, sector, sectors, DRIVE_SECTOR_INVALID);
+        }
+
+        // Calls f(cylinder, sector, sectors, data) for every run of buffered writes, in cylinder order
+        // (or of the given cylinder only), then marks them clean. data is nullptr without hold_data
+        template<typename F>
+        void destage(F f, const uint64_t only_cylinder = UINT64_MAX) {
+            if (!dirty_)
+                return;
+            std::vector<drive_track *> tracks;
+            for (auto &track: lru_)
+                if (track.dirty_ && (only_cylinder == UINT64_MAX || track.cylinder_ == only_cylinder))
+                    tracks.push_back(&track);
+            std::ranges::sort(tracks, {}, &drive_track::cylinder_);
+            for (drive_track *track: tracks) {
+                for (uint64_t i = 0; i < sectors_per_track_;) {
+                    if (track->state_[i] != DRIVE_SECTOR_DIRTY) {
+                        ++i;
+                        continue;
+                    }
+                    uint64_t end = i;
+                    while (end < sectors_per_track_ && track->state_[end] == DRIVE_SECTOR_DIRTY)
+                        ++end;
+                    f(track->cylinder_, i, end - i, hold_data_ ? track->data_.data() + i * bytes_per_sector_ : nullptr);
+                    set_state(*track, i, end - i, DRIVE_SECTOR_CLEAN);
+                    i = end;
+                }
+            }
+        }
+
+    private:
+        uint64_t tracks_;
+        uint64_t write_buffer_sectors_;
+        uint64_t sectors_per_track_;
+        uint64_t bytes_per_sector_;
+        bool hold_data_;
+        uint64_t dirty_;
+
+        std::list<drive_track> lru_; // most recently used first
+        std::unordered_map<uint64_t, std::list<drive_track>::iterator> index_;
+
+        void set_state(drive_track &track, const uint64_t sector, const uint64_t sectors, const drive_sector_state state) {
+            for (uint64_t i = sector; i < sector + sectors; ++i) {
+                if (track.state_[i] == DRIVE_SECTOR_DIRTY) {
+                    --track.dirty_;
+                    --dirty_;
+                }
+                track.state_[i] = state;
+            }
+        }
+
+        drive_track *find(const uint64_t cylinder) {
+            auto it = index_.find(cylinder);
+            if (it == index_.end())
+                return nullptr;
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return &*it->second;
+        }
+
+        drive_track *find_or_insert(const uint64_t cylinder) {
+            if (drive_track *track = find(cylinder))
+                return track;
+            if (lru_.size() >= tracks_) {
+                auto victim = std::find_if(lru_.rbegin(), lru_.rend(), [](const drive_track &t) { return t.dirty_ == 0; });
+                if (victim == lru_.rend())
+                    return nullptr; // every track holds buffered writes
+                index_.erase(victim->cylinder_);
+                lru_.erase(std::next(victim).base());
+            }
+            lru_.push_front({cylinder, std::vector<uint8_t>(sectors_per_track_, DRIVE_SECTOR_INVALID),
+                             std::vector<char>(hold_data_ ? sectors_per_track_ * bytes_per_sector_ : 0), 0});
+            index_[cylinder] = lru_.begin();
+            return &lru_.front();
+        }
+    };
+
+}
+
+#endif
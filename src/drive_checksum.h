@@ -0,0 +1,130 @@
+#ifndef DRIVE_CHECKSUM_H
+#define DRIVE_CHECKSUM_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils/crc32c.h"
+#include "utils/except.h"
+
+namespace cs2313 {
+
+    // CRC-32C of every sector as of the last acknowledged write, kept in a mapped file next to the
+    // image (path + ".crc"). Reads send the stored value, so the client also catches sectors that
+    // changed on the media. A missing table, or one of another size, is rebuilt from the image
+    class drive_checksum_table {
+    public:
+        drive_checksum_table(const char *image_path, const int image_fd, const uint64_t sectors, const uint64_t bytes_per_sector) :
+            sectors_(sectors),
+            bytes_per_sector_(bytes_per_sector),
+            size_(sectors * sizeof(uint32_t)) {
+            std::vector<char> zeros(bytes_per_sector, 0);
+            zero_checksum_ = crc32c(zeros.data(), bytes_per_sector);
+
+            fd_ = open(path(image_path).c_str(), O_RDWR | O_CREAT, 0666);
+            if (fd_ < 0)
+                throw except(errno, ERROR_VIRTUAL_DRIVE_FILE_CREATE, "Failed to create checksum table");
+            struct stat st;
+            bool valid = fstat(fd_, &st) == 0 && static_cast<uint64_t>(st.st_size) == size_;
+            if (!valid && ftruncate(fd_, static_cast<off_t>(size_)) != 0) {
+                close(fd_);
+                throw except(errno, ERROR_VIRTUAL_DRIVE_FILE_CREATE, "Failed to create checksum table");
+            }
+            void *table = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            if (table == MAP_FAILED) {
+                close(fd_);
+                throw except(errno, ERROR_VIRTUAL_DRIVE_MMAP, "Failed to map checksum table");
+            }
+            table_ = static_cast<uint32_t *>(table);
+            if (!valid) {
+                try {
+                    rebuild(image_fd);
+                } catch (except &) {
+                    munmap(table_, size_);
+                    close(fd_);
+                    throw;
+                }
+            }
+        }
+
+        ~drive_checksum_table() {
+            munmap(table_, size_);
+            close(fd_);
+        }
+
+        drive_checksum_table(const drive_checksum_table &) = delete;
+
+        drive_checksum_table &operator=(const drive_checksum_table &) = delete;
+
+        // The table of an image written without it would be stale
+        static void remove(const char *image_path) {
+            unlink(path(image_path).c_str());
+        }
+
+        const uint32_t *get(const uint64_t addr) const { return table_ + addr; }
+
+        void set(const uint64_t addr, const uint64_t sectors, const uint32_t *checksums) {
+            memcpy(table_ + addr, checksums, sectors * sizeof(uint32_t));
+        }
+
+        void set_zero(const uint64_t addr, const uint64_t sectors) {
+            std::fill(table_ + addr, table_ + addr + sectors, zero_checksum_);
+        }
+
+        uint32_t zero_checksum() const { return zero_checksum_; }
+
+        void sync() {
+            msync(table_, size_, MS_SYNC);
+        }
+
+    private:
+        int fd_;
+        uint32_t *table_;
+        uint64_t sectors_;
+        uint64_t bytes_per_sector_;
+        uint64_t size_;
+        uint32_t zero_checksum_;
+
+        static std::string path(const char *image_path) {
+            return std::string(image_path) + ".crc";
+        }
+
+        // Holes are known to be zeros; only the data regions of the image are read
+        void rebuild(const int image_fd) {
+            set_zero(0, sectors_);
+            const uint64_t image_size = sectors_ * bytes_per_sector_;
+            const uint64_t chunk = std::max<uint64_t>(bytes_per_sector_, 1 << 20);
+            std::vector<char> buffer(chunk);
+            off_t pos = 0;
+            while (static_cast<uint64_t>(pos) < image_size) {
+                off_t data = lseek(image_fd, pos, SEEK_DATA);
+                if (data < 0)
+                    break;
+                off_t hole = lseek(image_fd, data, SEEK_HOLE);
+                if (hole < 0 || static_cast<uint64_t>(hole) > image_size)
+                    hole = static_cast<off_t>(image_size);
+                uint64_t begin = data / bytes_per_sector_ * bytes_per_sector_;
+                uint64_t end = (hole + bytes_per_sector_ - 1) / bytes_per_sector_ * bytes_per_sector_;
+                for (uint64_t offset = begin; offset < end; offset += chunk) {
+                    uint64_t size = std::min(chunk, end - offset);
+                    ssize_t got = pread(image_fd, buffer.data(), size, static_cast<off_t>(offset));
+                    if (got < 0)
+                        throw except(errno, ERROR_VIRTUAL_DRIVE_IO, "Failed to read the image for the checksum table");
+                    memset(buffer.data() + got, 0, size - got);
+                    crc32c_sectors(buffer.data(), size / bytes_per_sector_, bytes_per_sector_, table_ + offset / bytes_per_sector_);
+                }
+                pos = static_cast<off_t>(end);
+            }
+        }
+    };
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef DRIVE_MODEL_H
+#define DRIVE_MODEL_H
+
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+
+namespace cs2313 {
+
+    struct drive_timing {
+        uint64_t seek_settle_ns = 0; // fixed cost of any head movement
+        uint64_t seek_per_cylinder_ns = 0; // coasting phase, grows linearly with the distance
+        uint64_t seek_sqrt_ns = 0; // acceleration phase, grows with the square root of the distance
+        uint64_t rpm = 0; // 0: no rotational latency
+        uint64_t transfer_ns_per_sector = 0;
+        bool virtual_clock = false; // time-stamp completions instead of sleeping
+    };
+
+    // The simulated clock of a drive. In real time mode the head thread actually sleeps for the
+    // service time; in virtual mode the clock is only advanced, so runs are deterministic and fast
+    class drive_clock {
+    public:
+        explicit drive_clock(const bool virtual_clock) :
+            virtual_(virtual_clock),
+            virtual_now_ns_(0),
+            start_(std::chrono::steady_clock::now()) {}
+
+        uint64_t now() const {
+            if (virtual_)
+                return virtual_now_ns_.load(std::memory_order_relaxed);
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+        }
+
+        void advance(const uint64_t ns) {
+            if (virtual_)
+                virtual_now_ns_.fetch_add(ns, std::memory_order_relaxed);
+            else if (ns)
+                std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+        }
+
+    private:
+        bool virtual_;
+        std::atomic<uint64_t> virtual_now_ns_; // read by the receivers to stamp deadlines
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    // Mechanical model of one head sweeping cylinders; each cylinder is taken as a single track
+    class drive_model {
+    public:
+        drive_model(const drive_timing &timing, const uint64_t sectors_per_cylinder) :
+            timing_(timing),
+            sectors_per_cylinder_(sectors_per_cylinder),
+            rotation_ns_(timing.rpm ? 60'000'000'000ULL / timing.rpm : 0) {}
+
+        uint64_t seek_time(const uint64_t cylinders) const {
+            if (!cylinders)
+                return 0;
+            return timing_.seek_settle_ns
+                   + cylinders * timing_.seek_per_cylinder_ns
+                   + static_cast<uint64_t>(std::sqrt(static_cast<double>(cylinders)) * static_cast<double>(timing_.seek_sqrt_ns));
+        }
+
+        // Time until the given sector comes under the head, if the head is on its cylinder at time now
+        uint64_t rotational_latency(const uint64_t now, const uint64_t sector) const {
+            if (!rotation_ns_)
+                return 0;
+            uint64_t target = sector * rotation_ns_ / sectors_per_cylinder_;
+            uint64_t current = now % rotation_ns_;
+            return (target + rotation_ns_ - current) % rotation_ns_;
+        }
+
+        // Rotational wait plus media transfer of a run starting at `sector` of the current cylinder;
+        // every cylinder boundary crossed costs a track-to-track seek
+        uint64_t access_time(const uint64_t now, const uint64_t sector, const uint64_t sectors, const uint64_t cylinders_crossed) const {
+            return rotational_latency(now, sector)
+                   + sectors * timing_.transfer_ns_per_sector
+                   + cylinders_crossed * seek_time(1);
+        }
+
+    private:
+        drive_timing timing_;
+        uint64_t sectors_per_cylinder_;
+        uint64_t rotation_ns_;
+    };
+
+}
+
+#endif
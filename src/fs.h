@@ -1,9 +1,17 @@
 #ifndef FS_H
 #define FS_H
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
+#include <exception>
+#include <map>
 #include <mutex>
+#include <optional>
+#include <set>
+#include <thread>
 
 #include "disk_view.h"
 #include "fs_allocator.h"
@@ -13,6 +21,14 @@ namespace cs2313 {
 
     class fs_handle;
 
+    // In blocks; available leaves out those promised to buffered writes
+    struct fs_stat {
+        uint64_t total_blocks;
+        uint64_t free_blocks;
+        uint64_t available_blocks;
+        uint64_t longest_free_blocks;
+    };
+
     class fs_file_handle;
 
     class fs_folder_handle;
@@ -21,37 +37,120 @@ namespace cs2313 {
     public:
         file_system(storage_interface &disk) :
             disk_(disk),
-            allocator_(disk_, ALLOC_ROOT),
             description_(disk.get_description()),
-            max_blocks_(description_.cylinders * description_.sectors_per_cylinder) {
+            max_blocks_(description_.cylinders * description_.sectors_per_cylinder),
+            allocator_(disk_, ALLOC_ROOT, max_blocks_, description_.sectors_per_cylinder * CYLINDERS_PER_GROUP) {
 
             directory_node file_root = disk_[FILE_ROOT];
             allocator_node alloc_root = disk_[ALLOC_ROOT];
-            if (file_root.magic != 0x0909 || alloc_root.header.magic != 0x0909)
+            if (file_root.magic != 0x0909 || alloc_root.header.magic != 0x0909) {
                 format();
+            } else {
+                allocator_.load();
+                orphan_head_ = file_root.next_orphan();
+                reclaim_pending_ = orphan_head_ != 0;
+            }
+            writeback_thread_ = std::thread(&file_system::writeback_loop, this);
+        }
+
+        ~file_system() {
+            {
+                std::lock_guard<std::mutex> lock(data_mutex_);
+                defrag_stop_ = true;
+            }
+            defrag_cv_.notify_all();
+            if (defrag_thread_.joinable())
+                defrag_thread_.join();
+            {
+                std::lock_guard<std::mutex> lock(data_mutex_);
+                writeback_stop_ = true;
+            }
+            writeback_cv_.notify_all();
+            writeback_thread_.join();
         }
 
         void format() {
             // todo init checksum
             std::lock_guard<std::mutex> lock(data_mutex_);
+            dirty_files_.clear();
+            dirty_bytes_ = reserved_blocks_ = 0;
+            moving_addr_ = 0;
+            defrag_pending_.clear();
+            usage_deltas_.clear();
+            orphan_head_ = 0;
+            reclaim_pending_ = false;
             disk_[FILE_ROOT] = directory_node::default_folder();
             disk_[ALLOC_ROOT] = allocator_node::default_root({RESERVED_BLOCKS, max_blocks_ - RESERVED_BLOCKS});
+            allocator_.reset();
+            disk_.flush();
         }
 
         fs_folder_handle root_folder();
 
+        // From counters kept up to date by every operation, without walking anything
+        fs_stat stat() {
+            std::lock_guard<std::mutex> lock(data_mutex_);
+            uint64_t free = allocator_.free_blocks();
+            return {max_blocks_, free, free - std::min(free, reserved_blocks_), allocator_.max_cont_blocks()};
+        }
+
+        uint32_t defragment(uint64_t blocks_per_second);
+
+        void start_defragment(uint64_t blocks_per_second);
+
     private:
         friend class fs_handle;
         friend class fs_file_handle;
         friend class fs_folder_handle;
 
         static constexpr uint64_t FILE_ROOT = 0, ALLOC_ROOT = 1, USER_ROOT = 2, RESERVED_BLOCKS = 3;
+        static constexpr uint64_t CYLINDERS_PER_GROUP = 16;
         disk_view disk_;
         disk_description description_;
         uint64_t max_blocks_;
         fs_allocator allocator_;
         std::mutex data_mutex_; // todo segmented mutex
 
+        // Delayed allocation: the contents of files written since the last writeback, by node address.
+        // A file gets its blocks only when written back, all at once, so it can have one extent however
+        // many writes it took. The blocks it may take are reserved when written, so writeback has room
+        struct fs_dirty_file {
+            std::string data_;
+            uint64_t reserved_blocks_;
+        };
+
+        static constexpr auto WRITEBACK_INTERVAL = std::chrono::seconds(5);
+        static constexpr uint64_t DIRTY_BYTES_MAX = 1 << 20;
+        std::map<uint64_t, fs_dirty_file> dirty_files_; // in address order, written back in one sweep
+        uint64_t dirty_bytes_ = 0, reserved_blocks_ = 0;
+        std::thread writeback_thread_;
+        std::condition_variable writeback_cv_;
+        bool writeback_stop_ = false;
+
+        // The file the defragmenter is copying, outside data_mutex_; its copy is dropped if it was written
+        // meanwhile. Cleared by format, which takes the destination back
+        static constexpr uint64_t DEFRAG_CHUNK_BLOCKS = 256;
+        uint64_t moving_addr_ = 0;
+        bool moving_changed_ = false;
+
+        // One defragmentation at a time, on defrag_thread_ when started in the background. The files it
+        // has yet to move are dropped from defrag_pending_ when removed, so it never opens a freed node
+        bool defragmenting_ = false, defrag_stop_ = false;
+        std::set<uint64_t> defrag_pending_;
+        std::thread defrag_thread_;
+        std::condition_variable defrag_cv_;
+
+        // Removed nodes whose blocks are yet to be freed, chained from the root folder so that they are
+        // freed after a restart too. The writeback thread frees them a batch at a time
+        static constexpr uint32_t RECLAIM_BATCH_NODES = 64;
+        static constexpr size_t PARALLEL_READERS = 4, PARALLEL_READ_MIN = 16; // nodes per reader at least
+        uint64_t orphan_head_ = 0;
+        bool reclaim_pending_ = false;
+
+        // Changes of the blocks used by files in a folder during an operation, added to it and to the
+        // folders above it on commit
+        std::map<uint64_t, int64_t> usage_deltas_;
+
         std::unordered_map<uint64_t, uint32_t> handle_instance_count_;
         std::mutex count_mutex_;
 
@@ -75,6 +174,418 @@ namespace cs2313 {
             }
         }
 
+        // Ends an operation: the folder usage it changed and the allocator nodes are written back, and
+        // all of it made durable. The blocks it freed are trimmed and reused only then
+        void commit() {
+            apply_usage_i();
+            allocator_.commit();
+            disk_.flush();
+            allocator_.release_freed();
+        }
+
+        void add_usage_i(uint64_t folder_addr, int64_t delta) {
+            if (delta != 0)
+                usage_deltas_[folder_addr] += delta;
+        }
+
+        // Each folder above a changed one is written once. Folders from before usage was counted have
+        // no usage_bit, and are left as they are
+        void apply_usage_i() {
+            if (usage_deltas_.empty())
+                return;
+            std::map<uint64_t, directory_node> folders;
+            std::map<uint64_t, int64_t> totals;
+            for (auto &[addr, delta]: usage_deltas_) {
+                for (uint64_t current = addr;;) {
+                    auto it = folders.find(current);
+                    if (it == folders.end())
+                        it = folders.emplace(current, disk_[current]).first;
+                    totals[current] += delta;
+                    if (current == FILE_ROOT)
+                        break;
+                    current = it->second.header.parent_addr;
+                }
+            }
+            usage_deltas_.clear();
+            for (auto &[addr, delta]: totals) {
+                directory_node &folder = folders[addr];
+                if (!folder.usage_bit() || delta == 0)
+                    continue;
+                folder.size_blocks = std::max<int64_t>(0, int64_t(folder.size_blocks) + delta);
+                disk_[addr] = folder;
+            }
+        }
+
+        // Keeps the contents of a file until writeback; by the caller, under data_mutex_. The blocks
+        // writeback may take are reserved out of the longest free run, so together with those of the
+        // other buffered files they fit in one extent each. Past that the file is written at once, and
+        // the write refused if its node cannot hold the extents it gets
+        void buffer_file_i(uint64_t addr, const char *data) {
+            directory_node node = disk_[addr];
+            uint64_t reserved = writeback_need(node, (strlen(data) + 0xFF) / 0x100);
+            auto it = dirty_files_.find(addr);
+            uint64_t released = it != dirty_files_.end() ? it->second.reserved_blocks_ : 0;
+            if (reserved + reserved_blocks_ - released > allocator_.max_cont_blocks()) {
+                write_file_i(addr, data);
+                if (it != dirty_files_.end())
+                    drop_file_i(it);
+                commit();
+                return;
+            }
+            if (it != dirty_files_.end())
+                drop_file_i(it);
+            dirty_files_[addr] = {data, reserved};
+            dirty_bytes_ += dirty_files_[addr].data_.size();
+            reserved_blocks_ += reserved;
+            if (dirty_bytes_ > DIRTY_BYTES_MAX)
+                writeback_i();
+        }
+
+        // The free blocks write_file_i can take for blocks of data: none if they fit in the file's
+        // preallocated blocks or its single extent, otherwise all of them, as the file may move
+        static uint64_t writeback_need(directory_node &node, uint64_t blocks) {
+            bool preallocated = false;
+            for (uint32_t i = 0; i < node.header.entries; ++i)
+                preallocated |= node.extent(i).unwritten();
+            if (allocated_blocks(node) >= blocks && (preallocated || node.header.entries <= 1))
+                return 0;
+            return blocks;
+        }
+
+        void drop_file_i(std::map<uint64_t, fs_dirty_file>::iterator it) {
+            dirty_bytes_ -= it->second.data_.size();
+            reserved_blocks_ -= it->second.reserved_blocks_;
+            dirty_files_.erase(it);
+        }
+
+        // Gives each buffered file its blocks, writes it, and commits. A file that finds no room, as
+        // when a run its reservation counted on was split, stays buffered for the next writeback
+        void writeback_i() {
+            for (auto it = dirty_files_.begin(); it != dirty_files_.end();) {
+                try {
+                    write_file_i(it->first, it->second.data_);
+                    drop_file_i(it++);
+                } catch (except &e) {
+                    if (e.error_code() != ERROR_FS_CAPACITY_EXCEEDED)
+                        throw;
+                    ++it;
+                }
+            }
+            commit();
+        }
+
+        // The file's blocks become one extent if there is one long enough, near the ones it had or
+        // else its node; then all of its data is written, one request per extent. A file with blocks
+        // still preallocated keeps all of them while they hold the data, the ones past it unwritten
+        void write_file_i(uint64_t addr, const std::string &data) {
+            if (addr == moving_addr_)
+                moving_changed_ = true;
+            directory_node node = disk_[addr];
+            uint64_t new_size = data.size(),
+                     new_blocks = (new_size + 0xFF) / 0x100,
+                     new_offset = ((new_size + 0xFF) & 0xFF) + 1;
+            uint64_t old_blocks = allocated_blocks(node);
+            std::vector<extent_token> old;
+            bool preallocated = false;
+            for (uint32_t i = 0; i < node.header.entries; ++i) {
+                old.push_back({node.extent(i).disk_addr, node.extent(i).blocks()});
+                preallocated |= node.extent(i).unwritten();
+            }
+            uint64_t goal = old.empty() ? addr : old[0].disk_block_no - 1;
+            std::vector<extent_token> extents = preallocated && allocated_blocks(node) >= new_blocks
+                                                    ? old
+                                                    : allocator_.reallocate(old, goal, new_blocks, node.header.entries_capacity);
+
+            node.header.entries = 0;
+            uint64_t file_block_no = 0;
+            for (extent_token &e: extents) {
+                uint64_t written = std::min(e.len, new_blocks - std::min(new_blocks, file_block_no));
+                append_extent(node, e.disk_block_no, written, false);
+                append_extent(node, e.disk_block_no + written, e.len - written, true);
+                file_block_no += e.len;
+            }
+            std::string buf = data;
+            buf.resize(new_blocks * 0x100, 0);
+            for (uint32_t i = 0; i < node.header.entries; ++i) {
+                extent_entry &e = node.extent(i);
+                if (!e.unwritten())
+                    disk_.write_range(e.disk_addr, e.blocks(), buf.data() + e.file_block_no * 0x100);
+            }
+            node.size_blocks = new_blocks;
+            node.size_offset = new_offset;
+            disk_[addr] = node;
+            add_usage_i(node.header.parent_addr, int64_t(allocated_blocks(node)) - int64_t(old_blocks));
+        }
+
+        // Reserves the blocks of a file up to size bytes, in as few extents as there are free runs for
+        // and after its last one, and grows it to size if shorter. The buffered contents are written
+        // first, so the reservation follows them
+        void preallocate_i(uint64_t addr, uint64_t size) {
+            if (addr == moving_addr_)
+                moving_changed_ = true;
+            auto dirty = dirty_files_.find(addr);
+            if (dirty != dirty_files_.end()) {
+                write_file_i(addr, dirty->second.data_);
+                drop_file_i(dirty);
+            }
+            directory_node node = disk_[addr];
+            uint64_t blocks = (size + 0xFF) / 0x100, allocated = allocated_blocks(node);
+            if (blocks > allocated) {
+                // an entry is left for splitting an extent between the data and the blocks past it
+                if (blocks - allocated + reserved_blocks_ > allocator_.free_blocks()
+                    || node.header.entries + 1 >= node.header.entries_capacity)
+                    throw except(ERROR_FS_CAPACITY_EXCEEDED);
+                uint64_t goal = addr;
+                if (node.header.entries > 0) {
+                    extent_entry &last = node.extent(node.header.entries - 1);
+                    goal = last.disk_addr + last.blocks() - 1;
+                }
+                size_t max_extents = node.header.entries_capacity - node.header.entries - 1;
+                for (extent_token &e: allocator_.reallocate({}, goal, blocks - allocated, max_extents))
+                    append_extent(node, e.disk_block_no, e.len, true);
+                add_usage_i(node.header.parent_addr, blocks - allocated);
+            }
+            uint64_t old_size = node.size_blocks ? (node.size_blocks - 1) * 0x100 + node.size_offset : 0;
+            if (size > old_size) {
+                node.size_blocks = blocks;
+                node.size_offset = ((size + 0xFF) & 0xFF) + 1;
+            }
+            disk_[addr] = node;
+        }
+
+        // The files under a folder whose extents do not follow each other on the disk, with the
+        // cylinders crossed going from one to the next. Buffered files are left to their writeback
+        void scan_fragmented_i(uint64_t folder_addr, std::vector<std::pair<uint64_t, uint64_t>> &files) {
+            directory_node folder = disk_[folder_addr];
+            for (uint32_t i = 0; i < folder.header.entries; ++i) {
+                uint64_t addr = folder.file_pointer(i);
+                directory_node node = disk_[addr];
+                if (node.folder_bit()) {
+                    scan_fragmented_i(addr, files);
+                    continue;
+                }
+                if (dirty_files_.contains(addr))
+                    continue;
+                uint64_t cost = fragment_cost(node);
+                if (cost > 0)
+                    files.emplace_back(cost, addr);
+            }
+        }
+
+        // The cylinders crossed reading a file from one extent to the next, 0 if it is not
+        // fragmented. Files with an extent tree are not moved
+        uint64_t fragment_cost(directory_node &node) const {
+            if (node.header.tree_depth > 0)
+                return 0;
+            uint64_t cost = 0;
+            for (uint32_t j = 1; j < node.header.entries; ++j) {
+                uint64_t end = node.extent(j - 1).disk_addr + node.extent(j - 1).blocks(), start = node.extent(j).disk_addr;
+                if (start != end)
+                    cost += 1 + (std::max(start, end) - std::min(start, end)) / description_.sectors_per_cylinder;
+            }
+            return cost;
+        }
+
+        // Copies the written blocks of a file to dest, gathering up to DEFRAG_CHUNK_BLOCKS from its
+        // extents into each write, and keeps to blocks_per_second over the blocks read and written.
+        // False if the destructor stopped it first
+        bool copy_file(const std::vector<extent_entry> &extents, uint64_t dest, uint64_t blocks_per_second) {
+            auto start = std::chrono::steady_clock::now();
+            uint64_t io_blocks = 0, pending = 0, pending_at = 0;
+            bool stopped = false;
+            std::string buf(DEFRAG_CHUNK_BLOCKS * 0x100, 0);
+            auto write_pending = [&] {
+                if (pending == 0)
+                    return;
+                disk_.write_range(dest + pending_at, pending, buf.data());
+                io_blocks += 2 * pending;
+                pending = 0;
+                if (blocks_per_second) {
+                    std::unique_lock<std::mutex> lock(data_mutex_);
+                    auto until = start + std::chrono::microseconds(io_blocks * 1000000 / blocks_per_second);
+                    stopped = defrag_cv_.wait_until(lock, until, [this] { return defrag_stop_; });
+                }
+            };
+            for (const extent_entry &e: extents) {
+                if (e.unwritten())
+                    continue;
+                for (uint64_t offset = 0; offset < e.blocks();) {
+                    if (pending_at + pending != e.file_block_no + offset || pending == DEFRAG_CHUNK_BLOCKS)
+                        write_pending();
+                    if (stopped)
+                        return false;
+                    if (pending == 0)
+                        pending_at = e.file_block_no + offset;
+                    uint64_t n = std::min(e.blocks() - offset, DEFRAG_CHUNK_BLOCKS - pending);
+                    disk_.read_range(e.disk_addr + offset, n, buf.data() + pending * 0x100);
+                    pending += n;
+                    offset += n;
+                }
+            }
+            write_pending();
+            disk_.flush();
+            return !stopped;
+        }
+
+        void claim_defrag_i() {
+            if (defragmenting_)
+                throw except(ERROR_FS_DEFRAG_RUNNING);
+            defragmenting_ = true;
+        }
+
+        // The body of a claimed run, which it hands back when over
+        uint32_t run_defrag(uint64_t blocks_per_second);
+
+        // Moves one of the files the scan found, unless it was removed or written since; true if moved
+        bool move_fragmented(uint64_t addr, uint64_t blocks_per_second);
+
+        // Nodes read by up to PARALLEL_READERS threads, for walks over many of them
+        std::vector<directory_node> read_nodes(const std::vector<uint64_t> &addrs) {
+            std::vector<directory_node> ret(addrs.size());
+            size_t readers = std::min<size_t>(PARALLEL_READERS, (addrs.size() + PARALLEL_READ_MIN - 1) / PARALLEL_READ_MIN);
+            std::vector<std::exception_ptr> errors(readers);
+            auto read_some = [&](size_t first) {
+                try {
+                    for (size_t i = first; i < addrs.size(); i += readers)
+                        ret[i] = disk_[addrs[i]];
+                } catch (...) {
+                    errors[first] = std::current_exception();
+                }
+            };
+            std::vector<std::thread> threads;
+            for (size_t r = 1; r < readers; ++r)
+                threads.emplace_back(read_some, r);
+            read_some(0);
+            for (std::thread &t: threads)
+                t.join();
+            for (std::exception_ptr &e: errors)
+                if (e)
+                    std::rethrow_exception(e);
+            return ret;
+        }
+
+        static uint64_t allocated_blocks(directory_node &node) {
+            uint64_t ret = 0;
+            for (uint32_t i = 0; i < node.header.entries; ++i)
+                ret += node.extent(i).blocks();
+            return ret;
+        }
+
+        // Adds len blocks from disk_addr to the end of a file, into its last extent if they follow it on
+        // the disk and are in the same state
+        static void append_extent(directory_node &node, uint64_t disk_addr, uint64_t len, bool unwritten) {
+            if (len == 0)
+                return;
+            uint32_t file_block_no = 0;
+            if (node.header.entries > 0) {
+                extent_entry &last = node.extent(node.header.entries - 1);
+                if (last.unwritten() == unwritten && last.disk_addr + last.blocks() == disk_addr) {
+                    last.len += len;
+                    return;
+                }
+                file_block_no = last.file_block_no + last.blocks();
+            }
+            if (node.header.entries == node.header.entries_capacity)
+                throw except(ERROR_FS_CAPACITY_EXCEEDED);
+            uint32_t flags = unwritten ? EXTENT_UNWRITTEN : 0;
+            node.extent(node.header.entries++) = {disk_addr, file_block_no, static_cast<uint32_t>(len) | flags};
+        }
+
+        // Chains a removed node, whose copy is given, to the orphans; the root folder is updated by
+        // write_orphan_head_i
+        void push_orphan_i(uint64_t addr, directory_node &node) {
+            defrag_pending_.erase(addr);
+            node.next_orphan() = orphan_head_;
+            disk_[addr] = node;
+            orphan_head_ = addr;
+        }
+
+        void write_orphan_head_i() {
+            directory_node root = disk_[FILE_ROOT];
+            root.next_orphan() = orphan_head_;
+            disk_[FILE_ROOT] = root;
+        }
+
+        // Frees an intermediate node of a file's extent tree, with the nodes and extents below it
+        void free_extent_tree_i(uint64_t addr) {
+            intermediate_node node = disk_[addr];
+            for (uint32_t i = 0; i < node.header.entries; ++i) {
+                if (node.header.tree_depth > 0)
+                    free_extent_tree_i(node.extent_index(i).node_addr);
+                else
+                    allocator_.delete_extent({node.extent(i).disk_addr, node.extent(i).blocks()});
+            }
+            allocator_.delete_block(addr);
+        }
+
+        // Frees the blocks of up to RECLAIM_BATCH_NODES removed nodes, in one commit; the children of
+        // a folder are chained in turn. A node still open stays first until the next writeback
+        void reclaim_i() {
+            for (uint32_t i = 0; i < RECLAIM_BATCH_NODES && orphan_head_; ++i) {
+                uint64_t addr = orphan_head_;
+                {
+                    std::lock_guard<std::mutex> count_lock(count_mutex_);
+                    if (handle_instance_count_.contains(addr)) {
+                        reclaim_pending_ = false;
+                        break;
+                    }
+                }
+                directory_node node = disk_[addr];
+                orphan_head_ = node.next_orphan();
+                if (node.folder_bit()) {
+                    for (uint32_t j = 0; j < node.header.entries; ++j) {
+                        directory_node child = disk_[node.file_pointer(j)];
+                        push_orphan_i(node.file_pointer(j), child);
+                    }
+                } else {
+                    auto dirty = dirty_files_.find(addr);
+                    if (dirty != dirty_files_.end())
+                        drop_file_i(dirty);
+                    for (uint32_t j = 0; j < node.header.entries; ++j) {
+                        if (node.header.tree_depth > 0)
+                            free_extent_tree_i(node.extent_index(j).node_addr);
+                        else
+                            allocator_.delete_extent({node.extent(j).disk_addr, node.extent(j).blocks()});
+                    }
+                }
+                allocator_.delete_block(addr);
+            }
+            if (!orphan_head_)
+                reclaim_pending_ = false;
+            write_orphan_head_i();
+            commit();
+        }
+
+        // Frees removed nodes as soon as they are queued, letting other operations in between batches,
+        // and writes buffered files back every WRITEBACK_INTERVAL
+        void writeback_loop() {
+            std::unique_lock<std::mutex> lock(data_mutex_);
+            auto next_writeback = std::chrono::steady_clock::now() + WRITEBACK_INTERVAL;
+            while (true) {
+                writeback_cv_.wait_until(lock, next_writeback, [this] { return writeback_stop_ || reclaim_pending_; });
+                bool stop = writeback_stop_;
+                try {
+                    if (orphan_head_)
+                        reclaim_i();
+                    if (stop || std::chrono::steady_clock::now() >= next_writeback) {
+                        next_writeback = std::chrono::steady_clock::now() + WRITEBACK_INTERVAL;
+                        if (!dirty_files_.empty())
+                            writeback_i();
+                    }
+                } catch (except &) {
+                    // retried at the next interval; on the way out, the disk is gone
+                    reclaim_pending_ = false;
+                }
+                if (stop)
+                    return;
+                if (reclaim_pending_) {
+                    lock.unlock();
+                    std::this_thread::yield();
+                    lock.lock();
+                }
+            }
+        }
+
         static bool is_name_valid(const std::string &name) {
             return !name.empty()
                    && name != "."
@@ -148,42 +659,35 @@ namespace cs2313 {
 
         std::string read_all() {
             std::lock_guard<std::mutex> lock(fs_.data_mutex_);
+            auto dirty = fs_.dirty_files_.find(addr_);
+            if (dirty != fs_.dirty_files_.end())
+                return dirty->second.data_;
             directory_node node = fs_.disk_[addr_];
             if (!node.size_blocks)
                 return "";
-            std::string ret;
+            std::string ret(node.size_blocks * 0x100, 0);
+            for (uint32_t i = 0; i < node.header.entries && node.extent(i).file_block_no < node.size_blocks; ++i) {
+                extent_entry &e = node.extent(i);
+                if (!e.unwritten()) // preallocated blocks are zeros, without reading them
+                    fs_.disk_.read_range(e.disk_addr, std::min<uint64_t>(e.blocks(), node.size_blocks - e.file_block_no),
+                                         ret.data() + e.file_block_no * 0x100);
+            }
             ret.resize((node.size_blocks - 1) * 0x100 + node.size_offset);
-            // assert size_blocks <= header.entries
-            // todo len > 1
-            for (uint32_t i = 0; i < node.header.entries - 1; ++i)
-                fs_.disk_[node.extent(i).disk_addr].read_raw(ret.data() + i * 0x100);
-            char buf[256];
-            fs_.disk_[node.extent(node.header.entries - 1).disk_addr].read_raw(buf);
-            memcpy(ret.data() + (node.header.entries - 1) * 0x100, buf, node.size_offset);
             return ret;
         }
 
+        // Buffered; the blocks are allocated and written by the next writeback
         void write_all(const char *data) {
             std::lock_guard<std::mutex> lock(fs_.data_mutex_);
-            directory_node node = fs_.disk_[addr_];
-            uint64_t new_size = strlen(data),
-                     new_blocks = (new_size + 0xFF) / 0x100,
-                     new_offset = ((new_size + 0xFF) & 0xFF) + 1;
-            if (new_blocks > node.header.entries)
-                for (uint32_t i = node.header.entries; i < new_blocks; ++i) {
-                    node.extent(i).disk_addr = fs_.allocator_.new_block();
-                    node.extent(i).len = 1; // todo allocate extents
-                }
-            node.header.entries = new_blocks;
-            node.size_blocks = new_blocks;
-            node.size_offset = new_offset;
+            fs_.buffer_file_i(addr_, data);
+        }
 
-            for (uint32_t i = 0; i < node.header.entries - 1; ++i)
-                fs_.disk_[node.extent(i).disk_addr].write_raw(data + i * 0x100);
-            char buf[256];
-            memcpy(buf, data + (new_blocks - 1) * 0x100, new_offset);
-            fs_.disk_[node.extent(node.header.entries - 1).disk_addr].write_raw(buf);
-            fs_.disk_[addr_] = node;
+        // Reserves the blocks for size bytes, contiguous where the free space allows, so that writes
+        // up to that size take no more blocks; a shorter file grows to size, reading as zeros
+        void preallocate(uint64_t size) {
+            std::lock_guard<std::mutex> lock(fs_.data_mutex_);
+            fs_.preallocate_i(addr_, size);
+            fs_.commit();
         }
 
         // void insert(uint64_t pos, const char *data) {
@@ -232,7 +736,7 @@ namespace cs2313 {
             directory_node node = fs_.disk_[addr_];
             if (strcmp(folder_name, "..") == 0) {
                 if (addr_ != fs_.FILE_ROOT)
-                    return {fs_, node.parent_addr};
+                    return {fs_, node.header.parent_addr};
                 return *this;
             }
 
@@ -262,45 +766,77 @@ namespace cs2313 {
 
             directory_node new_node = is_folder ? directory_node::default_folder() : directory_node::default_file();
             strcpy(new_node.name, name);
-            new_node.parent_addr = addr_;
-            uint64_t new_addr = fs_.allocator_.new_block();
+            new_node.header.parent_addr = addr_;
+            // a file next to its folder; a folder in a cylinder group of its own
+            uint64_t new_addr = fs_.allocator_.new_block(is_folder ? fs_.allocator_.group_goal() : addr_);
             node.file_pointer(node.header.entries) = new_addr;
             ++node.header.entries;
             fs_.disk_[new_addr] = new_node;
             fs_.disk_[addr_] = node;
+            fs_.commit();
         }
 
+        // A folder must be empty; see remove_recursive
         void remove(const char *name, bool is_folder) {
             std::lock_guard<std::mutex> lock(fs_.data_mutex_);
             directory_node node = fs_.disk_[addr_];
-            uint32_t index = 0;
-            bool found = false;
-            for (uint32_t i = 0; i < node.header.entries; ++i) {
-                directory_node child = fs_.disk_[node.file_pointer(i)];
-                if (child.folder_bit() == is_folder && strcmp(child.name, name) == 0) {
-                    index = i;
-                    found = true;
-                    break;
+            directory_node child;
+            uint32_t index = find_child_i(node, name, is_folder, child);
+            {
+                std::lock_guard<std::mutex> count_lock(fs_.count_mutex_);
+                if (fs_.handle_instance_count_.contains(node.file_pointer(index)))
+                    throw except(ERROR_FS_BUSY_HANDLE);
+            }
+            if (is_folder && child.header.entries > 0)
+                throw except(ERROR_FS_DIRECTORY_NOT_EMPTY);
+            auto dirty = fs_.dirty_files_.find(node.file_pointer(index));
+            if (dirty != fs_.dirty_files_.end())
+                fs_.drop_file_i(dirty);
+            unlink_child_i(node, index, child);
+        }
+
+        // Removes a folder with all under it in one operation, unless something under it is open. The
+        // subtree is read a level at a time, its nodes by several threads at once, and is unlinked
+        // whole, its blocks being freed afterwards by the writeback thread in batches
+        void remove_recursive(const char *name) {
+            std::lock_guard<std::mutex> lock(fs_.data_mutex_);
+            directory_node node = fs_.disk_[addr_];
+            directory_node child;
+            uint32_t index = find_child_i(node, name, true, child);
+
+            std::vector<uint64_t> subtree{node.file_pointer(index)}, level;
+            for (uint32_t i = 0; i < child.header.entries; ++i)
+                level.push_back(child.file_pointer(i));
+            while (!level.empty()) {
+                std::vector<directory_node> nodes = fs_.read_nodes(level);
+                std::vector<uint64_t> next_level;
+                for (size_t i = 0; i < level.size(); ++i) {
+                    subtree.push_back(level[i]);
+                    if (nodes[i].folder_bit())
+                        for (uint32_t j = 0; j < nodes[i].header.entries; ++j)
+                            next_level.push_back(nodes[i].file_pointer(j));
                 }
+                level = std::move(next_level);
             }
-            if (!found)
-                throw except(ERROR_FS_NAME_NOT_EXIST);
-            uint32_t recycle_addr = node.file_pointer(index); //
             {
                 std::lock_guard<std::mutex> count_lock(fs_.count_mutex_);
-                if (fs_.handle_instance_count_.contains(recycle_addr))
-                    throw except(ERROR_FS_BUSY_HANDLE);
+                for (uint64_t addr: subtree)
+                    if (fs_.handle_instance_count_.contains(addr))
+                        throw except(ERROR_FS_BUSY_HANDLE);
+            }
+            for (uint64_t addr: subtree) {
+                auto dirty = fs_.dirty_files_.find(addr);
+                if (dirty != fs_.dirty_files_.end())
+                    fs_.drop_file_i(dirty);
             }
+            unlink_child_i(node, index, child);
+        }
 
-            if (index != node.header.entries - 1)
-                memmove(
-                    node.data + index * sizeof(uint64_t),
-                    node.data + (index + 1) * sizeof(uint64_t),
-                    (node.header.entries - 1 - index) * sizeof(uint64_t) // todo hashed pointer
-                );
-            --node.header.entries;
-            fs_.allocator_.delete_block(recycle_addr);
-            fs_.disk_[addr_] = node;
+        // The blocks of all files under this folder, or UINT64_MAX for one from before they were counted
+        uint64_t usage() {
+            std::lock_guard<std::mutex> lock(fs_.data_mutex_);
+            directory_node node = fs_.disk_[addr_];
+            return node.usage_bit() ? node.size_blocks : UINT64_MAX;
         }
 
         std::vector<std::string> list() {
@@ -317,12 +853,152 @@ namespace cs2313 {
         }
 
     private:
+        uint32_t find_child_i(directory_node &node, const char *name, bool is_folder, directory_node &child) {
+            for (uint32_t i = 0; i < node.header.entries; ++i) {
+                child = fs_.disk_[node.file_pointer(i)];
+                if (child.folder_bit() == is_folder && strcmp(child.name, name) == 0)
+                    return i;
+            }
+            throw except(ERROR_FS_NAME_NOT_EXIST);
+        }
+
+        // Takes the child at index out of this folder and queues it to be freed
+        void unlink_child_i(directory_node &node, uint32_t index, directory_node &child) {
+            uint64_t recycle_addr = node.file_pointer(index);
+            uint64_t usage = !child.folder_bit() ? file_system::allocated_blocks(child) : child.usage_bit() ? child.size_blocks : 0;
+            fs_.add_usage_i(addr_, -int64_t(usage));
+            if (index != node.header.entries - 1)
+                memmove(
+                    node.data + index * sizeof(uint64_t),
+                    node.data + (index + 1) * sizeof(uint64_t),
+                    (node.header.entries - 1 - index) * sizeof(uint64_t) // todo hashed pointer
+                );
+            --node.header.entries;
+            // unlinked first, so that a crash leaves a node leaked rather than freed while linked
+            fs_.disk_[addr_] = node;
+            fs_.push_orphan_i(recycle_addr, child);
+            fs_.write_orphan_head_i();
+            fs_.reclaim_pending_ = true;
+            fs_.commit();
+            fs_.writeback_cv_.notify_all();
+        }
     };
 
     inline fs_folder_handle file_system::root_folder() {
         return {*this, FILE_ROOT};
     }
 
+    // Moves fragmented files into one extent each, those costing the most seeks first. A file is
+    // copied without data_mutex_, so the file system is used meanwhile, at no more than
+    // blocks_per_second (0 for no limit), and its extents are swapped under it if it was not written.
+    // Only the file being copied is held open, so that it cannot be removed. Throws
+    // ERROR_FS_DEFRAG_RUNNING while another run is going on. Returns how many were moved
+    inline uint32_t file_system::defragment(uint64_t blocks_per_second) {
+        {
+            std::lock_guard<std::mutex> lock(data_mutex_);
+            claim_defrag_i();
+        }
+        return run_defrag(blocks_per_second);
+    }
+
+    // As defragment, on a thread of its own that the destructor stops between two chunks
+    inline void file_system::start_defragment(uint64_t blocks_per_second) {
+        std::lock_guard<std::mutex> lock(data_mutex_);
+        claim_defrag_i();
+        if (defrag_thread_.joinable())
+            defrag_thread_.join(); // the last run, done
+        defrag_thread_ = std::thread([this, blocks_per_second] {
+            try {
+                run_defrag(blocks_per_second);
+            } catch (except &) {
+                // the disk is gone; the files moved so far stay moved
+            }
+        });
+    }
+
+    inline uint32_t file_system::run_defrag(uint64_t blocks_per_second) {
+        uint32_t moved = 0;
+        try {
+            std::vector<std::pair<uint64_t, uint64_t>> files;
+            {
+                std::lock_guard<std::mutex> lock(data_mutex_);
+                scan_fragmented_i(FILE_ROOT, files);
+                std::sort(files.begin(), files.end(), std::greater<>());
+                for (auto &[cost, addr]: files)
+                    defrag_pending_.insert(addr);
+            }
+            for (auto &[cost, addr]: files)
+                moved += move_fragmented(addr, blocks_per_second);
+        } catch (except &) {
+            std::lock_guard<std::mutex> lock(data_mutex_);
+            defrag_pending_.clear();
+            defragmenting_ = false;
+            throw;
+        }
+        std::lock_guard<std::mutex> lock(data_mutex_);
+        defrag_pending_.clear();
+        defragmenting_ = false;
+        return moved;
+    }
+
+    inline bool file_system::move_fragmented(uint64_t addr, uint64_t blocks_per_second) {
+        std::optional<fs_file_handle> handle;
+        std::vector<extent_entry> extents;
+        extent_token dest;
+        {
+            std::lock_guard<std::mutex> lock(data_mutex_);
+            if (defrag_stop_ || !defrag_pending_.erase(addr) || dirty_files_.contains(addr))
+                return false; // removed or written since the scan
+            directory_node node = disk_[addr];
+            if (allocated_blocks(node) == 0 || fragment_cost(node) == 0)
+                return false;
+            for (uint32_t i = 0; i < node.header.entries; ++i)
+                extents.push_back(node.extent(i));
+            try {
+                dest = allocator_.reallocate({}, addr, allocated_blocks(node), 1)[0];
+            } catch (except &e) {
+                if (e.error_code() != ERROR_FS_CAPACITY_EXCEEDED)
+                    throw;
+                return false; // no free run long enough
+            }
+            handle.emplace(*this, addr);
+            moving_addr_ = addr;
+            moving_changed_ = false;
+        }
+
+        bool copied;
+        try {
+            copied = copy_file(extents, dest.disk_block_no, blocks_per_second);
+        } catch (except &) {
+            std::lock_guard<std::mutex> lock(data_mutex_);
+            if (moving_addr_ == addr) {
+                moving_addr_ = 0;
+                allocator_.delete_extent(dest);
+                commit();
+            }
+            throw;
+        }
+
+        std::lock_guard<std::mutex> lock(data_mutex_);
+        if (moving_addr_ != addr)
+            return false; // formatted
+        moving_addr_ = 0;
+        if (moving_changed_ || !copied) {
+            allocator_.delete_extent(dest);
+            commit();
+            return false;
+        }
+        directory_node node = disk_[addr];
+        node.header.entries = 0;
+        for (extent_entry &e: extents)
+            append_extent(node, dest.disk_block_no + e.file_block_no, e.blocks(), e.unwritten());
+        disk_[addr] = node;
+        for (extent_entry &e: extents)
+            allocator_.delete_extent({e.disk_addr, e.blocks()});
+        commit();
+        return true;
+    }
+
 }
 
 #endif
@@ -1,59 +1,258 @@
 #ifndef FS_ALLOCATOR_H
 #define FS_ALLOCATOR_H
 
+#include <atomic>
+#include <cstring>
 #include <mutex>
+#include <set>
 #include <unordered_map>
 #include <vector>
+#include <algorithm>
 
 #include "fs_block_structure.h"
 #include "disk_view.h"
+#include "utils/block_bitmap.h"
+#include "utils/except.h"
 
 namespace cs2313 {
 
+    // Free extents in a B+ tree of allocator_node blocks. Leaf entries are sorted by their first
+    // block; the key of an index entry is where the block range covered by its subtree begins. Nodes
+    // stay cached once read and are changed in memory; commit() writes the dirty ones back, so
+    // allocating is a memory-only operation once the path to the leftmost leaf is cached.
+    //
+    // Blocks are taken from and freed into the tree directly. Every caller holds file_system's
+    // data_mutex_, so caches of free blocks per thread would gain no parallelism until that lock is
+    // split, and what they held would be lost on a crash. Only the few blocks kept in reserve for tree
+    // nodes are allocated on the disk without being used: a crash leaks them but never hands them out
+    // twice, and they go back to the tree when the allocator is destroyed
+    //
+    // Allocations may name a goal, a block the new one should be close to. The disk is cut into
+    // cylinder groups of blocks_per_group blocks; the free block nearest to the goal within its group
+    // is taken, and failing that the nearest one at all, so related blocks share cylinders. Searches
+    // around a goal run on used_map_, a bitmap of the blocks not free in the tree, built by load() at
+    // mount and changed along with the tree; searches across the disk stay on the tree's summaries
     class fs_allocator {
     public:
-        fs_allocator(disk_view &disk, uint64_t alloc_root):
-            disk_(disk), alloc_root_(alloc_root) {}
+        fs_allocator(disk_view &disk, uint64_t alloc_root, uint64_t disk_blocks, uint64_t blocks_per_group):
+            disk_(disk), alloc_root_(alloc_root), blocks_per_group_(std::max<uint64_t>(blocks_per_group, 1)),
+            groups_(std::max<uint64_t>(disk_blocks / blocks_per_group_, 1)), next_group_(0),
+            used_map_(disk_blocks) {}
 
         fs_allocator(const fs_allocator &other) = delete;
 
         fs_allocator operator=(const fs_allocator &other) = delete;
 
-        uint64_t new_block() {
+        ~fs_allocator() {
+            try {
+                drain_all();
+            } catch (except &) {
+                // what was not returned yet is leaked; what was is still committed below
+            }
+            try {
+                commit();
+                disk_.flush();
+            } catch (except &) {
+                // the disk is gone; the blocks returned above are leaked
+            }
+        }
+
+        // goal: the block after it is wanted, e.g. the previous block of a file; 0 for anywhere
+        uint64_t new_block(uint64_t goal = 0) {
             std::lock_guard<std::mutex> lock(global_mutex_);
-            uint64_t ret = new_block_i();
-            sync();
+            return goal ? new_extent_near_i(goal, 1).disk_block_no : new_block_i();
+        }
+
+        // A goal in the next cylinder group in turn, for a new folder: folders are spread over the
+        // disk, and the files in them kept next to them
+        uint64_t group_goal() {
+            return next_group_.fetch_add(1, std::memory_order_relaxed) % groups_ * blocks_per_group_;
+        }
+
+        // A file's blocks, changed to len blocks in at most max_extents extents: one if a free extent
+        // is long enough. A single extent shrinks or grows where it is if it can; otherwise the file
+        // moves to new blocks near goal and the old ones are freed. The caller writes all of the data
+        std::vector<extent_token> reallocate(const std::vector<extent_token> &old, uint64_t goal, uint64_t len,
+                                             size_t max_extents) {
+            std::vector<extent_token> ret, freed;
+            {
+                std::lock_guard<std::mutex> lock(global_mutex_);
+                if (old.size() == 1 && old[0].len >= len) {
+                    if (len > 0)
+                        ret.push_back({old[0].disk_block_no, len});
+                    if (old[0].len > len)
+                        freed.push_back({old[0].disk_block_no + len, old[0].len - len});
+                } else if (old.size() == 1 && take_range_i(old[0].disk_block_no + old[0].len, len - old[0].len)) {
+                    ret.push_back({old[0].disk_block_no, len});
+                } else {
+                    ret = new_extents_i(goal, len, max_extents);
+                    freed = old;
+                }
+            }
+            for (extent_token &e: freed)
+                delete_extent(e);
             return ret;
         }
 
         void delete_block(uint64_t addr) {
+            delete_extent({addr, 1});
+        }
+
+        // The extent is only handed out again, and trimmed, by release_freed()
+        void delete_extent(extent_token token) {
             std::lock_guard<std::mutex> lock(global_mutex_);
-            // todo recycle
-            // delete_block_internal(addr);
-            // sync();
+            freed_.push_back(token);
         }
 
-        // std::vector<extent_allocated> new_extent(uint32_t len) {
-        //     std::lock_guard<std::mutex> lock(global_mutex_);
-        //     // todo
-        //     sync();
-        //     // todo return
-        // }
+        // Trims what was freed since the last call and makes it allocatable. Called after the flush
+        // closing a file system operation, once the nodes that let go of the blocks are durable: a
+        // crash before it cannot have lost data still pointed to on the disk
+        void release_freed() {
+            std::vector<extent_token> freed;
+            {
+                std::lock_guard<std::mutex> lock(global_mutex_);
+                freed.swap(freed_);
+            }
+            for (extent_token &e: freed)
+                disk_.discard(e.disk_block_no, e.len);
+            std::lock_guard<std::mutex> lock(global_mutex_);
+            free_merged_i(freed);
+        }
 
-        void delete_extent(extent_token token) {
+        // Writes the nodes changed since the last commit back, in address order. Called right before
+        // the flush closing a file system operation, so they become durable together with it
+        void commit() {
             std::lock_guard<std::mutex> lock(global_mutex_);
-            // todo recycle
-            // sync();
+            for (uint64_t addr: node_dirty_)
+                disk_[addr] = node_cache_[addr];
+            node_dirty_.clear();
+        }
+
+        // Reads the whole tree, which stays cached, and builds used_map_ from it. At mount
+        void load() {
+            std::lock_guard<std::mutex> lock(global_mutex_);
+            load_i();
+        }
+
+        // Drops the cached nodes and the reserve, whose blocks were given back by rewriting the tree on
+        // the disk (format), and loads the new tree
+        void reset() {
+            std::lock_guard<std::mutex> lock(global_mutex_);
+            freed_.clear();
+            node_reserve_.clear();
+            node_cache_.clear();
+            node_dirty_.clear();
+            load_i();
+        }
+
+        uint64_t free_blocks() {
+            std::lock_guard<std::mutex> lock(global_mutex_);
+            return fetch_node(alloc_root_).header.free_blocks;
+        }
+
+        uint64_t max_cont_blocks() {
+            std::lock_guard<std::mutex> lock(global_mutex_);
+            return fetch_node(alloc_root_).header.max_cont_blocks;
         }
 
     private:
         disk_view &disk_;
         uint64_t alloc_root_;
+        uint64_t blocks_per_group_, groups_;
         std::mutex global_mutex_; // todo segmented mutex
+        std::atomic<uint64_t> next_group_;
 
+        // References into the cache stay valid, as an unordered_map never moves its elements
         std::unordered_map<uint64_t, allocator_node> node_cache_;
-        std::unordered_map<uint64_t, bool> node_dirty_;
-        std::unordered_map<uint64_t, uint64_t> parent_map_;
+        std::set<uint64_t> node_dirty_;
+
+        // Freed by the current file system operation, not yet trimmed nor reusable
+        std::vector<extent_token> freed_;
+
+        // Blocks for the nodes a split creates, taken before an insertion starts walking the tree
+        std::vector<uint64_t> node_reserve_;
+
+        block_bitmap used_map_;
+
+        uint64_t group_of(uint64_t addr) const {
+            return addr / blocks_per_group_;
+        }
+
+        // Adjacent extents are merged before they reach the tree
+        void free_merged_i(std::vector<extent_token> &extents) {
+            std::ranges::sort(extents, {}, &extent_token::disk_block_no);
+            size_t merged = 0;
+            for (size_t i = 1; i < extents.size(); ++i) {
+                extent_token &last = extents[merged];
+                if (last.disk_block_no + last.len == extents[i].disk_block_no)
+                    last.len += extents[i].len;
+                else
+                    extents[++merged] = extents[i];
+            }
+            if (!extents.empty())
+                extents.resize(merged + 1);
+            for (extent_token &e: extents)
+                free_extent_i(e.disk_block_no, e.len);
+        }
+
+        void drain_all() {
+            release_freed();
+            std::lock_guard<std::mutex> lock(global_mutex_);
+            drain_reserve_i();
+        }
+
+        // The reserve goes back in runs of adjacent blocks, highest first. A run pays for the splits
+        // its insertion makes with its own blocks and then the rest of the reserve; one that cannot is
+        // kept out of the tree, as it would take more blocks for nodes than it gives back
+        void drain_reserve_i() {
+            std::ranges::sort(node_reserve_);
+            while (!node_reserve_.empty()) {
+                uint64_t addr = node_reserve_.back(), len = 1;
+                node_reserve_.pop_back();
+                while (!node_reserve_.empty() && node_reserve_.back() + 1 == addr) {
+                    addr = node_reserve_.back();
+                    node_reserve_.pop_back();
+                    ++len;
+                }
+                if (split_blocks_i(addr, len) <= len + node_reserve_.size())
+                    free_extent_i(addr, len, false);
+            }
+        }
+
+        // The blocks the insertion of [addr, addr + len) would take for new nodes: two if the root
+        // splits, one for each other full node on its path. A split leaves the nodes below as they are
+        uint64_t split_blocks_i(uint64_t addr, uint64_t len) {
+            uint64_t blocks = node_full(alloc_root_) && !leaf_merges(alloc_root_, addr, len) ? 2 : 0;
+            uint64_t current_addr = alloc_root_;
+            while (fetch_node(current_addr).header.tree_depth > 0) {
+                allocator_node &node = fetch_node(current_addr);
+                uint64_t child = node.extent_index(child_index(node, addr)).node_addr;
+                if (node_full(child) && !leaf_merges(child, addr, len))
+                    ++blocks;
+                current_addr = child;
+            }
+            return blocks;
+        }
+
+        // The gaps between the free extents, visited in order, are what is in use
+        void load_i() {
+            used_map_.reset();
+            uint64_t end = 0;
+            load_node_i(alloc_root_, end);
+            used_map_.set(end, used_map_.size() - end);
+        }
+
+        void load_node_i(uint64_t addr, uint64_t &end) {
+            allocator_node &node = fetch_node(addr);
+            for (int i = 0; i < node.header.entries; ++i) {
+                if (node.header.tree_depth > 0) {
+                    load_node_i(node.extent_index(i).node_addr, end);
+                } else {
+                    used_map_.set(end, node.extent(i).disk_block_no - end);
+                    end = node.extent(i).disk_block_no + node.extent(i).len;
+                }
+            }
+        }
 
         allocator_node &fetch_node(uint64_t addr) {
             auto it = node_cache_.find(addr);
@@ -61,161 +260,474 @@ namespace cs2313 {
                 return it->second;
             } else {
                 allocator_node node = disk_[addr];
-                node_cache_[addr] = node;
-                node_dirty_[addr] = false;
-                return node_cache_[addr];
+                return node_cache_[addr] = node;
             }
         }
 
         void set_dirty(uint64_t addr) {
-            node_dirty_[addr] = true;
+            node_dirty_.insert(addr);
         }
 
-        void sync() {
-            for (auto &it: node_cache_) {
-                if (node_dirty_[it.first]) {
-                    disk_[it.first] = it.second;
+        // free_blocks and max_cont_blocks of a node from its entries, or from its children's
+        void update_summary(uint64_t addr) {
+            allocator_node &node = fetch_node(addr);
+            uint64_t free_blocks = 0, max_cont_blocks = 0;
+            for (int i = 0; i < node.header.entries; ++i) {
+                uint64_t free, max_cont;
+                if (node.header.tree_depth == 0) {
+                    free = max_cont = node.extent(i).len;
+                } else {
+                    allocator_node &child = fetch_node(node.extent_index(i).node_addr);
+                    free = child.header.free_blocks;
+                    max_cont = child.header.max_cont_blocks;
                 }
+                free_blocks += free;
+                max_cont_blocks = std::max(max_cont_blocks, max_cont);
             }
-            node_cache_.clear();
-            node_dirty_.clear();
+            node.header.free_blocks = free_blocks;
+            node.header.max_cont_blocks = max_cont_blocks;
+            set_dirty(addr);
         }
 
         uint64_t new_block_i() {
+            return new_extent_i(1).disk_block_no;
+        }
 
+        // Up to max_len blocks from the lowest free extent
+        extent_token new_extent_i(uint64_t max_len) {
+            tree_position pos;
             uint64_t current_addr = alloc_root_;
-            allocator_node *current_node = &fetch_node(current_addr);
-            std::vector<uint64_t> path;
+            while (fetch_node(current_addr).header.tree_depth > 0) {
+                allocator_node &node = fetch_node(current_addr);
+                int i = 0;
+                while (i + 1 < node.header.entries && fetch_node(node.extent_index(i).node_addr).header.free_blocks == 0)
+                    ++i;
+                pos.path.emplace_back(current_addr, i);
+                current_addr = node.extent_index(i).node_addr;
+            }
 
-            while (current_node->header.tree_depth > 0) {
-                path.push_back(current_addr);
-                current_addr = current_node->extent_index(0).node_addr;
-                current_node = &fetch_node(current_addr);
+            allocator_node &leaf = fetch_node(current_addr);
+            if (leaf.header.entries == 0)
+                throw except(ERROR_FS_CAPACITY_EXCEEDED);
+            pos.leaf = current_addr;
+            pos.index = 0;
+            return carve_i(pos, 0, leaf.extent(0).disk_block_no, std::min(max_len, leaf.extent(0).len));
+        }
+
+        // A leaf entry, with the index entries leading to it from the root
+        struct tree_position {
+            std::vector<std::pair<uint64_t, int>> path;
+            uint64_t leaf;
+            int index;
+        };
+
+        // An entry spanning the separator after its subtree (merges allow that) may now start past it;
+        // as separators bound where the entries of a subtree start, they are raised past the new start.
+        // The entries after it start no sooner than where it ends
+        void raise_separators(const tree_position &pos, uint64_t start) {
+            for (auto &[node_addr, i]: pos.path) {
+                allocator_node &node = fetch_node(node_addr);
+                if (i + 1 < node.header.entries && node.extent_index(i + 1).disk_block_no <= start) {
+                    node.extent_index(i + 1).disk_block_no = start + 1;
+                    set_dirty(node_addr);
+                }
             }
+        }
 
-            if (current_node->header.entries == 0)
-                return 0; // todo throw
+        // Up to max_len blocks from the free run closest to the block after goal: from that block on
+        // if it is free, else from the end of the run before it or the start of the one after it, the
+        // one in goal's group being preferred
+        extent_token new_extent_near_i(uint64_t goal, uint64_t max_len) {
+            const uint64_t target = goal + 1;
+            uint64_t after = used_map_.find_clear(target);
+            if (after == target)
+                return take_i(target, std::min(max_len, run_end(target) - target));
+            uint64_t before = used_map_.rfind_clear(goal);
+            if (before == block_bitmap::npos && after == block_bitmap::npos)
+                throw except(ERROR_FS_CAPACITY_EXCEEDED);
 
-            alloc_extent_entry &entry = current_node->extent(0);
-            uint64_t block_allocated = entry.disk_block_no;
+            bool take_before = after == block_bitmap::npos;
+            if (before != block_bitmap::npos && after != block_bitmap::npos) {
+                bool low_near = group_of(before) == group_of(goal), high_near = group_of(after) == group_of(goal);
+                take_before = low_near != high_near ? low_near : target - before < after - target;
+            }
+            if (take_before) {
+                uint64_t start = used_map_.rfind_set(before) + 1; // npos + 1 == 0
+                uint64_t len = std::min(max_len, before + 1 - start);
+                return take_i(before + 1 - len, len);
+            }
+            return take_i(after, std::min(max_len, run_end(after) - after));
+        }
+
+        // Where the free run holding addr ends
+        uint64_t run_end(uint64_t addr) {
+            return std::min(used_map_.find_set(addr), used_map_.size());
+        }
 
-            if (entry.len == 1) {
-                node_remove_entry(current_addr, 0);
+        // Takes [addr, addr + len) out of the entry at index of the leaf at pos, which holds it. What
+        // is left past it goes back to the tree as an extent of its own
+        extent_token carve_i(const tree_position &pos, int index, uint64_t addr, uint64_t len) {
+            alloc_extent_entry &entry = fetch_node(pos.leaf).extent(index);
+            uint64_t start = entry.disk_block_no, end = start + entry.len;
+            used_map_.set(addr, len);
+            if (addr == start && addr + len == end) {
+                node_remove_entry(pos.leaf, index);
+            } else if (addr == start) {
+                entry.disk_block_no += len;
+                entry.len -= len;
+                raise_separators(pos, entry.disk_block_no);
             } else {
-                ++entry.disk_block_no;
-                --entry.len;
+                entry.len = addr - start;
             }
-            set_dirty(current_addr);
+            update_summary(pos.leaf);
+            for (auto it = pos.path.rbegin(); it != pos.path.rend(); ++it)
+                update_summary(it->first);
+            if (addr != start && addr + len < end)
+                free_extent_i(addr + len, end - addr - len);
+            return {addr, len};
+        }
 
-            // todo maintain
-            // if (current_node->header.entries == 0 && current_addr != alloc_root_) {
-            //     delete_node(current_addr);
-            // }
+        // The leaf whose range holds addr, at its first entry starting after addr
+        tree_position tree_find(uint64_t addr) {
+            tree_position pos;
+            uint64_t current_addr = alloc_root_;
+            while (fetch_node(current_addr).header.tree_depth > 0) {
+                allocator_node &node = fetch_node(current_addr);
+                int i = child_index(node, addr);
+                pos.path.emplace_back(current_addr, i);
+                current_addr = node.extent_index(i).node_addr;
+            }
+            pos.leaf = current_addr;
+            pos.index = leaf_position(fetch_node(current_addr), addr);
+            return pos;
+        }
 
-            return block_allocated;
+        // On to the first entry of the next leaf with a free extent of min_len blocks or more in its
+        // subtree; false past the last one
+        bool tree_next(tree_position &pos, uint64_t min_len = 1) {
+            while (!pos.path.empty()) {
+                uint64_t node_addr = pos.path.back().first;
+                int i = ++pos.path.back().second;
+                allocator_node &node = fetch_node(node_addr);
+                if (i >= node.header.entries) {
+                    pos.path.pop_back();
+                    continue;
+                }
+                uint64_t current_addr = node.extent_index(i).node_addr;
+                if (fetch_node(current_addr).header.max_cont_blocks < min_len)
+                    continue;
+                while (fetch_node(current_addr).header.tree_depth > 0) {
+                    pos.path.emplace_back(current_addr, 0);
+                    current_addr = fetch_node(current_addr).extent_index(0).node_addr;
+                }
+                if (fetch_node(current_addr).header.entries > 0) {
+                    pos.leaf = current_addr;
+                    pos.index = 0;
+                    return true;
+                }
+            }
+            return false;
         }
 
-        void delete_block_internal(uint64_t addr) {
-            // todo
+        // Back to just past the last entry of the previous leaf with free blocks; false before the first
+        bool tree_prev(tree_position &pos) {
+            while (!pos.path.empty()) {
+                uint64_t node_addr = pos.path.back().first;
+                int i = --pos.path.back().second;
+                if (i < 0) {
+                    pos.path.pop_back();
+                    continue;
+                }
+                uint64_t current_addr = fetch_node(node_addr).extent_index(i).node_addr;
+                if (fetch_node(current_addr).header.free_blocks == 0)
+                    continue;
+                while (fetch_node(current_addr).header.tree_depth > 0) {
+                    allocator_node &node = fetch_node(current_addr);
+                    pos.path.emplace_back(current_addr, node.header.entries - 1);
+                    current_addr = node.extent_index(node.header.entries - 1).node_addr;
+                }
+                if (fetch_node(current_addr).header.entries > 0) {
+                    pos.leaf = current_addr;
+                    pos.index = fetch_node(current_addr).header.entries;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // len blocks in as few extents as there are, at most max_extents: each one the first long enough
+        // for the rest after goal, or failing that the longest there is
+        std::vector<extent_token> new_extents_i(uint64_t goal, uint64_t len, size_t max_extents) {
+            std::vector<extent_token> ret;
+            try {
+                while (len > 0) {
+                    if (ret.size() == max_extents)
+                        throw except(ERROR_FS_CAPACITY_EXCEEDED);
+                    extent_token extent = fetch_node(alloc_root_).header.max_cont_blocks >= len
+                                              ? new_extent_fit_i(goal, len)
+                                              : new_extent_longest_i(len);
+                    ret.push_back(extent);
+                    len -= extent.len;
+                    goal = extent.disk_block_no + extent.len - 1;
+                }
+            } catch (except &) {
+                for (extent_token &e: ret)
+                    free_extent_i(e.disk_block_no, e.len);
+                throw;
+            }
+            return ret;
+        }
+
+        // len blocks in one piece: from the block after goal on if the run there is long enough, else
+        // from the shortest run long enough in goal's group, else the first one after the group,
+        // wrapping around to the start of the disk. Some extent must be long enough
+        extent_token new_extent_fit_i(uint64_t goal, uint64_t len) {
+            const uint64_t target = goal + 1;
+            if (used_map_.find_clear(target) == target && run_end(target) - target >= len)
+                return take_i(target, len);
+
+            const uint64_t group_begin = group_of(goal) * blocks_per_group_,
+                           group_end = std::min(group_begin + blocks_per_group_, used_map_.size());
+            uint64_t best = block_bitmap::npos, best_len = UINT64_MAX;
+            for (uint64_t p = used_map_.find_clear_run(group_begin, group_end, len), end;
+                 p != block_bitmap::npos && best_len != len; p = used_map_.find_clear_run(end, group_end, len)) {
+                end = run_end(p);
+                if (end - p < best_len) {
+                    best = p;
+                    best_len = end - p;
+                }
+            }
+            if (best != block_bitmap::npos)
+                return take_i(best, len);
+
+            // past the group, first fit in the tree, which skips the subtrees without a long enough extent
+            tree_position pos = tree_find(group_end);
+            for (bool wrapped = false;;) {
+                allocator_node &leaf = fetch_node(pos.leaf);
+                for (; pos.index < leaf.header.entries; ++pos.index)
+                    if (leaf.extent(pos.index).len >= len)
+                        return carve_i(pos, pos.index, leaf.extent(pos.index).disk_block_no, len);
+                if (!tree_next(pos, len)) {
+                    if (wrapped)
+                        throw except(ERROR_FS_CAPACITY_EXCEEDED);
+                    wrapped = true;
+                    pos = tree_find(0);
+                }
+            }
+        }
+
+        // Up to max_len blocks from the start of the longest free extent
+        extent_token new_extent_longest_i(uint64_t max_len) {
+            const uint64_t longest = fetch_node(alloc_root_).header.max_cont_blocks;
+            if (longest == 0)
+                throw except(ERROR_FS_CAPACITY_EXCEEDED);
+            tree_position pos;
+            uint64_t current_addr = alloc_root_;
+            while (fetch_node(current_addr).header.tree_depth > 0) {
+                allocator_node &node = fetch_node(current_addr);
+                int i = 0;
+                while (fetch_node(node.extent_index(i).node_addr).header.max_cont_blocks < longest)
+                    ++i;
+                pos.path.emplace_back(current_addr, i);
+                current_addr = node.extent_index(i).node_addr;
+            }
+            allocator_node &leaf = fetch_node(current_addr);
+            int i = 0;
+            while (leaf.extent(i).len < longest)
+                ++i;
+            pos.leaf = current_addr;
+            pos.index = i;
+            return carve_i(pos, i, leaf.extent(i).disk_block_no, std::min(max_len, longest));
+        }
+
+        // Takes [addr, addr + len) if all of it is free in the tree
+        bool take_range_i(uint64_t addr, uint64_t len) {
+            if (len == 0)
+                return true;
+            if (used_map_.find_set(addr) < addr + len || addr + len > used_map_.size())
+                return false;
+            take_i(addr, len);
+            return true;
+        }
+
+        // Takes [addr, addr + len), all free, out of the tree: out of as many leaf entries as it
+        // spans, as neighbours in different leaves are not merged
+        extent_token take_i(uint64_t addr, uint64_t len) {
+            for (uint64_t taken = 0; taken < len;) {
+                tree_position pos = tree_find(addr + taken);
+                if (pos.index == 0)
+                    tree_prev(pos);
+                alloc_extent_entry &entry = fetch_node(pos.leaf).extent(pos.index - 1);
+                uint64_t n = std::min(len - taken, entry.disk_block_no + entry.len - (addr + taken));
+                carve_i(pos, pos.index - 1, addr + taken, n);
+                taken += n;
+            }
+            return {addr, len};
+        }
+
+        // Returns [addr, addr + len) to the tree, merged with the free extents next to it in its leaf.
+        // Full nodes are split on the way down, so an insertion never travels back up
+        void free_extent_i(uint64_t addr, uint64_t len, bool top_up_reserve = true) {
+            if (top_up_reserve) {
+                // a root split takes two blocks, any other level one
+                const uint64_t needed = fetch_node(alloc_root_).header.tree_depth + 2;
+                try {
+                    while (node_reserve_.size() < needed)
+                        node_reserve_.push_back(new_block_i());
+                } catch (except &) {
+                    // the tree is empty, so nothing will be split
+                }
+            }
+
+            if (node_full(alloc_root_) && !leaf_merges(alloc_root_, addr, len))
+                bp_tree_split_root(addr, len);
+
+            uint64_t current_addr = alloc_root_;
+            std::vector<uint64_t> path;
+            while (fetch_node(current_addr).header.tree_depth > 0) {
+                path.push_back(current_addr);
+                allocator_node &node = fetch_node(current_addr);
+                int i = child_index(node, addr);
+                uint64_t child = node.extent_index(i).node_addr;
+                if (node_full(child) && !leaf_merges(child, addr, len)) {
+                    bp_tree_split(current_addr, i, addr, len);
+                    i = child_index(node, addr);
+                    child = node.extent_index(i).node_addr;
+                }
+                if (node.extent_index(i).disk_block_no > addr) {
+                    node.extent_index(i).disk_block_no = addr;
+                    set_dirty(current_addr);
+                }
+                current_addr = child;
+            }
+
+            if (len > 0) {
+                leaf_insert(current_addr, addr, len);
+                used_map_.clear(addr, len);
+            }
+            update_summary(current_addr);
+            for (auto it = path.rbegin(); it != path.rend(); ++it)
+                update_summary(*it);
+        }
+
+        bool node_full(uint64_t node_addr) {
+            allocator_node &node = fetch_node(node_addr);
+            return node.header.entries >= node.header.entries_capacity;
+        }
+
+        // The child whose range holds addr
+        static int child_index(allocator_node &node, uint64_t addr) {
+            int i = 0;
+            while (i + 1 < node.header.entries && node.extent_index(i + 1).disk_block_no <= addr)
+                ++i;
+            return i;
+        }
+
+        // First entry of a leaf starting after addr
+        static int leaf_position(allocator_node &node, uint64_t addr) {
+            int i = 0;
+            while (i < node.header.entries && node.extent(i).disk_block_no <= addr)
+                ++i;
+            return i;
+        }
+
+        // Whether [addr, addr + len) would extend an entry of this node rather than add one
+        bool leaf_merges(uint64_t node_addr, uint64_t addr, uint64_t len) {
+            allocator_node &node = fetch_node(node_addr);
+            if (node.header.tree_depth > 0)
+                return false;
+            int i = leaf_position(node, addr);
+            return (i > 0 && node.extent(i - 1).disk_block_no + node.extent(i - 1).len == addr)
+                   || (i < node.header.entries && addr + len == node.extent(i).disk_block_no);
+        }
+
+        void leaf_insert(uint64_t node_addr, uint64_t addr, uint64_t len) {
+            allocator_node &node = fetch_node(node_addr);
+            int i = leaf_position(node, addr);
+            bool merge_prev = i > 0 && node.extent(i - 1).disk_block_no + node.extent(i - 1).len == addr;
+            bool merge_next = i < node.header.entries && addr + len == node.extent(i).disk_block_no;
+            if (merge_prev && merge_next) {
+                node.extent(i - 1).len += len + node.extent(i).len;
+                node_remove_entry(node_addr, i);
+            } else if (merge_prev) {
+                node.extent(i - 1).len += len;
+            } else if (merge_next) {
+                node.extent(i).disk_block_no = addr;
+                node.extent(i).len += len;
+            } else {
+                memmove(&node.extent(i + 1), &node.extent(i), (node.header.entries - i) * sizeof(alloc_extent_entry));
+                node.extent(i) = {addr, len};
+                ++node.header.entries;
+            }
+            set_dirty(node_addr);
         }
 
         void node_remove_entry(uint64_t node_addr, int index) {
-            // allocator_node &node = fetch_node(node_addr);
-            // // todo memcpy
-            // if (node.header.tree_depth == 0) {
-            //     for (int i = index; i < node.header.entries - 1; ++i) {
-            //         node.extent(i) = node.extent(i + 1);
-            //     }
-            // } else {
-            //     for (int i = index; i < node.header.entries - 1; ++i) {
-            //         node.extent_index(i) = node.extent_index(i + 1);
-            //     }
-            // }
-            // node.header.entries--;
-        }
-
-        void delete_node(uint64_t node_addr) {
-            // auto parent_it = parent_map_.find(node_addr);
-            // if (parent_it == parent_map_.end()) return;
-            //
-            // uint64_t parent_addr = parent_it->second;
-            // allocator_node &parent = fetch_node(parent_addr);
-            //
-            // int index = -1;
-            // for (int i = 0; i < parent.header.entries; ++i) {
-            //     if (parent.extent_index(i).node_addr == node_addr) {
-            //         index = i;
-            //         break;
-            //     }
-            // }
-            // if (index == -1) return;
-            //
-            // node_remove_entry(parent_addr, index);
-            // delete_block_internal(node_addr);
-            //
-            // if (parent.header.entries == 0 && parent_addr != alloc_root_) {
-            //     delete_node(parent_addr);
-            // }
-        }
-
-        void bp_tree_split(uint64_t node_addr) {
-            // allocator_node &node = fetch_node(node_addr);
-            // uint64_t new_addr = new_block_i();
-            // allocator_node &new_node = fetch_node(new_addr);
-            // new_node.header = node.header;
-            // int split_pos = node.header.entries / 2;
-            //
-            // if (node.header.tree_depth == 0) {
-            //     for (int i = split_pos; i < node.header.entries; ++i) {
-            //         new_node.extent(i - split_pos) = node.extent(i);
-            //     }
-            // } else {
-            //     for (int i = split_pos; i < node.header.entries; ++i) {
-            //         new_node.extent_index(i - split_pos) = node.extent_index(i);
-            //         parent_map_[node.extent_index(i).node_addr] = new_addr;
-            //     }
-            // }
-            // new_node.header.entries = node.header.entries - split_pos;
-            // node.header.entries = split_pos;
-            // set_dirty(node_addr);
-            // set_dirty(new_addr);
-            //
-            // // update parent
-            // if (node_addr == alloc_root_) {
-            //     bp_tree_split_root(node_addr, new_addr);
-            // } else {
-            //     uint64_t parent_addr = parent_map_[node_addr];
-            //     allocator_node &parent = fetch_node(parent_addr);
-            //     alloc_extent_index_entry entry;
-            //     entry.node_addr = new_addr;
-            //     entry.disk_block_no = new_node.extent_index(new_node.header.entries - 1).disk_block_no;
-            //     int pos = find_insert_pos(parent, entry.disk_block_no);
-            //     node_insert_index_entry(parent_addr, pos, entry);
-            //     parent_map_[new_addr] = parent_addr;
-            // }
-        }
-
-        void bp_tree_split_root(uint64_t old_root, uint64_t new_node) {
-            // uint64_t new_root = new_block_i();
-            // allocator_node &root = fetch_node(new_root);
-            // root.header.magic = 0x0909;
-            // root.header.tree_depth = fetch_node(old_root).header.tree_depth + 1;
-            // root.header.entries = 2;
-            // root.header.entries_capacity = 14;
-            //
-            // root.extent_index(0).node_addr = old_root;
-            // root.extent_index(0).disk_block_no = get_max_block(old_root);
-            // root.extent_index(1).node_addr = new_node;
-            // root.extent_index(1).disk_block_no = get_max_block(new_node);
-            //
-            // alloc_root_ = new_root;
-            // set_dirty(new_root);
-            // parent_map_[old_root] = new_root;
-            // parent_map_[new_node] = new_root;
-        }
-
-        void bp_tree_merge(uint64_t node_addr) {
-            // todo
+            allocator_node &node = fetch_node(node_addr);
+            memmove(&node.extent(index), &node.extent(index + 1), (node.header.entries - 1 - index) * sizeof(alloc_extent_entry));
+            node.header.entries--;
+            set_dirty(node_addr);
+        }
+
+        // A block for a new node: the last one of the extent being freed, or one from the reserve
+        uint64_t take_node_block(uint64_t addr, uint64_t &len) {
+            if (len > 0) {
+                used_map_.set(addr + len - 1, 1); // the rest of a carved extent is free already
+                return addr + --len;
+            }
+            if (node_reserve_.empty())
+                throw except(ERROR_FS_CAPACITY_EXCEEDED);
+            uint64_t ret = node_reserve_.back();
+            node_reserve_.pop_back();
+            return ret;
+        }
+
+        // Where the range of a node begins, for the index entry pointing to it
+        uint64_t node_key(uint64_t node_addr) {
+            allocator_node &node = fetch_node(node_addr);
+            return node.header.tree_depth == 0 ? node.extent(0).disk_block_no : node.extent_index(0).disk_block_no;
+        }
+
+        // Moves the upper half of node into new_addr
+        void move_upper_half(uint64_t node_addr, uint64_t new_addr) {
+            allocator_node &node = fetch_node(node_addr);
+            allocator_node &new_node = node_cache_[new_addr] = allocator_node::default_node(node.header.tree_depth);
+            int split_pos = node.header.entries / 2;
+            new_node.header.entries = node.header.entries - split_pos;
+            memcpy(&new_node.extent(0), &node.extent(split_pos), new_node.header.entries * sizeof(alloc_extent_entry));
+            node.header.entries = split_pos;
+            update_summary(node_addr);
+            update_summary(new_addr);
+        }
+
+        // Splits the child at index of a parent with room
+        void bp_tree_split(uint64_t parent_addr, int index, uint64_t addr, uint64_t &len) {
+            uint64_t child_addr = fetch_node(parent_addr).extent_index(index).node_addr;
+            uint64_t new_addr = take_node_block(addr, len);
+            move_upper_half(child_addr, new_addr);
+            allocator_node &parent = fetch_node(parent_addr);
+            memmove(&parent.extent_index(index + 2), &parent.extent_index(index + 1),
+                    (parent.header.entries - index - 1) * sizeof(alloc_extent_index_entry));
+            parent.extent_index(index + 1) = {new_addr, node_key(new_addr)};
+            ++parent.header.entries;
+            set_dirty(parent_addr);
+        }
+
+        // The root stays where the file system expects it: its entries move down into two new
+        // children, and it becomes their parent
+        void bp_tree_split_root(uint64_t addr, uint64_t &len) {
+            uint64_t low_addr = take_node_block(addr, len);
+            uint64_t high_addr = take_node_block(addr, len);
+            allocator_node &root = fetch_node(alloc_root_);
+            node_cache_[low_addr] = root;
+            move_upper_half(low_addr, high_addr);
+
+            uint64_t low_key = node_key(low_addr), high_key = node_key(high_addr);
+            root = allocator_node::default_node(root.header.tree_depth + 1);
+            root.header.entries = 2;
+            root.extent_index(0) = {low_addr, low_key};
+            root.extent_index(1) = {high_addr, high_key};
+            update_summary(alloc_root_);
         }
     };
 
@@ -44,10 +44,17 @@ namespace cs2313 {
         uint64_t right_addr;
     };
 
+    // Set in the len of an extent preallocated and not written since, which reads as zeros
+    static constexpr uint32_t EXTENT_UNWRITTEN = 0x80000000;
+
     struct extent_entry {
         uint64_t disk_addr; // start from
         uint32_t file_block_no; // start from
-        uint32_t len;
+        uint32_t len; // with EXTENT_UNWRITTEN
+
+        uint32_t blocks() const { return len & ~EXTENT_UNWRITTEN; }
+
+        bool unwritten() const { return len & EXTENT_UNWRITTEN; }
     };
 
     struct extent_index_entry {
@@ -101,6 +108,8 @@ namespace cs2313 {
 
         bit_proxy folder_bit() { return {&attrib_bits, 0}; }
         // bit_proxy indirect_name_bit() { return {&attrib_bits_l, 1}; } // todo
+        // folder: size_blocks counts the blocks of the files under it, at any depth
+        bit_proxy usage_bit() { return {&attrib_bits, 2}; }
 
         uint64_t &file_pointer(const int index) {
             return *reinterpret_cast<uint64_t *>(data + index * sizeof(uint64_t));
@@ -114,12 +123,19 @@ namespace cs2313 {
             return *reinterpret_cast<extent_index_entry *>(data + index * sizeof(extent_index_entry));
         }
 
+        // The removed node after this one, waiting for its blocks to be freed; in the root folder, the
+        // first of them
+        uint64_t &next_orphan() { return header.right_addr; }
+
         static directory_node default_folder() {
             directory_node node;
 
             node.magic = 0x0909;
             node.attrib_bits = 0;
             node.folder_bit() = true;
+            node.usage_bit() = true;
+            node.size_blocks = 0;
+            node.size_offset = 0;
             node.name[0] = 0;
             node.timestamp = time(nullptr);
 
@@ -236,6 +252,22 @@ namespace cs2313 {
 
             return node;
         }
+
+        static allocator_node default_node(const uint16_t tree_depth) {
+            allocator_node node;
+
+            node.header.magic = 0x0909;
+            node.header.entries = 0;
+            node.header.entries_capacity = 13;
+            node.header.tree_depth = tree_depth;
+            node.header.parent_addr = 0;
+            node.header.left_addr = 0;
+            node.header.right_addr = 0;
+            node.header.free_blocks = 0;
+            node.header.max_cont_blocks = 0;
+
+            return node;
+        }
     };
 
     static_assert(sizeof(allocator_node) == 0x100);
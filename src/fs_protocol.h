@@ -15,10 +15,14 @@ namespace cs2313 {
                               FS_INSTR_MKDIR = 4,
                               FS_INSTR_RMDIR = 5,
                               FS_INSTR_CHMOD = 6, // todo
+                              FS_INSTR_RM_R = 7,
                               FS_INSTR_FILE_CAT = 8,
                               FS_INSTR_FILE_W = 9,
                               FS_INSTR_FILE_I = 10,
                               FS_INSTR_FILE_D = 11,
+                              FS_INSTR_FILE_PREALLOC = 12,
+                              FS_INSTR_DEFRAG = 13,
+                              FS_INSTR_STATFS = 14,
                               FS_INSTR_FORMAT = 15;
 
     typedef uint8_t fs_reply;
@@ -36,6 +40,8 @@ namespace cs2313 {
                               FS_REPLY_BUSY_HANDLE = 0x34,
                               FS_REPLY_CAPACITY_EXCEEDED = 0x35,
                               FS_REPLY_ACCESS_DENIED = 0x36,
+                              FS_REPLY_NOT_EMPTY = 0x37,
+                              FS_REPLY_DEFRAG_RUNNING = 0x38,
                               FS_REPLY_UNKNOWN_ERROR = 0x3F;
 
     inline fs_reply error_reply(ERROR_CODE error_code) {
@@ -46,6 +52,10 @@ namespace cs2313 {
                 return FS_REPLY_CAPACITY_EXCEEDED;
             case ERROR_FS_ACCESS_DENIED:
                 return FS_REPLY_ACCESS_DENIED;
+            case ERROR_FS_DIRECTORY_NOT_EMPTY:
+                return FS_REPLY_NOT_EMPTY;
+            case ERROR_FS_DEFRAG_RUNNING:
+                return FS_REPLY_DEFRAG_RUNNING;
             case ERROR_FS_NAME_NOT_EXIST:
                 return FS_REPLY_NOT_EXIST;
             case ERROR_FS_NAME_ALREADY_EXIST:
@@ -111,14 +111,19 @@ namespace cs2313 {
                         break;
 
                         case FS_INSTR_RM:
-                        case FS_INSTR_RMDIR: {
+                        case FS_INSTR_RMDIR:
+                        case FS_INSTR_RM_R: {
                             connection_socket.recv_str(str_buf);
                             try {
-                                current_folder.remove(str_buf.c_str(), instr == FS_INSTR_RMDIR);
+                                if (instr == FS_INSTR_RM_R)
+                                    current_folder.remove_recursive(str_buf.c_str());
+                                else
+                                    current_folder.remove(str_buf.c_str(), instr == FS_INSTR_RMDIR);
                                 connection_socket.send(FS_REPLY_OK);
                             } catch (except &e) {
                                 switch (e.error_code()) {
                                     case ERROR_FS_BUSY_HANDLE:
+                                    case ERROR_FS_DIRECTORY_NOT_EMPTY:
                                     case ERROR_FS_NAME_NOT_EXIST:
                                         connection_socket.send(error_reply(e.error_code()));
                                         break;
@@ -222,6 +227,56 @@ namespace cs2313 {
                         }
                         break;
 
+                        case FS_INSTR_FILE_PREALLOC: {
+                            uint64_t size;
+                            connection_socket.recv_str(str_buf);
+                            connection_socket.recv(size);
+                            try {
+                                fs_file_handle file = current_folder.open(str_buf.c_str());
+                                file.preallocate(size);
+                                connection_socket.send(FS_REPLY_OK);
+                            } catch (except &e) {
+                                switch (e.error_code()) {
+                                    case ERROR_FS_NAME_NOT_EXIST:
+                                    case ERROR_FS_CAPACITY_EXCEEDED:
+                                        connection_socket.send(error_reply(e.error_code()));
+                                        break;
+                                    default:
+                                        throw;
+                                }
+                            }
+                        }
+                        break;
+
+                        case FS_INSTR_DEFRAG: {
+                            uint64_t blocks_per_second;
+                            connection_socket.recv(blocks_per_second);
+                            try {
+                                fs_.start_defragment(blocks_per_second);
+                                connection_socket.send(FS_REPLY_OK);
+                            } catch (except &e) {
+                                switch (e.error_code()) {
+                                    case ERROR_FS_DEFRAG_RUNNING:
+                                        connection_socket.send(error_reply(e.error_code()));
+                                        break;
+                                    default:
+                                        throw;
+                                }
+                            }
+                        }
+                        break;
+
+                        case FS_INSTR_STATFS: {
+                            fs_stat stat = fs_.stat();
+                            connection_socket.send(FS_REPLY_OK);
+                            connection_socket.send(stat.total_blocks);
+                            connection_socket.send(stat.free_blocks);
+                            connection_socket.send(stat.available_blocks);
+                            connection_socket.send(stat.longest_free_blocks);
+                            connection_socket.send(current_folder.usage());
+                        }
+                        break;
+
                         case FS_INSTR_FORMAT: {
                             fs_.format();
                             connection_socket.send(FS_REPLY_OK);
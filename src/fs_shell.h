@@ -73,15 +73,21 @@ namespace cs2313 {
                         std::cout << fail_prompt(reply, true, name) << std::endl;
                     }
                 } else if (cmd == "rm") {
-                    if (!(iss >> name)) {
-                        std::cout << "Missing file name" << std::endl;
+                    bool recursive = false;
+                    if (iss >> name && name == "-r") {
+                        recursive = true;
+                        name.clear();
+                        iss >> name;
+                    }
+                    if (name.empty()) {
+                        std::cout << (recursive ? "Missing directory name" : "Missing file name") << std::endl;
                         continue;
                     }
-                    client_socket_.send(FS_INSTR_RM);
+                    client_socket_.send(recursive ? FS_INSTR_RM_R : FS_INSTR_RM);
                     client_socket_.send_str(name);
                     client_socket_.recv(reply);
                     if (reply != FS_REPLY_OK) {
-                        std::cout << fail_prompt(reply, false, name) << std::endl;
+                        std::cout << fail_prompt(reply, recursive, name) << std::endl;
                     }
                 } else if (cmd == "cd") {
                     if (!(iss >> name)) {
@@ -187,6 +193,53 @@ namespace cs2313 {
                     if (reply != FS_REPLY_OK) {
                         std::cout << fail_prompt(reply, false, name) << std::endl;
                     }
+                } else if (cmd == "p") {
+                    uint64_t size;
+                    if (!(iss >> name >> size)) {
+                        std::cout << "Invalid command format" << std::endl;
+                        continue;
+                    }
+                    client_socket_.send(FS_INSTR_FILE_PREALLOC);
+                    client_socket_.send_str(name);
+                    client_socket_.send(size);
+                    client_socket_.recv(reply);
+                    if (reply != FS_REPLY_OK) {
+                        std::cout << fail_prompt(reply, false, name) << std::endl;
+                    }
+                } else if (cmd == "df") {
+                    client_socket_.send(FS_INSTR_STATFS);
+                    client_socket_.recv(reply);
+                    if (reply == FS_REPLY_OK) {
+                        uint64_t total, free, available, longest, usage;
+                        client_socket_.recv(total);
+                        client_socket_.recv(free);
+                        client_socket_.recv(available);
+                        client_socket_.recv(longest);
+                        client_socket_.recv(usage);
+                        std::cout << "Blocks of 256 bytes: " << total << " total, " << total - free << " used, "
+                                  << free << " free (" << available << " available), longest free run " << longest << std::endl;
+                        std::cout << "Files under " << path_prompt_ << ": ";
+                        if (usage == UINT64_MAX)
+                            std::cout << "not counted (directory made by an older version)" << std::endl;
+                        else
+                            std::cout << usage << " blocks" << std::endl;
+                    } else {
+                        std::cout << fail_prompt(reply, true) << std::endl;
+                    }
+                } else if (cmd == "defrag") {
+                    uint64_t blocks_per_second = DEFRAG_BLOCKS_PER_SECOND;
+                    if (!(iss >> std::ws).eof() && !(iss >> blocks_per_second)) {
+                        std::cout << "Invalid command format" << std::endl;
+                        continue;
+                    }
+                    client_socket_.send(FS_INSTR_DEFRAG);
+                    client_socket_.send(blocks_per_second);
+                    client_socket_.recv(reply);
+                    if (reply == FS_REPLY_OK) {
+                        std::cout << "Defragmenting in the background" << std::endl;
+                    } else {
+                        std::cout << fail_prompt(reply, false) << std::endl;
+                    }
                 } else {
                     std::cout << "Unknown command: " << cmd << std::endl;
                 }
@@ -194,6 +247,8 @@ namespace cs2313 {
         }
 
     private:
+        static constexpr uint64_t DEFRAG_BLOCKS_PER_SECOND = 4096; // 1 MiB/s read and written
+
         client_socket_handle client_socket_;
         std::string path_prompt_;
 
@@ -221,12 +276,18 @@ namespace cs2313 {
                     str += is_folder_instr ? "directory " : "file ";
                     str += "is in use";
                     break;
+                case FS_REPLY_NOT_EMPTY:
+                    str += "the directory is not empty";
+                    break;
                 case FS_REPLY_CAPACITY_EXCEEDED:
                     str += "capacity exceeded";
                     break;
                 case FS_REPLY_ACCESS_DENIED:
                     str += "access denied";
                     break;
+                case FS_REPLY_DEFRAG_RUNNING:
+                    str += "a defragmentation is already running";
+                    break;
                 case FS_REPLY_UNKNOWN_ERROR:
                 default:
                     str += "unknown error";
@@ -0,0 +1,243 @@
+#ifndef IO_TRACE_H
+#define IO_TRACE_H
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "storage_interface.h"
+#include "utils/except.h"
+
+namespace cs2313 {
+
+    // Binary trace file: an io_trace_header followed by fixed-size io_trace_records in the order
+    // the requests completed. Timestamps are relative to the start of the recording
+    inline static constexpr char IO_TRACE_MAGIC[8] = {'C', 'S', 'I', 'O', 'T', 'R', 'C', '1'};
+
+    struct io_trace_header {
+        char magic[8];
+        disk_description description;
+    };
+
+    struct io_trace_record {
+        uint64_t issue_ns; // when the request was issued
+        uint64_t latency_ns; // until it completed
+        uint64_t sector_addr;
+        uint64_t sectors;
+        uint32_t tid; // issue order
+        io_instr instr; // IO_INSTR_READ_RANGE / WRITE_RANGE for ranges, single-sector READ / WRITE, TRIM, FLUSH
+        io_priority priority;
+        uint16_t reserved;
+    };
+
+    class io_trace_writer {
+    public:
+        io_trace_writer(const char *path, const disk_description &description) {
+            file_ = fopen(path, "wb");
+            if (!file_)
+                throw except(errno, ERROR_IO_TRACE_FILE, "Failed to create trace file");
+            io_trace_header header{};
+            memcpy(header.magic, IO_TRACE_MAGIC, sizeof(IO_TRACE_MAGIC));
+            header.description = description;
+            if (fwrite(&header, sizeof(header), 1, file_) != 1) {
+                fclose(file_);
+                throw except(errno, ERROR_IO_TRACE_FILE, "Failed to write trace file");
+            }
+        }
+
+        ~io_trace_writer() { fclose(file_); }
+
+        io_trace_writer(const io_trace_writer &) = delete;
+
+        io_trace_writer &operator=(const io_trace_writer &) = delete;
+
+        void append(const io_trace_record &record) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            fwrite(&record, sizeof(record), 1, file_); // stdio buffers, the trace is not on the I/O path
+        }
+
+    private:
+        FILE *file_;
+        std::mutex mutex_;
+    };
+
+    inline std::vector<io_trace_record> io_trace_load(const char *path, disk_description &description) {
+        FILE *file = fopen(path, "rb");
+        if (!file)
+            throw except(errno, ERROR_IO_TRACE_FILE, "Failed to open trace file");
+        io_trace_header header;
+        if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, IO_TRACE_MAGIC, sizeof(IO_TRACE_MAGIC)) != 0) {
+            fclose(file);
+            throw except(ERROR_IO_TRACE_FILE, "Not a trace file");
+        }
+        description = header.description;
+        std::vector<io_trace_record> records;
+        io_trace_record record;
+        while (fread(&record, sizeof(record), 1, file) == 1)
+            records.push_back(record);
+        fclose(file);
+        return records;
+    }
+
+    struct io_replay_options {
+        bool original_timing = false; // issue each request at its recorded time instead of as soon as possible
+        uint32_t queue_depth = 1; // requests in flight at most
+    };
+
+    struct io_replay_result {
+        uint64_t elapsed_ns = 0;
+        uint64_t bytes_read = 0, bytes_written = 0;
+        std::vector<uint64_t> read_latency_ns, write_latency_ns, other_latency_ns;
+    };
+
+    // Issues the recorded requests against any storage, from queue_depth threads. Written data is a
+    // fixed pattern: traces carry addresses and sizes only
+    inline io_replay_result io_trace_replay(storage_interface &storage, std::vector<io_trace_record> records,
+                                            const io_replay_options &options) {
+        std::ranges::sort(records, {}, &io_trace_record::issue_ns);
+        const uint64_t bytes_per_sector = storage.get_description().bytes_per_sector;
+        uint64_t max_sectors = 1;
+        for (auto &r: records)
+            if (r.instr != IO_INSTR_TRIM && r.instr != IO_INSTR_FLUSH)
+                max_sectors = std::max(max_sectors, r.sectors);
+
+        io_replay_result result;
+        std::mutex result_mutex;
+        std::atomic<size_t> next(0);
+        const auto start = std::chrono::steady_clock::now();
+        const uint64_t first_ns = records.empty() ? 0 : records.front().issue_ns;
+
+        auto worker = [&] {
+            std::vector<char> buffer(max_sectors * bytes_per_sector, 0x5a);
+            io_replay_result local;
+            for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < records.size();) {
+                const io_trace_record &r = records[i];
+                if (options.original_timing)
+                    std::this_thread::sleep_until(start + std::chrono::nanoseconds(r.issue_ns - first_ns));
+                io_priority_scope priority(r.priority);
+                auto issued = std::chrono::steady_clock::now();
+                switch (r.instr) {
+                    case IO_INSTR_READ:
+                        storage.read(r.sector_addr, buffer.data());
+                        break;
+                    case IO_INSTR_WRITE:
+                        storage.write(r.sector_addr, buffer.data());
+                        break;
+                    case IO_INSTR_READ_RANGE:
+                        storage.read_range(r.sector_addr, r.sectors, buffer.data());
+                        break;
+                    case IO_INSTR_WRITE_RANGE:
+                        storage.write_range(r.sector_addr, r.sectors, buffer.data());
+                        break;
+                    case IO_INSTR_TRIM:
+                        storage.discard(r.sector_addr, r.sectors);
+                        break;
+                    case IO_INSTR_FLUSH:
+                        storage.flush(r.sector_addr, r.sectors);
+                        break;
+                    default:
+                        continue;
+                }
+                uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - issued).count();
+                if (r.instr == IO_INSTR_READ || r.instr == IO_INSTR_READ_RANGE) {
+                    local.read_latency_ns.push_back(latency);
+                    local.bytes_read += r.sectors * bytes_per_sector;
+                } else if (r.instr == IO_INSTR_WRITE || r.instr == IO_INSTR_WRITE_RANGE) {
+                    local.write_latency_ns.push_back(latency);
+                    local.bytes_written += r.sectors * bytes_per_sector;
+                } else {
+                    local.other_latency_ns.push_back(latency);
+                }
+            }
+            std::lock_guard<std::mutex> lock(result_mutex);
+            result.bytes_read += local.bytes_read;
+            result.bytes_written += local.bytes_written;
+            result.read_latency_ns.insert(result.read_latency_ns.end(), local.read_latency_ns.begin(), local.read_latency_ns.end());
+            result.write_latency_ns.insert(result.write_latency_ns.end(), local.write_latency_ns.begin(), local.write_latency_ns.end());
+            result.other_latency_ns.insert(result.other_latency_ns.end(), local.other_latency_ns.begin(), local.other_latency_ns.end());
+        };
+
+        std::vector<std::thread> workers;
+        for (uint32_t i = 0; i < std::max(options.queue_depth, 1u); ++i)
+            workers.emplace_back(worker);
+        for (auto &w: workers)
+            w.join();
+        result.elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    // Decorator recording every request passed to the underlying storage
+    class traced_storage : public storage_interface {
+    public:
+        traced_storage(storage_interface &storage, const char *path) :
+            storage_(storage),
+            writer_(path, storage.get_description()),
+            start_(std::chrono::steady_clock::now()),
+            tid_counter_(0) {}
+
+        void read(const uint64_t sector_addr, char *data) override {
+            traced(IO_INSTR_READ, sector_addr, 1, [&] { storage_.read(sector_addr, data); });
+        }
+
+        void write(const uint64_t sector_addr, const char *data) override {
+            traced(IO_INSTR_WRITE, sector_addr, 1, [&] { storage_.write(sector_addr, data); });
+        }
+
+        void read_range(const uint64_t sector_addr, const uint64_t sectors, char *data) override {
+            traced(IO_INSTR_READ_RANGE, sector_addr, sectors, [&] { storage_.read_range(sector_addr, sectors, data); });
+        }
+
+        void write_range(const uint64_t sector_addr, const uint64_t sectors, const char *data) override {
+            traced(IO_INSTR_WRITE_RANGE, sector_addr, sectors, [&] { storage_.write_range(sector_addr, sectors, data); });
+        }
+
+        void discard(const uint64_t sector_addr, const uint64_t sectors) override {
+            traced(IO_INSTR_TRIM, sector_addr, sectors, [&] { storage_.discard(sector_addr, sectors); });
+        }
+
+        void flush(const uint64_t sector_addr, const uint64_t sectors) override {
+            traced(IO_INSTR_FLUSH, sector_addr, sectors, [&] { storage_.flush(sector_addr, sectors); });
+        }
+
+        disk_description get_description() override {
+            return storage_.get_description();
+        }
+
+        void shutdown() override {
+            storage_.shutdown();
+        }
+
+    private:
+        storage_interface &storage_;
+        io_trace_writer writer_;
+        std::chrono::steady_clock::time_point start_;
+        std::atomic<uint32_t> tid_counter_;
+
+        uint64_t now() const {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+        }
+
+        template<typename F>
+        void traced(const io_instr instr, const uint64_t sector_addr, const uint64_t sectors, F request) {
+            io_trace_record record{};
+            record.tid = tid_counter_.fetch_add(1, std::memory_order_relaxed);
+            record.instr = instr;
+            record.priority = current_io_priority;
+            record.sector_addr = sector_addr;
+            record.sectors = sectors;
+            record.issue_ns = now();
+            request();
+            record.latency_ns = now() - record.issue_ns;
+            writer_.append(record);
+        }
+    };
+
+}
+
+#endif
@@ -0,0 +1,297 @@
+#ifndef MIRRORED_STORAGE_H
+#define MIRRORED_STORAGE_H
+
+#include <set>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <shared_mutex>
+
+#include "storage_array.h"
+#include "utils/except.h"
+
+namespace cs2313 {
+
+    enum mirror_read_policy {
+        MIRROR_READ_SHORTEST_QUEUE, // fewest outstanding requests, ties to the nearest head
+        MIRROR_READ_NEAREST_HEAD // nearest head, ties to the shortest queue
+    };
+
+    // RAID-1 over members of identical geometry. Writes go to every replica in sync, reads to one of
+    // them. A replica failing a request falls out of sync: it is skipped from then on while the
+    // cylinders written meanwhile are recorded, and a background thread copies them over from a
+    // replica in sync until it catches up
+    class mirrored_storage : public storage_interface {
+    public:
+        mirrored_storage(const std::vector<storage_interface *> &members, const mirror_read_policy policy = MIRROR_READ_SHORTEST_QUEUE,
+                         const uint32_t threads_per_member = 4,
+                         const std::chrono::milliseconds resync_interval = std::chrono::milliseconds(1000)) :
+            policy_(policy),
+            resync_interval_(resync_interval),
+            sig_term_(false) {
+            if (members.size() < 2)
+                throw except(ERROR_STORAGE_ARRAY_INVALID, "A mirror needs at least two members");
+            description_ = members[0]->get_description();
+            for (storage_interface *m: members) {
+                disk_description d = m->get_description();
+                if (d.cylinders != description_.cylinders
+                    || d.sectors_per_cylinder != description_.sectors_per_cylinder
+                    || d.bytes_per_sector != description_.bytes_per_sector)
+                    throw except(ERROR_STORAGE_ARRAY_INVALID, "Members of a mirror must have the same geometry");
+                replicas_.push_back(std::make_unique<mirror_replica>(*m, threads_per_member));
+            }
+            sectors_ = description_.cylinders * description_.sectors_per_cylinder;
+            resync_thread_ = std::thread(&mirrored_storage::resync_worker, this);
+        }
+
+        ~mirrored_storage() override {
+            {
+                std::lock_guard<std::mutex> lock(state_mutex_);
+                sig_term_ = true;
+            }
+            resync_cv_.notify_all();
+            resync_thread_.join();
+        }
+
+        void read(const uint64_t sector_addr, char *data) override {
+            check_range(sector_addr, 1);
+            read_from_replica(sector_addr, 1, [&](storage_interface &s) { s.read(sector_addr, data); });
+        }
+
+        void write(const uint64_t sector_addr, const char *data) override {
+            check_range(sector_addr, 1);
+            replicate(sector_addr, 1, [&](storage_interface &s) { s.write(sector_addr, data); });
+        }
+
+        void read_range(const uint64_t sector_addr, const uint64_t sectors, char *data) override {
+            check_range(sector_addr, sectors);
+            read_from_replica(sector_addr, sectors, [&](storage_interface &s) { s.read_range(sector_addr, sectors, data); });
+        }
+
+        void write_range(const uint64_t sector_addr, const uint64_t sectors, const char *data) override {
+            check_range(sector_addr, sectors);
+            replicate(sector_addr, sectors, [&](storage_interface &s) { s.write_range(sector_addr, sectors, data); });
+        }
+
+        void discard(const uint64_t sector_addr, const uint64_t sectors) override {
+            check_range(sector_addr, sectors);
+            replicate(sector_addr, sectors, [&](storage_interface &s) { s.discard(sector_addr, sectors); });
+        }
+
+        void flush(const uint64_t sector_addr, const uint64_t sectors) override {
+            replicate(sector_addr, sectors, [&](storage_interface &s) { s.flush(sector_addr, sectors); }, false);
+        }
+
+        disk_description get_description() override {
+            return description_;
+        }
+
+        void shutdown() override {
+            storage_array_request request;
+            for (auto &r: replicas_)
+                request.add(r->member_, [](storage_interface &s) { s.shutdown(); });
+            request.run();
+        }
+
+        // Replicas currently in sync
+        size_t replicas_in_sync() const {
+            size_t n = 0;
+            for (auto &r: replicas_)
+                if (r->in_sync_.load(std::memory_order_acquire))
+                    ++n;
+            return n;
+        }
+
+        // Requests issued to a replica and not completed yet
+        uint64_t outstanding(const size_t replica) const {
+            return replicas_[replica]->member_.outstanding();
+        }
+
+    private:
+        struct mirror_replica {
+            storage_member member_;
+            std::atomic<bool> in_sync_;
+            std::atomic<uint64_t> head_cylinder_; // where the last request issued to it ended
+            std::set<uint64_t> stale_cylinders_; // written while out of sync; guarded by state_mutex_
+
+            mirror_replica(storage_interface &storage, const uint32_t threads) :
+                member_(storage, threads),
+                in_sync_(true),
+                head_cylinder_(0) {}
+        };
+
+        std::vector<std::unique_ptr<mirror_replica>> replicas_;
+        disk_description description_;
+        uint64_t sectors_;
+        mirror_read_policy policy_;
+
+        // Writes hold it shared; a resync step holds it exclusively so that no write slips between
+        // copying a cylinder and marking it current
+        std::shared_mutex sync_mutex_;
+        std::mutex state_mutex_;
+
+        std::thread resync_thread_;
+        std::condition_variable resync_cv_;
+        std::chrono::milliseconds resync_interval_;
+        bool sig_term_;
+
+        void check_range(const uint64_t sector_addr, const uint64_t sectors) const {
+            if (sector_addr >= sectors_ || sectors > sectors_ - sector_addr)
+                throw except(ERROR_DISK_ADDR_INVALID, "Invalid disk address");
+        }
+
+        uint64_t cylinder_of(const uint64_t sector_addr) const {
+            return sector_addr / description_.sectors_per_cylinder;
+        }
+
+        size_t pick_replica(const uint64_t cylinder) const {
+            size_t best = SIZE_MAX;
+            uint64_t best_queue = 0, best_distance = 0;
+            for (size_t i = 0; i < replicas_.size(); ++i) {
+                const mirror_replica &r = *replicas_[i];
+                if (!r.in_sync_.load(std::memory_order_acquire))
+                    continue;
+                uint64_t queue = r.member_.outstanding();
+                uint64_t head = r.head_cylinder_.load(std::memory_order_relaxed);
+                uint64_t distance = head > cylinder ? head - cylinder : cylinder - head;
+                bool better = best == SIZE_MAX
+                              || (policy_ == MIRROR_READ_SHORTEST_QUEUE
+                                      ? queue < best_queue || (queue == best_queue && distance < best_distance)
+                                      : distance < best_distance || (distance == best_distance && queue < best_queue));
+                if (better) {
+                    best = i;
+                    best_queue = queue;
+                    best_distance = distance;
+                }
+            }
+            return best;
+        }
+
+        // Takes the replica out of sync; the given range may be partially written on it
+        void fail_replica(const size_t replica, const uint64_t sector_addr, const uint64_t sectors) {
+            std::lock_guard<std::mutex> lock(state_mutex_);
+            mirror_replica &r = *replicas_[replica];
+            r.in_sync_.store(false, std::memory_order_release);
+            mark_stale(r, sector_addr, sectors);
+            resync_cv_.notify_all();
+        }
+
+        void mark_stale(mirror_replica &r, const uint64_t sector_addr, const uint64_t sectors) {
+            if (sectors == 0)
+                return;
+            for (uint64_t c = cylinder_of(sector_addr); c <= cylinder_of(sector_addr + sectors - 1); ++c)
+                r.stale_cylinders_.insert(c);
+        }
+
+        template<typename F>
+        void read_from_replica(const uint64_t sector_addr, const uint64_t sectors, F f) {
+            while (true) {
+                size_t i = pick_replica(cylinder_of(sector_addr));
+                if (i == SIZE_MAX)
+                    throw except(ERROR_STORAGE_ARRAY_FAILED, "No replica in sync");
+                mirror_replica &r = *replicas_[i];
+                r.head_cylinder_.store(cylinder_of(sector_addr + sectors - 1), std::memory_order_relaxed);
+                try {
+                    r.member_.execute(f);
+                    return;
+                } catch (except &) {
+                    fail_replica(i, 0, 0); // and retry on another one
+                }
+            }
+        }
+
+        // Runs f on every replica in sync in parallel; the others only note the cylinders as stale.
+        // Fails only if no replica succeeds
+        template<typename F>
+        void replicate(const uint64_t sector_addr, const uint64_t sectors, F f, const bool moves_data = true) {
+            std::shared_lock<std::shared_mutex> sync_lock(sync_mutex_);
+            storage_array_request request;
+            std::atomic<size_t> succeeded(0);
+            std::exception_ptr error;
+            std::mutex error_mutex;
+            {
+                std::lock_guard<std::mutex> lock(state_mutex_);
+                for (size_t i = 0; i < replicas_.size(); ++i) {
+                    mirror_replica &r = *replicas_[i];
+                    if (!r.in_sync_.load(std::memory_order_acquire)) {
+                        if (moves_data)
+                            mark_stale(r, sector_addr, sectors);
+                        continue;
+                    }
+                    if (moves_data)
+                        r.head_cylinder_.store(cylinder_of(sector_addr + sectors - 1), std::memory_order_relaxed);
+                    request.add(r.member_, [&, i](storage_interface &s) {
+                        try {
+                            f(s);
+                            succeeded.fetch_add(1, std::memory_order_relaxed);
+                        } catch (except &) {
+                            fail_replica(i, sector_addr, moves_data ? sectors : 0);
+                            std::lock_guard<std::mutex> error_lock(error_mutex);
+                            if (!error)
+                                error = std::current_exception();
+                        }
+                    });
+                }
+            }
+            request.run();
+            if (succeeded.load(std::memory_order_relaxed) == 0) {
+                if (error)
+                    std::rethrow_exception(error);
+                throw except(ERROR_STORAGE_ARRAY_FAILED, "No replica in sync");
+            }
+        }
+
+        // Copies the stale cylinders of a replica from one in sync; true once it is back in sync
+        bool resync(const size_t replica) {
+            mirror_replica &target = *replicas_[replica];
+            std::vector<char> buffer(description_.sectors_per_cylinder * description_.bytes_per_sector);
+            while (true) {
+                std::unique_lock<std::shared_mutex> sync_lock(sync_mutex_);
+                uint64_t cylinder;
+                {
+                    std::lock_guard<std::mutex> lock(state_mutex_);
+                    if (sig_term_)
+                        return false;
+                    if (target.stale_cylinders_.empty()) {
+                        target.in_sync_.store(true, std::memory_order_release);
+                        return true;
+                    }
+                    cylinder = *target.stale_cylinders_.begin();
+                }
+                size_t source = pick_replica(cylinder);
+                if (source == SIZE_MAX)
+                    return false;
+                try {
+                    uint64_t addr = cylinder * description_.sectors_per_cylinder;
+                    replicas_[source]->member_.execute([&](storage_interface &s) {
+                        s.read_range(addr, description_.sectors_per_cylinder, buffer.data());
+                    });
+                    target.member_.execute([&](storage_interface &s) {
+                        s.write_range(addr, description_.sectors_per_cylinder, buffer.data());
+                    });
+                } catch (except &) {
+                    return false; // either side is still failing, try again later
+                }
+                std::lock_guard<std::mutex> lock(state_mutex_);
+                target.stale_cylinders_.erase(cylinder);
+            }
+        }
+
+        void resync_worker() {
+            std::unique_lock<std::mutex> lock(state_mutex_);
+            while (!sig_term_) {
+                resync_cv_.wait_for(lock, resync_interval_);
+                for (size_t i = 0; i < replicas_.size() && !sig_term_; ++i) {
+                    if (replicas_[i]->in_sync_.load(std::memory_order_acquire))
+                        continue;
+                    lock.unlock();
+                    resync(i);
+                    lock.lock();
+                }
+            }
+        }
+    };
+
+}
+
+#endif
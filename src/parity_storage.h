@@ -0,0 +1,508 @@
+#ifndef PARITY_STORAGE_H
+#define PARITY_STORAGE_H
+
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "storage_array.h"
+#include "utils/except.h"
+#include "utils/parity_kernel.h"
+
+namespace cs2313 {
+
+    // Rows of the array being written; overlapping ranges wait for each other, so that no two
+    // writers update the parity of a row at the same time
+    class row_range_lock {
+    public:
+        void lock(const uint64_t begin, const uint64_t end) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [&] {
+                return std::ranges::none_of(held_, [&](auto &r) { return r.first < end && begin < r.second; });
+            });
+            held_.emplace_back(begin, end);
+        }
+
+        void unlock(const uint64_t begin, const uint64_t end) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                held_.erase(std::ranges::find(held_, std::make_pair(begin, end)));
+            }
+            cv_.notify_all();
+        }
+
+    private:
+        std::vector<std::pair<uint64_t, uint64_t>> held_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+    };
+
+    // RAID-5 over members of identical geometry, or RAID-6 with q_syndrome. A row is one stripe unit
+    // at the same address on every member: n - 1 (or n - 2) data units, the P unit (XOR of the data)
+    // and optionally the Q unit (Reed-Solomon syndrome over GF(2^8)). P and Q rotate to the left by
+    // one member per row, data units follow them. A member failing a request is taken out and its
+    // units are reconstructed from the others until as many members as there are syndromes failed
+    class parity_storage : public storage_interface {
+    public:
+        parity_storage(const std::vector<storage_interface *> &members, const uint64_t stripe_unit_sectors,
+                       const bool q_syndrome = false, const uint32_t threads_per_member = 4) :
+            unit_(stripe_unit_sectors),
+            syndromes_(q_syndrome ? 2 : 1) {
+            if (members.size() < syndromes_ + 2)
+                throw except(ERROR_STORAGE_ARRAY_INVALID, "Too few members for a parity array");
+            member_description_ = members[0]->get_description();
+            for (storage_interface *m: members) {
+                disk_description d = m->get_description();
+                if (d.cylinders != member_description_.cylinders
+                    || d.sectors_per_cylinder != member_description_.sectors_per_cylinder
+                    || d.bytes_per_sector != member_description_.bytes_per_sector)
+                    throw except(ERROR_STORAGE_ARRAY_INVALID, "Members of a parity array must have the same geometry");
+                members_.push_back(std::make_unique<parity_array_member>(*m, threads_per_member));
+            }
+            if (unit_ == 0 || member_description_.sectors_per_cylinder % unit_ != 0)
+                throw except(ERROR_STORAGE_ARRAY_INVALID, "Stripe unit must divide the sectors per cylinder");
+            data_units_ = members_.size() - syndromes_;
+            bytes_per_sector_ = member_description_.bytes_per_sector;
+            unit_bytes_ = unit_ * bytes_per_sector_;
+            sectors_ = member_description_.cylinders * member_description_.sectors_per_cylinder * data_units_;
+        }
+
+        void read(const uint64_t sector_addr, char *data) override {
+            read_range(sector_addr, 1, data);
+        }
+
+        void write(const uint64_t sector_addr, const char *data) override {
+            write_range(sector_addr, 1, data);
+        }
+
+        void read_range(const uint64_t sector_addr, const uint64_t sectors, char *data) override {
+            check_range(sector_addr, sectors);
+            std::vector<parity_piece> pieces = split(sector_addr, sectors);
+
+            // Pieces on one member are read with a single request, parity units in between included
+            std::vector<std::vector<const parity_piece *>> by_member(members_.size());
+            std::vector<const parity_piece *> lost;
+            for (auto &p: pieces) {
+                size_t m = data_member(p.row_, p.unit_);
+                if (failed(m))
+                    lost.push_back(&p);
+                else
+                    by_member[m].push_back(&p);
+            }
+            std::mutex lost_mutex;
+            storage_array_request request;
+            for (size_t m = 0; m < members_.size(); ++m) {
+                if (by_member[m].empty())
+                    continue;
+                request.add(members_[m]->member_, [&, m](storage_interface &s) {
+                    auto &list = by_member[m];
+                    try {
+                        if (list.size() == 1) {
+                            s.read_range(member_addr(*list[0]), list[0]->sectors_, data + list[0]->offset_ * bytes_per_sector_);
+                        } else {
+                            uint64_t begin = member_addr(*list.front()), end = member_addr(*list.back()) + list.back()->sectors_;
+                            std::vector<char> buffer((end - begin) * bytes_per_sector_);
+                            s.read_range(begin, end - begin, buffer.data());
+                            for (auto *p: list)
+                                memcpy(data + p->offset_ * bytes_per_sector_, buffer.data() + (member_addr(*p) - begin) * bytes_per_sector_,
+                                       p->sectors_ * bytes_per_sector_);
+                        }
+                    } catch (except &) {
+                        fail(m);
+                        std::lock_guard<std::mutex> lock(lost_mutex);
+                        lost.insert(lost.end(), list.begin(), list.end());
+                    }
+                });
+            }
+            request.run();
+
+            // Degraded mode: rebuild the rest from the other units of their rows
+            for (const parity_piece *p: lost) {
+                row_guard guard(rows_, p->row_, p->row_ + 1);
+                std::vector<bool> need(data_units_, false);
+                need[p->unit_] = true;
+                auto units = read_row(p->row_, p->first_, p->first_ + p->sectors_, need);
+                memcpy(data + p->offset_ * bytes_per_sector_, units[p->unit_].data(), p->sectors_ * bytes_per_sector_);
+            }
+        }
+
+        void write_range(const uint64_t sector_addr, const uint64_t sectors, const char *data) override {
+            check_range(sector_addr, sectors);
+            update(sector_addr, sectors, data);
+        }
+
+        // Discarded data reads back as zeros, so parity stays consistent if whole rows are discarded
+        // on every member; partial rows are written with zeros
+        void discard(const uint64_t sector_addr, const uint64_t sectors) override {
+            check_range(sector_addr, sectors);
+            update(sector_addr, sectors, nullptr);
+        }
+
+        void flush(const uint64_t sector_addr, const uint64_t sectors) override {
+            uint64_t begin = 0, end = 0;
+            if (sectors != 0) {
+                check_range(sector_addr, sectors);
+                begin = sector_addr / unit_ / data_units_ * unit_;
+                end = ((sector_addr + sectors - 1) / unit_ / data_units_ + 1) * unit_;
+            }
+            storage_array_request request;
+            for (size_t m = 0; m < members_.size(); ++m)
+                if (!failed(m))
+                    request.add(members_[m]->member_, [this, m, begin, end](storage_interface &s) {
+                        try {
+                            s.flush(begin, end - begin);
+                        } catch (except &) {
+                            fail(m);
+                        }
+                    });
+            request.run();
+            check_failures();
+        }
+
+        disk_description get_description() override {
+            return {member_description_.cylinders, member_description_.sectors_per_cylinder * data_units_, bytes_per_sector_};
+        }
+
+        void shutdown() override {
+            storage_array_request request;
+            for (size_t m = 0; m < members_.size(); ++m)
+                request.add(members_[m]->member_, [this, m](storage_interface &s) {
+                    try {
+                        s.shutdown();
+                    } catch (except &) {
+                        fail(m);
+                    }
+                });
+            request.run();
+        }
+
+        size_t failed_members() const {
+            size_t n = 0;
+            for (auto &m: members_)
+                if (m->failed_.load(std::memory_order_acquire))
+                    ++n;
+            return n;
+        }
+
+    private:
+        struct parity_array_member {
+            storage_member member_;
+            std::atomic<bool> failed_;
+
+            parity_array_member(storage_interface &storage, const uint32_t threads) :
+                member_(storage, threads),
+                failed_(false) {}
+        };
+
+        // The part of a request inside one data unit
+        struct parity_piece {
+            uint64_t row_;
+            size_t unit_; // data unit index in the row
+            uint64_t first_; // sector in the unit
+            uint64_t sectors_;
+            uint64_t offset_; // in sectors from the start of the request
+        };
+
+        struct member_io {
+            size_t member_;
+            uint64_t addr_;
+            uint64_t sectors_;
+            char *data_;
+        };
+
+        class row_guard {
+        public:
+            row_guard(row_range_lock &lock, const uint64_t begin, const uint64_t end) :
+                lock_(lock), begin_(begin), end_(end) { lock_.lock(begin_, end_); }
+
+            ~row_guard() { lock_.unlock(begin_, end_); }
+
+        private:
+            row_range_lock &lock_;
+            uint64_t begin_, end_;
+        };
+
+        std::vector<std::unique_ptr<parity_array_member>> members_;
+        disk_description member_description_;
+        uint64_t unit_;
+        size_t syndromes_;
+        size_t data_units_;
+        uint64_t bytes_per_sector_;
+        uint64_t unit_bytes_;
+        uint64_t sectors_;
+        row_range_lock rows_;
+
+        size_t p_member(const uint64_t row) const {
+            return members_.size() - 1 - row % members_.size();
+        }
+
+        size_t q_member(const uint64_t row) const {
+            return (p_member(row) + 1) % members_.size();
+        }
+
+        size_t data_member(const uint64_t row, const size_t unit) const {
+            return (p_member(row) + syndromes_ + unit) % members_.size();
+        }
+
+        uint64_t member_addr(const parity_piece &p) const {
+            return p.row_ * unit_ + p.first_;
+        }
+
+        bool failed(const size_t member) const {
+            return members_[member]->failed_.load(std::memory_order_acquire);
+        }
+
+        void fail(const size_t member) {
+            members_[member]->failed_.store(true, std::memory_order_release);
+        }
+
+        void check_failures() const {
+            if (failed_members() > syndromes_)
+                throw except(ERROR_STORAGE_ARRAY_FAILED, "Too many failed members in the parity array");
+        }
+
+        void check_range(const uint64_t sector_addr, const uint64_t sectors) const {
+            if (sector_addr >= sectors_ || sectors > sectors_ - sector_addr)
+                throw except(ERROR_DISK_ADDR_INVALID, "Invalid disk address");
+        }
+
+        std::vector<parity_piece> split(const uint64_t sector_addr, const uint64_t sectors) const {
+            std::vector<parity_piece> pieces;
+            for (uint64_t addr = sector_addr; addr < sector_addr + sectors;) {
+                uint64_t n = std::min(unit_ - addr % unit_, sector_addr + sectors - addr);
+                uint64_t unit = addr / unit_;
+                pieces.push_back({unit / data_units_, unit % data_units_, addr % unit_, n, addr - sector_addr});
+                addr += n;
+            }
+            return pieces;
+        }
+
+        // Runs the transfers in parallel; a member failing one is taken out. False if any failed
+        bool transfer(const std::vector<member_io> &ios, const bool write) {
+            std::atomic<bool> ok(true);
+            storage_array_request request;
+            for (auto &io: ios) {
+                if (failed(io.member_)) {
+                    ok = false;
+                    continue;
+                }
+                request.add(members_[io.member_]->member_, [&](storage_interface &s) {
+                    try {
+                        if (write)
+                            s.write_range(io.addr_, io.sectors_, io.data_);
+                        else
+                            s.read_range(io.addr_, io.sectors_, io.data_);
+                    } catch (except &) {
+                        fail(io.member_);
+                        ok = false;
+                    }
+                });
+            }
+            request.run();
+            return ok;
+        }
+
+        // Sectors [begin, end) of the data units of a row marked in need; a unit on a failed member
+        // is reconstructed from the other data units and the syndromes
+        std::vector<std::vector<char>> read_row(const uint64_t row, const uint64_t begin, const uint64_t end,
+                                                const std::vector<bool> &need) {
+            const uint64_t sectors = end - begin, bytes = sectors * bytes_per_sector_;
+            while (true) {
+                std::vector<std::vector<char>> units(data_units_, std::vector<char>(bytes));
+                std::vector<char> p(bytes), q(bytes);
+                std::vector<size_t> missing;
+                for (size_t j = 0; j < data_units_; ++j)
+                    if (failed(data_member(row, j)))
+                        missing.push_back(j);
+                bool rebuild = std::ranges::any_of(missing, [&](size_t j) { return need[j]; });
+
+                std::vector<member_io> ios;
+                for (size_t j = 0; j < data_units_; ++j)
+                    if ((need[j] || rebuild) && !failed(data_member(row, j)))
+                        ios.push_back({data_member(row, j), row * unit_ + begin, sectors, units[j].data()});
+                bool p_ok = rebuild && !failed(p_member(row));
+                bool q_ok = rebuild && syndromes_ == 2 && !failed(q_member(row));
+                if (p_ok)
+                    ios.push_back({p_member(row), row * unit_ + begin, sectors, p.data()});
+                if (q_ok)
+                    ios.push_back({q_member(row), row * unit_ + begin, sectors, q.data()});
+                if (!transfer(ios, false)) {
+                    check_failures();
+                    continue; // another member failed meanwhile, plan again
+                }
+                if (!rebuild)
+                    return units;
+
+                std::vector<const char *> sources;
+                for (auto &u: units)
+                    sources.push_back(u.data()); // units still missing are zero-filled
+                if (missing.size() == 1 && p_ok) {
+                    size_t x = missing[0];
+                    sources[x] = p.data();
+                    parity_compute(units[x].data(), nullptr, sources.data(), sources.size(), bytes);
+                } else if (missing.size() == 1 && q_ok) {
+                    size_t x = missing[0];
+                    std::vector<char> partial(bytes);
+                    parity_compute(nullptr, partial.data(), sources.data(), sources.size(), bytes);
+                    parity_xor(partial.data(), q.data(), bytes);
+                    parity_mul_add(units[x].data(), partial.data(), gf_inv(gf_pow2(x)), bytes);
+                } else if (missing.size() == 2 && p_ok && q_ok) {
+                    size_t x = missing[0], y = missing[1];
+                    std::vector<char> pxy(bytes), qxy(bytes);
+                    parity_compute(pxy.data(), qxy.data(), sources.data(), sources.size(), bytes);
+                    parity_xor(pxy.data(), p.data(), bytes); // D_x ^ D_y
+                    parity_xor(qxy.data(), q.data(), bytes); // 2^x D_x ^ 2^y D_y
+                    uint8_t denominator = gf_inv(gf_pow2(x) ^ gf_pow2(y));
+                    parity_mul_add(units[x].data(), pxy.data(), gf_mul(gf_pow2(y), denominator), bytes);
+                    parity_mul_add(units[x].data(), qxy.data(), denominator, bytes);
+                    parity_xor(pxy.data(), units[x].data(), bytes);
+                    units[y] = std::move(pxy);
+                } else {
+                    throw except(ERROR_STORAGE_ARRAY_FAILED, "Too many failed members in the parity array");
+                }
+                return units;
+            }
+        }
+
+        void update(const uint64_t sector_addr, const uint64_t sectors, const char *data) {
+            std::vector<parity_piece> pieces = split(sector_addr, sectors);
+            row_guard guard(rows_, pieces.front().row_, pieces.back().row_ + 1);
+            std::vector<char> zeros(data ? 0 : unit_bytes_);
+            auto source = [&](const parity_piece &p) {
+                return data ? data + p.offset_ * bytes_per_sector_ : zeros.data();
+            };
+
+            // Only the first and the last row can be partial
+            auto full = [&](size_t i) {
+                return pieces.size() - i >= data_units_ && pieces[i].unit_ == 0 && pieces[i].first_ == 0
+                       && pieces[i + data_units_ - 1].sectors_ == unit_ && pieces[i + data_units_ - 1].first_ == 0;
+            };
+            size_t i = 0;
+            if (!full(0)) {
+                size_t k = 0;
+                while (k < pieces.size() && pieces[k].row_ == pieces[0].row_)
+                    ++k;
+                update_partial_row(pieces.data(), k, source);
+                i = k;
+            }
+            size_t k = i;
+            while (k < pieces.size() && full(k))
+                k += data_units_;
+            if (k > i)
+                update_full_rows(pieces[i].row_, (k - i) / data_units_, data ? data + pieces[i].offset_ * bytes_per_sector_ : nullptr);
+            if (k < pieces.size())
+                update_partial_row(pieces.data() + k, pieces.size() - k, source);
+            check_failures();
+        }
+
+        // Full-stripe writes: parity comes from the new data alone, nothing is read
+        void update_full_rows(const uint64_t first_row, const uint64_t rows, const char *data) {
+            if (!data) {
+                storage_array_request request;
+                for (size_t m = 0; m < members_.size(); ++m)
+                    if (!failed(m))
+                        request.add(members_[m]->member_, [this, m, first_row, rows](storage_interface &s) {
+                            try {
+                                s.discard(first_row * unit_, rows * unit_);
+                            } catch (except &) {
+                                fail(m);
+                            }
+                        });
+                request.run();
+                return;
+            }
+            std::vector<std::vector<char>> buffers(members_.size(), std::vector<char>(rows * unit_bytes_));
+            std::vector<const char *> sources(data_units_);
+            for (uint64_t r = 0; r < rows; ++r) {
+                uint64_t row = first_row + r;
+                for (size_t j = 0; j < data_units_; ++j) {
+                    sources[j] = data + (r * data_units_ + j) * unit_bytes_;
+                    memcpy(buffers[data_member(row, j)].data() + r * unit_bytes_, sources[j], unit_bytes_);
+                }
+                parity_compute(buffers[p_member(row)].data() + r * unit_bytes_,
+                               syndromes_ == 2 ? buffers[q_member(row)].data() + r * unit_bytes_ : nullptr,
+                               sources.data(), data_units_, unit_bytes_);
+            }
+            std::vector<member_io> ios;
+            for (size_t m = 0; m < members_.size(); ++m)
+                ios.push_back({m, first_row * unit_, rows * unit_, buffers[m].data()});
+            transfer(ios, true);
+        }
+
+        // Sub-stripe write of the pieces of one row, by read-modify-write (old data of the pieces and
+        // old syndromes) or by reconstruct-write (old data of the rest of the row), whichever reads less
+        template<typename S>
+        void update_partial_row(const parity_piece *pieces, const size_t count, S source) {
+            const uint64_t row = pieces[0].row_;
+            uint64_t begin = unit_, end = 0;
+            for (size_t i = 0; i < count; ++i) {
+                begin = std::min(begin, pieces[i].first_);
+                end = std::max(end, pieces[i].first_ + pieces[i].sectors_);
+            }
+            const uint64_t bytes = (end - begin) * bytes_per_sector_;
+            std::vector<bool> covered(data_units_, false);
+            for (size_t i = 0; i < count; ++i)
+                covered[pieces[i].unit_] = pieces[i].first_ == begin && pieces[i].sectors_ == end - begin;
+            size_t reconstruct_reads = std::ranges::count(covered, false);
+            size_t rmw_reads = count + syndromes_;
+            bool rmw_possible = !failed(p_member(row)) && (syndromes_ == 1 || !failed(q_member(row)));
+            for (size_t i = 0; i < count; ++i)
+                rmw_possible = rmw_possible && !failed(data_member(row, pieces[i].unit_));
+
+            std::vector<char> p(bytes), q(syndromes_ == 2 ? bytes : 0);
+            std::vector<member_io> ios;
+            if (rmw_possible && rmw_reads < reconstruct_reads) {
+                std::vector<std::vector<char>> old(count);
+                for (size_t i = 0; i < count; ++i) {
+                    old[i].resize(pieces[i].sectors_ * bytes_per_sector_);
+                    ios.push_back({data_member(row, pieces[i].unit_), member_addr(pieces[i]), pieces[i].sectors_, old[i].data()});
+                }
+                ios.push_back({p_member(row), row * unit_ + begin, end - begin, p.data()});
+                if (syndromes_ == 2)
+                    ios.push_back({q_member(row), row * unit_ + begin, end - begin, q.data()});
+                if (transfer(ios, false)) {
+                    ios.clear();
+                    for (size_t i = 0; i < count; ++i) {
+                        const uint64_t at = (pieces[i].first_ - begin) * bytes_per_sector_, n = old[i].size();
+                        parity_xor(old[i].data(), source(pieces[i]), n); // delta of the data unit
+                        parity_xor(p.data() + at, old[i].data(), n);
+                        if (syndromes_ == 2)
+                            parity_mul_add(q.data() + at, old[i].data(), gf_pow2(pieces[i].unit_), n);
+                        ios.push_back({data_member(row, pieces[i].unit_), member_addr(pieces[i]), pieces[i].sectors_,
+                                       const_cast<char *>(source(pieces[i]))});
+                    }
+                    ios.push_back({p_member(row), row * unit_ + begin, end - begin, p.data()});
+                    if (syndromes_ == 2)
+                        ios.push_back({q_member(row), row * unit_ + begin, end - begin, q.data()});
+                    transfer(ios, true);
+                    return;
+                }
+                check_failures();
+                ios.clear(); // a member failed while reading, reconstruct instead
+            }
+
+            std::vector<bool> need(data_units_);
+            for (size_t j = 0; j < data_units_; ++j)
+                need[j] = !covered[j];
+            auto units = read_row(row, begin, end, need);
+            for (size_t i = 0; i < count; ++i)
+                memcpy(units[pieces[i].unit_].data() + (pieces[i].first_ - begin) * bytes_per_sector_, source(pieces[i]),
+                       pieces[i].sectors_ * bytes_per_sector_);
+            std::vector<const char *> sources;
+            for (auto &u: units)
+                sources.push_back(u.data());
+            parity_compute(p.data(), syndromes_ == 2 ? q.data() : nullptr, sources.data(), data_units_, bytes);
+            for (size_t i = 0; i < count; ++i)
+                ios.push_back({data_member(row, pieces[i].unit_), member_addr(pieces[i]), pieces[i].sectors_,
+                               const_cast<char *>(source(pieces[i]))});
+            ios.push_back({p_member(row), row * unit_ + begin, end - begin, p.data()});
+            if (syndromes_ == 2)
+                ios.push_back({q_member(row), row * unit_ + begin, end - begin, q.data()});
+            transfer(ios, true);
+        }
+    };
+
+}
+
+#endif
@@ -30,6 +30,24 @@ namespace cs2313 {
             memcpy(&storage_[addr * bytes_per_sector_], data, bytes_per_sector_);
         }
 
+        void read_range(const uint64_t addr, const uint64_t sectors, char *data) override {
+            if (!is_valid_range(addr, sectors))
+                throw except(ERROR_DISK_ADDR_INVALID, "Invalid disk address");
+            memcpy(data, &storage_[addr * bytes_per_sector_], sectors * bytes_per_sector_);
+        }
+
+        void write_range(const uint64_t addr, const uint64_t sectors, const char *data) override {
+            if (!is_valid_range(addr, sectors))
+                throw except(ERROR_DISK_ADDR_INVALID, "Invalid disk address");
+            memcpy(&storage_[addr * bytes_per_sector_], data, sectors * bytes_per_sector_);
+        }
+
+        void discard(const uint64_t addr, const uint64_t sectors) override {
+            if (!is_valid_range(addr, sectors))
+                throw except(ERROR_DISK_ADDR_INVALID, "Invalid disk address");
+            memset(&storage_[addr * bytes_per_sector_], 0, sectors * bytes_per_sector_);
+        }
+
         disk_description get_description() override {
             return {cylinders_, sectors_per_cylinder_, bytes_per_sector_};
         }
@@ -49,6 +67,10 @@ namespace cs2313 {
         bool is_valid_addr(const uint64_t addr) const {
             return addr < cylinders_ * sectors_per_cylinder_;
         }
+
+        bool is_valid_range(const uint64_t addr, const uint64_t sectors) const {
+            return addr < cylinders_ * sectors_per_cylinder_ && sectors <= cylinders_ * sectors_per_cylinder_ - addr;
+        }
     };
 
 }
@@ -0,0 +1,161 @@
+#ifndef STORAGE_ARRAY_H
+#define STORAGE_ARRAY_H
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+
+#include "storage_interface.h"
+
+namespace cs2313 {
+
+    // One backend of a storage array. Backends are synchronous, so each member keeps a few threads
+    // of its own to let the parts of a split request proceed on all members at once
+    class storage_member {
+    public:
+        storage_member(storage_interface &storage, const uint32_t threads) :
+            storage_(storage),
+            outstanding_(0),
+            sig_term_(false) {
+            for (uint32_t i = 0; i < threads; ++i)
+                workers_.emplace_back(&storage_member::worker, this);
+        }
+
+        ~storage_member() {
+            {
+                std::lock_guard<std::mutex> lock(jobs_mutex_);
+                sig_term_ = true;
+            }
+            jobs_cv_.notify_all();
+            for (auto &w: workers_)
+                w.join();
+        }
+
+        storage_member(const storage_member &) = delete;
+
+        storage_member &operator=(const storage_member &) = delete;
+
+        storage_interface &storage() { return storage_; }
+
+        // Requests issued to this member and not completed yet, queued ones included
+        uint64_t outstanding() const { return outstanding_.load(std::memory_order_relaxed); }
+
+        // Runs f(storage) in the calling thread
+        template<typename F>
+        void execute(F &&f) {
+            outstanding_.fetch_add(1, std::memory_order_relaxed);
+            try {
+                f(storage_);
+            } catch (...) {
+                outstanding_.fetch_sub(1, std::memory_order_relaxed);
+                throw;
+            }
+            outstanding_.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        // Runs job on one of the member threads, with the priority of the submitting thread
+        void submit(std::function<void()> job) {
+            outstanding_.fetch_add(1, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock(jobs_mutex_);
+                jobs_.push_back({std::move(job), current_io_priority});
+            }
+            jobs_cv_.notify_one();
+        }
+
+    private:
+        struct member_job {
+            std::function<void()> job_;
+            io_priority priority_;
+        };
+
+        storage_interface &storage_;
+        std::atomic<uint64_t> outstanding_;
+
+        std::vector<std::thread> workers_;
+        std::deque<member_job> jobs_;
+        std::mutex jobs_mutex_;
+        std::condition_variable jobs_cv_;
+        bool sig_term_;
+
+        void worker() {
+            while (true) {
+                member_job job;
+                {
+                    std::unique_lock<std::mutex> lock(jobs_mutex_);
+                    jobs_cv_.wait(lock, [this] { return sig_term_ || !jobs_.empty(); });
+                    if (jobs_.empty())
+                        return;
+                    job = std::move(jobs_.front());
+                    jobs_.pop_front();
+                }
+                io_priority_scope priority(job.priority_);
+                job.job_(); // never throws, see storage_array_request
+                outstanding_.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    // A request split into parts on several members. run() executes the first part in the calling
+    // thread and the others on the member threads, waits for all of them and rethrows the first error
+    class storage_array_request {
+    public:
+        template<typename F>
+        void add(storage_member &member, F f) {
+            parts_.push_back({&member, std::function<void(storage_interface &)>(std::move(f))});
+        }
+
+        void run() {
+            if (parts_.empty())
+                return;
+            remaining_ = parts_.size() - 1;
+            for (size_t i = 1; i < parts_.size(); ++i) {
+                parts_[i].member_->submit([this, i] {
+                    try {
+                        parts_[i].f_(parts_[i].member_->storage());
+                    } catch (...) {
+                        fail(std::current_exception());
+                    }
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (--remaining_ == 0)
+                        cv_.notify_one();
+                });
+            }
+            try {
+                parts_[0].member_->execute(parts_[0].f_);
+            } catch (...) {
+                fail(std::current_exception());
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return remaining_ == 0; });
+            if (error_)
+                std::rethrow_exception(error_);
+        }
+
+    private:
+        struct request_part {
+            storage_member *member_;
+            std::function<void(storage_interface &)> f_;
+        };
+
+        std::vector<request_part> parts_;
+        size_t remaining_ = 0;
+        std::exception_ptr error_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+
+        void fail(std::exception_ptr error) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_)
+                error_ = std::move(error);
+        }
+    };
+
+}
+
+#endif
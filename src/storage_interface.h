@@ -11,12 +11,43 @@ namespace cs2313 {
         uint64_t bytes_per_sector;
     };
 
+    struct drive_stats {
+        uint64_t requests;
+        uint64_t sectors;
+        uint64_t seek_cylinders;
+        uint64_t service_ns; // simulated time the head spent seeking, rotating and transferring
+        uint64_t clock_ns; // simulated time of the last completion
+        uint64_t cache_hits; // requests served from the track buffer
+        uint64_t destaged_sectors; // buffered writes written to the media
+    };
+
     class storage_interface {
     public:
         virtual void read(uint64_t sector_addr, char *data) = 0;
 
         virtual void write(uint64_t sector_addr, const char *data) = 0;
 
+        // Multi-sector transfers; devices that can move a run of sectors at once override these
+
+        virtual void read_range(const uint64_t sector_addr, const uint64_t sectors, char *data) {
+            const uint64_t bytes_per_sector = get_description().bytes_per_sector;
+            for (uint64_t i = 0; i < sectors; ++i)
+                read(sector_addr + i, data + i * bytes_per_sector);
+        }
+
+        virtual void write_range(const uint64_t sector_addr, const uint64_t sectors, const char *data) {
+            const uint64_t bytes_per_sector = get_description().bytes_per_sector;
+            for (uint64_t i = 0; i < sectors; ++i)
+                write(sector_addr + i, data + i * bytes_per_sector);
+        }
+
+        // Tells the device the range holds no live data any more; it reads back as zeros afterwards
+        virtual void discard(const uint64_t, const uint64_t) {}
+
+        // Barrier: everything written before the call is durable once it returns.
+        // Covers the given range, or the whole device if sectors == 0
+        virtual void flush(const uint64_t, const uint64_t) {}
+
         virtual disk_description get_description() = 0;
 
         virtual void shutdown() = 0;
@@ -28,7 +59,67 @@ namespace cs2313 {
     inline static constexpr io_instr IO_INSTR_GET_DESC = 0, // only in constructor, not as an transaction
                                      IO_INSTR_READ = 1,
                                      IO_INSTR_WRITE = 2,
-                                     IO_INSTR_SHUTDOWN = 3;
+                                     IO_INSTR_SHUTDOWN = 3,
+                                     IO_INSTR_READ_RANGE = 4,
+                                     IO_INSTR_WRITE_RANGE = 5,
+                                     IO_INSTR_TRIM = 6,
+                                     IO_INSTR_FLUSH = 7,
+                                     IO_INSTR_GET_STATS = 8,
+                                     IO_INSTR_COMPLETE_BATCH = 9, // as a request: opt in to batched acknowledgements
+                                     IO_INSTR_CHECKSUM_ERROR = 10, // reply only: a checksummed write arrived damaged and was dropped
+                                     IO_INSTR_GET_CAPS = 11, // only in constructor, followed by IO_INSTR_GET_DESC
+                                     IO_INSTR_ADDR_ERROR = 12; // reply only: the request was empty, reached past the drive or exceeded max_transfer_sectors
+
+    // Set on a queued request (READ, WRITE, ranges, TRIM) whose tid is followed by an io_priority byte
+    inline static constexpr io_instr IO_INSTR_PRIORITY_FLAG = 0x80;
+
+    // Set on READ, WRITE and the ranges: the sector data of the request (writes) or of the reply
+    // (reads) is followed by one CRC-32C (u32) per sector
+    inline static constexpr io_instr IO_INSTR_CHECKSUM_FLAG = 0x40;
+
+    // What a drive supports, answered to IO_INSTR_GET_CAPS. A drive older than that request does not
+    // answer it at all, and is taken to be version 0 with the single-sector requests only
+    struct io_capabilities {
+        uint32_t version;
+        uint32_t features; // IO_FEATURE_*
+        uint64_t max_transfer_sectors; // per request (0: no limit)
+        uint32_t max_queue_depth; // outstanding requests per connection (0: no limit)
+        uint32_t reserved;
+    };
+
+    inline static constexpr uint32_t IO_PROTOCOL_VERSION = 1;
+
+    inline static constexpr uint32_t IO_FEATURE_RANGE = 1 << 0, // READ_RANGE, WRITE_RANGE
+                                     IO_FEATURE_TRIM = 1 << 1,
+                                     IO_FEATURE_FLUSH = 1 << 2,
+                                     IO_FEATURE_STATS = 1 << 3,
+                                     IO_FEATURE_BATCH_COMPLETIONS = 1 << 4,
+                                     IO_FEATURE_PRIORITY = 1 << 5,
+                                     IO_FEATURE_CHECKSUMS = 1 << 6, // checksummed frames
+                                     IO_FEATURE_CHECKSUM_TABLE = 1 << 7; // read checksums are those stored with the data
+
+    typedef unsigned char io_priority;
+    inline static constexpr io_priority IO_PRIORITY_META = 0, // served ahead of the head sweep
+                                        IO_PRIORITY_NORMAL = 1;
+
+    // Priority of the requests the current thread issues
+    inline thread_local io_priority current_io_priority = IO_PRIORITY_NORMAL;
+
+    class io_priority_scope {
+    public:
+        explicit io_priority_scope(const io_priority priority): saved_(current_io_priority) {
+            current_io_priority = priority;
+        }
+
+        ~io_priority_scope() { current_io_priority = saved_; }
+
+        io_priority_scope(const io_priority_scope &) = delete;
+
+        io_priority_scope &operator=(const io_priority_scope &) = delete;
+
+    private:
+        io_priority saved_;
+    };
 }
 
 
@@ -0,0 +1,193 @@
+#ifndef STRIPED_STORAGE_H
+#define STRIPED_STORAGE_H
+
+#include <memory>
+#include <vector>
+#include <cstring>
+
+#include "storage_array.h"
+#include "utils/except.h"
+
+namespace cs2313 {
+
+    // RAID-0 over members of identical geometry. Stripe unit i lives on member i % n, at unit i / n of
+    // that member; a cylinder of the array is the same cylinder on every member
+    class striped_storage : public storage_interface {
+    public:
+        striped_storage(const std::vector<storage_interface *> &members, const uint64_t stripe_unit_sectors,
+                        const uint32_t threads_per_member = 4) :
+            unit_(stripe_unit_sectors) {
+            if (members.empty())
+                throw except(ERROR_STORAGE_ARRAY_INVALID, "No members in the stripe set");
+            member_description_ = members[0]->get_description();
+            for (storage_interface *m: members) {
+                disk_description d = m->get_description();
+                if (d.cylinders != member_description_.cylinders
+                    || d.sectors_per_cylinder != member_description_.sectors_per_cylinder
+                    || d.bytes_per_sector != member_description_.bytes_per_sector)
+                    throw except(ERROR_STORAGE_ARRAY_INVALID, "Members of a stripe set must have the same geometry");
+                members_.push_back(std::make_unique<storage_member>(*m, threads_per_member));
+            }
+            if (unit_ == 0 || member_description_.sectors_per_cylinder % unit_ != 0)
+                throw except(ERROR_STORAGE_ARRAY_INVALID, "Stripe unit must divide the sectors per cylinder");
+            bytes_per_sector_ = member_description_.bytes_per_sector;
+            sectors_ = member_description_.cylinders * member_description_.sectors_per_cylinder * members_.size();
+        }
+
+        void read(const uint64_t sector_addr, char *data) override {
+            check_range(sector_addr, 1);
+            members_[member_of(sector_addr)]->execute([&](storage_interface &s) { s.read(member_addr(sector_addr), data); });
+        }
+
+        void write(const uint64_t sector_addr, const char *data) override {
+            check_range(sector_addr, 1);
+            members_[member_of(sector_addr)]->execute([&](storage_interface &s) { s.write(member_addr(sector_addr), data); });
+        }
+
+        void read_range(const uint64_t sector_addr, const uint64_t sectors, char *data) override {
+            check_range(sector_addr, sectors);
+            std::vector<stripe_extent> extents = split(sector_addr, sectors);
+            storage_array_request request;
+            for (auto &e: extents) {
+                if (e.pieces_.size() == 1) {
+                    char *target = data + e.pieces_[0].offset_ * bytes_per_sector_;
+                    request.add(*members_[e.member_], [&e, target](storage_interface &s) {
+                        s.read_range(e.addr_, e.sectors_, target);
+                    });
+                } else {
+                    request.add(*members_[e.member_], [this, &e, data](storage_interface &s) {
+                        std::vector<char> buffer(e.sectors_ * bytes_per_sector_);
+                        s.read_range(e.addr_, e.sectors_, buffer.data());
+                        scatter(e, buffer.data(), data);
+                    });
+                }
+            }
+            request.run();
+        }
+
+        void write_range(const uint64_t sector_addr, const uint64_t sectors, const char *data) override {
+            check_range(sector_addr, sectors);
+            std::vector<stripe_extent> extents = split(sector_addr, sectors);
+            storage_array_request request;
+            for (auto &e: extents) {
+                if (e.pieces_.size() == 1) {
+                    const char *source = data + e.pieces_[0].offset_ * bytes_per_sector_;
+                    request.add(*members_[e.member_], [&e, source](storage_interface &s) {
+                        s.write_range(e.addr_, e.sectors_, source);
+                    });
+                } else {
+                    request.add(*members_[e.member_], [this, &e, data](storage_interface &s) {
+                        std::vector<char> buffer(e.sectors_ * bytes_per_sector_);
+                        gather(e, data, buffer.data());
+                        s.write_range(e.addr_, e.sectors_, buffer.data());
+                    });
+                }
+            }
+            request.run();
+        }
+
+        void discard(const uint64_t sector_addr, const uint64_t sectors) override {
+            check_range(sector_addr, sectors);
+            std::vector<stripe_extent> extents = split(sector_addr, sectors);
+            storage_array_request request;
+            for (auto &e: extents)
+                request.add(*members_[e.member_], [&e](storage_interface &s) { s.discard(e.addr_, e.sectors_); });
+            request.run();
+        }
+
+        void flush(const uint64_t sector_addr, const uint64_t sectors) override {
+            storage_array_request request;
+            std::vector<stripe_extent> extents;
+            if (sectors == 0) {
+                for (auto &m: members_)
+                    request.add(*m, [](storage_interface &s) { s.flush(0, 0); });
+            } else {
+                check_range(sector_addr, sectors);
+                extents = split(sector_addr, sectors);
+                for (auto &e: extents)
+                    request.add(*members_[e.member_], [&e](storage_interface &s) { s.flush(e.addr_, e.sectors_); });
+            }
+            request.run();
+        }
+
+        disk_description get_description() override {
+            return {member_description_.cylinders, member_description_.sectors_per_cylinder * members_.size(), bytes_per_sector_};
+        }
+
+        void shutdown() override {
+            storage_array_request request;
+            for (auto &m: members_)
+                request.add(*m, [](storage_interface &s) { s.shutdown(); });
+            request.run();
+        }
+
+    private:
+        std::vector<std::unique_ptr<storage_member>> members_;
+        disk_description member_description_;
+        uint64_t unit_;
+        uint64_t bytes_per_sector_;
+        uint64_t sectors_;
+
+        struct stripe_piece {
+            uint64_t offset_; // in sectors from the start of the request
+            uint64_t sectors_;
+        };
+
+        // The part of a request on one member: always contiguous there, but every n-th stripe unit of
+        // the request buffer if it spans more than one stripe
+        struct stripe_extent {
+            size_t member_;
+            uint64_t addr_;
+            uint64_t sectors_;
+            std::vector<stripe_piece> pieces_;
+        };
+
+        size_t member_of(const uint64_t sector_addr) const {
+            return sector_addr / unit_ % members_.size();
+        }
+
+        uint64_t member_addr(const uint64_t sector_addr) const {
+            return sector_addr / unit_ / members_.size() * unit_ + sector_addr % unit_;
+        }
+
+        void check_range(const uint64_t sector_addr, const uint64_t sectors) const {
+            if (sector_addr >= sectors_ || sectors > sectors_ - sector_addr)
+                throw except(ERROR_DISK_ADDR_INVALID, "Invalid disk address");
+        }
+
+        std::vector<stripe_extent> split(const uint64_t sector_addr, const uint64_t sectors) const {
+            std::vector<stripe_extent> extents;
+            std::vector<size_t> index(members_.size(), SIZE_MAX);
+            for (uint64_t addr = sector_addr; addr < sector_addr + sectors;) {
+                uint64_t n = std::min(unit_ - addr % unit_, sector_addr + sectors - addr);
+                size_t m = member_of(addr);
+                if (index[m] == SIZE_MAX) {
+                    index[m] = extents.size();
+                    extents.push_back({m, member_addr(addr), 0, {}});
+                }
+                stripe_extent &e = extents[index[m]];
+                e.sectors_ += n;
+                e.pieces_.push_back({addr - sector_addr, n});
+                addr += n;
+            }
+            return extents;
+        }
+
+        void gather(const stripe_extent &e, const char *data, char *buffer) const {
+            for (auto &p: e.pieces_) {
+                memcpy(buffer, data + p.offset_ * bytes_per_sector_, p.sectors_ * bytes_per_sector_);
+                buffer += p.sectors_ * bytes_per_sector_;
+            }
+        }
+
+        void scatter(const stripe_extent &e, const char *buffer, char *data) const {
+            for (auto &p: e.pieces_) {
+                memcpy(data + p.offset_ * bytes_per_sector_, buffer, p.sectors_ * bytes_per_sector_);
+                buffer += p.sectors_ * bytes_per_sector_;
+            }
+        }
+    };
+
+}
+
+#endif
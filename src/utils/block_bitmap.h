@@ -0,0 +1,287 @@
+#ifndef BLOCK_BITMAP_H
+#define BLOCK_BITMAP_H
+
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace cs2313 {
+
+    namespace bitmap_detail {
+
+        static constexpr size_t npos = SIZE_MAX;
+
+        typedef size_t (*scan_fn)(const uint64_t *, size_t, size_t);
+
+        // First nonzero word in [begin, end), or npos
+        inline size_t scan_scalar(const uint64_t *words, size_t begin, const size_t end) {
+            for (; begin < end; ++begin)
+                if (words[begin])
+                    return begin;
+            return npos;
+        }
+
+        // Last nonzero word in [begin, end), or npos
+        inline size_t rscan_scalar(const uint64_t *words, const size_t begin, size_t end) {
+            while (end > begin)
+                if (words[--end])
+                    return end;
+            return npos;
+        }
+
+#if defined(__x86_64__)
+
+        __attribute__((target("avx2")))
+        inline size_t scan_avx2(const uint64_t *words, size_t begin, const size_t end) {
+            for (; begin + 4 <= end; begin += 4) {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(words + begin));
+                if (!_mm256_testz_si256(v, v))
+                    break;
+            }
+            return scan_scalar(words, begin, end);
+        }
+
+        __attribute__((target("avx2")))
+        inline size_t rscan_avx2(const uint64_t *words, const size_t begin, size_t end) {
+            for (; end >= begin + 4; end -= 4) {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(words + end - 4));
+                if (!_mm256_testz_si256(v, v))
+                    break;
+            }
+            return rscan_scalar(words, begin, end);
+        }
+
+        inline bool has_avx2() {
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+        }
+
+        inline scan_fn select_scan() { return has_avx2() ? scan_avx2 : scan_scalar; }
+
+        inline scan_fn select_rscan() { return has_avx2() ? rscan_avx2 : rscan_scalar; }
+
+#else
+
+        inline scan_fn select_scan() { return scan_scalar; }
+
+        inline scan_fn select_rscan() { return rscan_scalar; }
+
+#endif
+
+        inline size_t scan(const uint64_t *words, const size_t begin, const size_t end) {
+            static const scan_fn f = select_scan();
+            return f(words, begin, end);
+        }
+
+        inline size_t rscan(const uint64_t *words, const size_t begin, const size_t end) {
+            static const scan_fn f = select_rscan();
+            return f(words, begin, end);
+        }
+
+    }
+
+    // One bit per block, set while the block is in use, over two summaries with a bit per word: whether
+    // it has a clear bit, and whether it has a set one. A search looks at one word, then skips 4096
+    // blocks per summary bit, scanning the summaries four words at a time with AVX2 when the CPU has
+    // it. The words are mapped on demand, so the parts of a disk that were never used take no memory
+    class block_bitmap {
+    public:
+        static constexpr uint64_t npos = UINT64_MAX;
+
+        explicit block_bitmap(const uint64_t size) :
+            size_(size),
+            word_count_((size + 63) / 64),
+            words_(nullptr) {
+            reset();
+        }
+
+        ~block_bitmap() {
+            unmap();
+        }
+
+        block_bitmap(const block_bitmap &) = delete;
+
+        block_bitmap &operator=(const block_bitmap &) = delete;
+
+        // All blocks clear again
+        void reset() {
+            unmap();
+            void *words = mmap(nullptr, map_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (words == MAP_FAILED)
+                throw std::bad_alloc();
+            words_ = static_cast<uint64_t *>(words);
+            has_clear_.assign((word_count_ + 63) / 64, 0);
+            has_set_.assign((word_count_ + 63) / 64, 0);
+            for (size_t w = 0; w < word_count_; ++w)
+                has_clear_[w / 64] |= 1ULL << (w % 64);
+            // the bits past the end are in use, so they are never found clear
+            if (size_ % 64)
+                update_word(word_count_ - 1, ~0ULL << (size_ % 64), true);
+        }
+
+        uint64_t size() const { return size_; }
+
+        bool test(const uint64_t i) const {
+            return (words_[i / 64] >> (i % 64)) & 1;
+        }
+
+        void set(const uint64_t begin, const uint64_t len) { update(begin, len, true); }
+
+        void clear(const uint64_t begin, const uint64_t len) { update(begin, len, false); }
+
+        // The first clear (set) bit at or after from, or npos
+        uint64_t find_clear(const uint64_t from) const { return find(from, true); }
+
+        uint64_t find_set(const uint64_t from) const { return find(from, false); }
+
+        // The last clear (set) bit at or before from, or npos
+        uint64_t rfind_clear(const uint64_t from) const { return rfind(from, true); }
+
+        uint64_t rfind_set(const uint64_t from) const { return rfind(from, false); }
+
+        // The start of the first clear run of len bits or more starting in [from, to), or npos. Within a
+        // word, runs are found by shifting and ANDing its clear bits; runs crossing words are counted
+        // from one to the next, and used words are skipped by the summaries
+        uint64_t find_clear_run(const uint64_t from, const uint64_t to, const uint64_t len) const {
+            uint64_t start = find_clear(from);
+            if (start == npos || start >= to)
+                return npos;
+            size_t w = start / 64;
+            uint64_t bits = ~words_[w] & (~0ULL << (start % 64)), carry = 0;
+            while (true) {
+                const uint64_t prefix = std::countr_one(bits);
+                if (carry && carry + prefix >= len)
+                    return w * 64 - carry;
+                if (carry && prefix == 64) {
+                    carry += 64;
+                } else {
+                    if (carry)
+                        bits &= ~0ULL << prefix; // the rest of a run too short
+                    if (len <= 64) {
+                        uint64_t starts = bits;
+                        for (uint64_t k = 1; k < len;) {
+                            const uint64_t shift = std::min(k, len - k);
+                            starts &= starts >> shift;
+                            k += shift;
+                        }
+                        if (starts) {
+                            const uint64_t ret = w * 64 + std::countr_zero(starts);
+                            return ret < to ? ret : npos;
+                        }
+                    }
+                    carry = std::countl_one(bits);
+                    if (carry && w * 64 + 64 - carry >= to)
+                        return npos;
+                }
+                if (++w >= word_count_)
+                    return npos;
+                if (!carry) {
+                    start = find_clear(w * 64);
+                    if (start == npos || start >= to)
+                        return npos;
+                    w = start / 64;
+                }
+                bits = ~words_[w];
+            }
+        }
+
+    private:
+        uint64_t size_;
+        size_t word_count_;
+        uint64_t *words_;
+        std::vector<uint64_t> has_clear_, has_set_;
+
+        size_t map_size() const {
+            return std::max<size_t>(word_count_, 1) * sizeof(uint64_t);
+        }
+
+        void unmap() {
+            if (words_)
+                munmap(words_, map_size());
+            words_ = nullptr;
+        }
+
+        void update_word(const size_t w, const uint64_t mask, const bool value) {
+            uint64_t word = value ? words_[w] | mask : words_[w] & ~mask;
+            if (word == words_[w])
+                return;
+            words_[w] = word;
+            const uint64_t bit = 1ULL << (w % 64);
+            has_clear_[w / 64] = ~word ? has_clear_[w / 64] | bit : has_clear_[w / 64] & ~bit;
+            has_set_[w / 64] = word ? has_set_[w / 64] | bit : has_set_[w / 64] & ~bit;
+        }
+
+        void update(uint64_t begin, uint64_t len, const bool value) {
+            while (len > 0) {
+                const uint64_t offset = begin % 64, n = std::min<uint64_t>(len, 64 - offset);
+                update_word(begin / 64, (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << offset, value);
+                begin += n;
+                len -= n;
+            }
+        }
+
+        uint64_t word_bits(const size_t w, const bool clear) const {
+            return clear ? ~words_[w] : words_[w];
+        }
+
+        uint64_t find(const uint64_t from, const bool clear) const {
+            if (from >= size_)
+                return npos;
+            size_t w = from / 64;
+            uint64_t bits = word_bits(w, clear) & (~0ULL << (from % 64));
+            if (!bits) {
+                const std::vector<uint64_t> &summary = clear ? has_clear_ : has_set_;
+                const size_t next = w + 1;
+                if (next >= word_count_)
+                    return npos;
+                size_t s = next / 64;
+                uint64_t candidates = summary[s] & (~0ULL << (next % 64));
+                if (!candidates) {
+                    s = bitmap_detail::scan(summary.data(), s + 1, summary.size());
+                    if (s == bitmap_detail::npos)
+                        return npos;
+                    candidates = summary[s];
+                }
+                w = s * 64 + std::countr_zero(candidates);
+                bits = word_bits(w, clear);
+            }
+            const uint64_t ret = w * 64 + std::countr_zero(bits);
+            return ret < size_ ? ret : npos;
+        }
+
+        uint64_t rfind(uint64_t from, const bool clear) const {
+            if (size_ == 0)
+                return npos;
+            from = std::min(from, size_ - 1);
+            size_t w = from / 64;
+            uint64_t bits = word_bits(w, clear) & (~0ULL >> (63 - from % 64));
+            if (!bits) {
+                const std::vector<uint64_t> &summary = clear ? has_clear_ : has_set_;
+                if (w == 0)
+                    return npos;
+                const size_t prev = w - 1;
+                size_t s = prev / 64;
+                uint64_t candidates = summary[s] & (~0ULL >> (63 - prev % 64));
+                if (!candidates) {
+                    s = bitmap_detail::rscan(summary.data(), 0, s);
+                    if (s == bitmap_detail::npos)
+                        return npos;
+                    candidates = summary[s];
+                }
+                w = s * 64 + 63 - std::countl_zero(candidates);
+                bits = word_bits(w, clear);
+            }
+            return w * 64 + 63 - std::countl_zero(bits);
+        }
+    };
+
+}
+
+#endif
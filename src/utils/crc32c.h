@@ -0,0 +1,98 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace cs2313 {
+
+    namespace crc32c_detail {
+
+        typedef uint32_t (*crc_fn)(uint32_t, const char *, size_t);
+
+        struct crc32c_tables {
+            uint32_t t_[8][256];
+        };
+
+        // Slicing-by-8 over the reflected Castagnoli polynomial
+        inline const crc32c_tables &tables() {
+            static const crc32c_tables tables = [] {
+                crc32c_tables t{};
+                for (uint32_t i = 0; i < 256; ++i) {
+                    uint32_t c = i;
+                    for (int k = 0; k < 8; ++k)
+                        c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+                    t.t_[0][i] = c;
+                }
+                for (uint32_t i = 0; i < 256; ++i)
+                    for (int k = 1; k < 8; ++k)
+                        t.t_[k][i] = (t.t_[k - 1][i] >> 8) ^ t.t_[0][t.t_[k - 1][i] & 0xff];
+                return t;
+            }();
+            return tables;
+        }
+
+        inline uint32_t crc_table(uint32_t crc, const char *data, size_t size) {
+            const auto &t = tables().t_;
+            uint32_t c = ~crc;
+            for (; size >= 8; data += 8, size -= 8) {
+                uint64_t v;
+                memcpy(&v, data, 8);
+                v ^= c;
+                c = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^ t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff]
+                    ^ t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^ t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+            }
+            for (; size; ++data, --size)
+                c = t[0][(c ^ static_cast<uint8_t>(*data)) & 0xff] ^ (c >> 8);
+            return ~c;
+        }
+
+#if defined(__x86_64__)
+
+        __attribute__((target("sse4.2")))
+        inline uint32_t crc_sse42(uint32_t crc, const char *data, size_t size) {
+            uint64_t c = ~crc;
+            for (; size >= 8; data += 8, size -= 8) {
+                uint64_t v;
+                memcpy(&v, data, 8);
+                c = _mm_crc32_u64(c, v);
+            }
+            uint32_t c32 = static_cast<uint32_t>(c);
+            for (; size; ++data, --size)
+                c32 = _mm_crc32_u8(c32, static_cast<uint8_t>(*data));
+            return ~c32;
+        }
+
+        inline crc_fn select() {
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.2") ? crc_sse42 : crc_table;
+        }
+
+#else
+
+        inline crc_fn select() { return crc_table; }
+
+#endif
+
+    }
+
+    // CRC-32C (Castagnoli), with the SSE4.2 instruction when the CPU has it
+    inline uint32_t crc32c(const char *data, const size_t size, const uint32_t crc = 0) {
+        static const crc32c_detail::crc_fn f = crc32c_detail::select();
+        return f(crc, data, size);
+    }
+
+    // One checksum per sector
+    inline void crc32c_sectors(const char *data, const uint64_t sectors, const uint64_t bytes_per_sector, uint32_t *checksums) {
+        for (uint64_t i = 0; i < sectors; ++i)
+            checksums[i] = crc32c(data + i * bytes_per_sector, bytes_per_sector);
+    }
+
+}
+
+#endif
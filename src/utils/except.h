@@ -15,12 +15,20 @@ namespace cs2313 {
         ERROR_PWD_INIT_FAIL = 0x21,
         ERROR_PWD_COMPUTE_FAIL = 0x22,
         ERROR_DISK_ADDR_INVALID = 0x81,
+        ERROR_IO_TRACE_FILE = 0x82,
+        ERROR_STORAGE_ARRAY_INVALID = 0x83,
+        ERROR_STORAGE_ARRAY_FAILED = 0x84,
+        ERROR_DISK_CHECKSUM_MISMATCH = 0x85,
         ERROR_VIRTUAL_DRIVE_INVALID_ARGS = 0x101,
         ERROR_VIRTUAL_DRIVE_FILE_CREATE = 0x102,
         ERROR_VIRTUAL_DRIVE_MMAP = 0x103,
+        ERROR_VIRTUAL_DRIVE_IO = 0x104,
+        ERROR_VIRTUAL_DRIVE_BACKEND = 0x105,
         ERROR_FS_BUSY_HANDLE = 0x141,
         ERROR_FS_CAPACITY_EXCEEDED = 0x142,
         ERROR_FS_ACCESS_DENIED = 0x143,
+        ERROR_FS_DIRECTORY_NOT_EMPTY = 0x144,
+        ERROR_FS_DEFRAG_RUNNING = 0x145,
         ERROR_FS_NAME_NOT_EXIST = 0x151,
         ERROR_FS_NAME_ALREADY_EXIST = 0x152,
         ERROR_FS_NAME_TOO_LONG = 0x153,
@@ -0,0 +1,237 @@
+#ifndef PARITY_KERNEL_H
+#define PARITY_KERNEL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace cs2313 {
+
+    // GF(2^8) over x^8 + x^4 + x^3 + x^2 + 1 (0x11d) with generator 2, as in RAID-6
+    struct gf256_tables {
+        uint8_t exp_[512];
+        uint8_t log_[256];
+    };
+
+    inline const gf256_tables &gf256() {
+        static const gf256_tables tables = [] {
+            gf256_tables t{};
+            unsigned x = 1;
+            for (int i = 0; i < 255; ++i) {
+                t.exp_[i] = t.exp_[i + 255] = static_cast<uint8_t>(x);
+                t.log_[x] = static_cast<uint8_t>(i);
+                x <<= 1;
+                if (x & 0x100)
+                    x ^= 0x11d;
+            }
+            t.exp_[510] = t.exp_[511] = t.exp_[0];
+            return t;
+        }();
+        return tables;
+    }
+
+    inline uint8_t gf_mul(const uint8_t a, const uint8_t b) {
+        if (!a || !b)
+            return 0;
+        return gf256().exp_[gf256().log_[a] + gf256().log_[b]];
+    }
+
+    inline uint8_t gf_inv(const uint8_t a) {
+        return gf256().exp_[255 - gf256().log_[a]];
+    }
+
+    // 2^n
+    inline uint8_t gf_pow2(const uint64_t n) {
+        return gf256().exp_[n % 255];
+    }
+
+    namespace parity_detail {
+
+        typedef void (*compute_fn)(char *, char *, const char *const *, size_t, size_t);
+        typedef void (*mul_add_fn)(char *, const char *, uint8_t, size_t);
+
+        inline uint64_t mul2_word(const uint64_t v) {
+            uint64_t high = v & 0x8080808080808080ULL;
+            return ((v & 0x7f7f7f7f7f7f7f7fULL) << 1) ^ ((high >> 7) * 0x1d);
+        }
+
+        // Byte ranges past the last full vector, and the whole buffer on other architectures
+        inline void compute_scalar(char *p, char *q, const char *const *sources, const size_t count,
+                                   const size_t begin, const size_t bytes) {
+            size_t i = begin;
+            for (; i + 8 <= bytes; i += 8) {
+                uint64_t vp, vq, v;
+                memcpy(&vp, sources[count - 1] + i, 8);
+                vq = vp;
+                for (size_t j = count - 1; j-- > 0;) {
+                    memcpy(&v, sources[j] + i, 8);
+                    vp ^= v;
+                    vq = mul2_word(vq) ^ v;
+                }
+                if (p)
+                    memcpy(p + i, &vp, 8);
+                if (q)
+                    memcpy(q + i, &vq, 8);
+            }
+            for (; i < bytes; ++i) {
+                uint8_t vp = sources[count - 1][i], vq = vp;
+                for (size_t j = count - 1; j-- > 0;) {
+                    uint8_t v = sources[j][i];
+                    vp ^= v;
+                    vq = static_cast<uint8_t>((vq << 1) ^ (vq & 0x80 ? 0x1d : 0)) ^ v;
+                }
+                if (p)
+                    p[i] = static_cast<char>(vp);
+                if (q)
+                    q[i] = static_cast<char>(vq);
+            }
+        }
+
+        inline void compute_generic(char *p, char *q, const char *const *sources, const size_t count, const size_t bytes) {
+            compute_scalar(p, q, sources, count, 0, bytes);
+        }
+
+        inline void mul_add_generic(char *dst, const char *src, const uint8_t c, const size_t bytes) {
+            if (!c)
+                return;
+            const uint8_t log_c = gf256().log_[c];
+            for (size_t i = 0; i < bytes; ++i) {
+                uint8_t v = src[i];
+                if (v)
+                    dst[i] = static_cast<char>(dst[i] ^ gf256().exp_[gf256().log_[v] + log_c]);
+            }
+        }
+
+#if defined(__x86_64__)
+
+        // Q is evaluated by Horner's rule, so one pass over the sources yields both syndromes
+        inline void compute_sse2(char *p, char *q, const char *const *sources, const size_t count, const size_t bytes) {
+            const __m128i poly = _mm_set1_epi8(0x1d), zero = _mm_setzero_si128();
+            size_t i = 0;
+            for (; i + 16 <= bytes; i += 16) {
+                __m128i vp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sources[count - 1] + i)), vq = vp;
+                for (size_t j = count - 1; j-- > 0;) {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sources[j] + i));
+                    vp = _mm_xor_si128(vp, v);
+                    if (q)
+                        vq = _mm_xor_si128(_mm_xor_si128(_mm_add_epi8(vq, vq), _mm_and_si128(_mm_cmpgt_epi8(zero, vq), poly)), v);
+                }
+                if (p)
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(p + i), vp);
+                if (q)
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(q + i), vq);
+            }
+            compute_scalar(p, q, sources, count, i, bytes);
+        }
+
+        __attribute__((target("avx2")))
+        inline void compute_avx2(char *p, char *q, const char *const *sources, const size_t count, const size_t bytes) {
+            const __m256i poly = _mm256_set1_epi8(0x1d), zero = _mm256_setzero_si256();
+            size_t i = 0;
+            if (!q) {
+                // plain XOR, two vectors per step to keep more loads in flight
+                for (; i + 64 <= bytes; i += 64) {
+                    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sources[0] + i));
+                    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sources[0] + i + 32));
+                    for (size_t j = 1; j < count; ++j) {
+                        a = _mm256_xor_si256(a, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sources[j] + i)));
+                        b = _mm256_xor_si256(b, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sources[j] + i + 32)));
+                    }
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p + i), a);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p + i + 32), b);
+                }
+            }
+            for (; i + 32 <= bytes; i += 32) {
+                __m256i vp = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sources[count - 1] + i)), vq = vp;
+                for (size_t j = count - 1; j-- > 0;) {
+                    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sources[j] + i));
+                    vp = _mm256_xor_si256(vp, v);
+                    if (q)
+                        vq = _mm256_xor_si256(_mm256_xor_si256(_mm256_add_epi8(vq, vq), _mm256_and_si256(_mm256_cmpgt_epi8(zero, vq), poly)), v);
+                }
+                if (p)
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p + i), vp);
+                if (q)
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(q + i), vq);
+            }
+            compute_scalar(p, q, sources, count, i, bytes);
+        }
+
+        // Multiplication by a constant through two 16-entry tables, one per nibble
+        __attribute__((target("avx2")))
+        inline void mul_add_avx2(char *dst, const char *src, const uint8_t c, const size_t bytes) {
+            if (!c)
+                return;
+            alignas(16) uint8_t low[16], high[16];
+            for (int i = 0; i < 16; ++i) {
+                low[i] = gf_mul(c, static_cast<uint8_t>(i));
+                high[i] = gf_mul(c, static_cast<uint8_t>(i << 4));
+            }
+            const __m256i table_low = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(low)));
+            const __m256i table_high = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(high)));
+            const __m256i mask = _mm256_set1_epi8(0x0f);
+            size_t i = 0;
+            for (; i + 32 <= bytes; i += 32) {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+                __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(table_low, _mm256_and_si256(v, mask)),
+                                                   _mm256_shuffle_epi8(table_high, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask)));
+                __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_xor_si256(d, product));
+            }
+            mul_add_generic(dst + i, src + i, c, bytes - i);
+        }
+
+        inline bool has_avx2() {
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+        }
+
+        inline compute_fn select_compute() { return has_avx2() ? compute_avx2 : compute_sse2; }
+
+        inline mul_add_fn select_mul_add() { return has_avx2() ? mul_add_avx2 : mul_add_generic; }
+
+        inline const char *select_name() { return has_avx2() ? "avx2" : "sse2"; }
+
+#else
+
+        inline compute_fn select_compute() { return compute_generic; }
+
+        inline mul_add_fn select_mul_add() { return mul_add_generic; }
+
+        inline const char *select_name() { return "scalar"; }
+
+#endif
+
+    }
+
+    // p = XOR of the sources, q = sum of 2^j * sources[j] over GF(2^8); either may be nullptr.
+    // The widest kernel the CPU supports is picked on the first call
+    inline void parity_compute(char *p, char *q, const char *const *sources, const size_t count, const size_t bytes) {
+        static const parity_detail::compute_fn f = parity_detail::select_compute();
+        f(p, q, sources, count, bytes);
+    }
+
+    // dst ^= c * src over GF(2^8)
+    inline void parity_mul_add(char *dst, const char *src, const uint8_t c, const size_t bytes) {
+        static const parity_detail::mul_add_fn f = parity_detail::select_mul_add();
+        f(dst, src, c, bytes);
+    }
+
+    // dst ^= src
+    inline void parity_xor(char *dst, const char *src, const size_t bytes) {
+        const char *sources[2] = {dst, src};
+        parity_compute(dst, nullptr, sources, 2, bytes);
+    }
+
+    inline const char *parity_kernel_name() {
+        static const char *name = parity_detail::select_name();
+        return name;
+    }
+
+}
+
+#endif
@@ -5,7 +5,10 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <linux/errqueue.h>
 
 #include "except.h"
 
@@ -75,6 +78,70 @@ namespace cs2313 {
             }
         }
 
+        // Requests and replies are sent field by field; without this Nagle holds the tail of each
+        // message back until the previous segment is acknowledged, which is delayed by the peer
+        void set_nodelay() const {
+            int one = 1;
+            setsockopt(sockfd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+
+        bool enable_zerocopy() const {
+            int one = 1;
+            return setsockopt(sockfd_, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        }
+
+        // Sends without copying into the kernel. The buffer must stay untouched until the returned
+        // number of send calls (one notification id each, counted per socket from 0) have been reaped
+        uint32_t send_raw_zerocopy(const char *buf, const size_t len) const {
+            size_t total_sent = 0;
+            uint32_t calls = 0;
+            while (total_sent < len) {
+                ssize_t sent = ::send(sockfd_, buf + total_sent, len - total_sent, MSG_NOSIGNAL | MSG_ZEROCOPY);
+                if (sent < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == ENOBUFS) { // out of pinned page quota, fall back to copying
+                        send_raw(buf + total_sent, len - total_sent);
+                        return calls;
+                    }
+                    if (errno == EPIPE)
+                        throw except(ERROR_SOCKET_CLOSED_BY_REMOTE, "Socket disconnected");
+                    if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK)
+                        throw except(errno, ERROR_SOCKET_TERMINATED, "Socket terminated");
+                    throw except(errno, ERROR_SOCKET_SEND_FAIL, "Socket send failed");
+                }
+                ++calls;
+                total_sent += sent;
+            }
+            return calls;
+        }
+
+        // Calls on_complete(first_id, last_id) for every finished zero-copy send,
+        // waiting at most timeout_ms for the first notification
+        template<typename F>
+        bool reap_zerocopy(const int timeout_ms, F on_complete) const {
+            pollfd pfd{sockfd_, 0, 0}; // POLLERR is always reported
+            if (poll(&pfd, 1, timeout_ms) <= 0)
+                return false;
+            bool reaped = false;
+            while (true) {
+                char control[128];
+                msghdr msg{};
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                if (recvmsg(sockfd_, &msg, MSG_ERRQUEUE) < 0)
+                    break;
+                for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                    auto *err = reinterpret_cast<sock_extended_err *>(CMSG_DATA(cm));
+                    if (err->ee_errno == 0 && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                        on_complete(err->ee_info, err->ee_data);
+                        reaped = true;
+                    }
+                }
+            }
+            return reaped;
+        }
+
         template<typename T>
         void send(const T &t) {
             send_raw(reinterpret_cast<const char *>(&t), sizeof(T));
@@ -104,6 +171,12 @@ namespace cs2313 {
             }
         }
 
+        // Wakes up threads blocked in accept / recv on this socket without releasing the fd
+        void interrupt() const {
+            if (!closed_)
+                ::shutdown(sockfd_, SHUT_RDWR);
+        }
+
     protected:
         int sockfd_;
         sockaddr_in addr_;
@@ -160,6 +233,7 @@ namespace cs2313 {
                 throw except(errno, ERROR_SOCKET_CONNECT_FAIL, "Connection failed");
             }
             connection.closed_ = false;
+            connection.set_nodelay();
             return connection;
         }
 
@@ -188,6 +262,7 @@ namespace cs2313 {
                 close(sockfd_);
                 throw except(errno, ERROR_SOCKET_CONNECT_FAIL, "Connection failed");
             }
+            set_nodelay();
         }
     };
 
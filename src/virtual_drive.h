@@ -2,16 +2,27 @@
 #define VIRTUAL_DRIVE_H
 
 #include <vector>
+#include <algorithm>
 #include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <cstring>
 #include <thread>
 #include <atomic>
 #include <condition_variable>
+#include <cstdlib>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
 
 #include "storage_interface.h"
+#include "drive_backend.h"
+#include "drive_model.h"
+#include "drive_cache.h"
+#include "drive_checksum.h"
 #include "utils/except.h"
 #include "utils/socket.h"
 #include "utils/misc.h"
@@ -26,35 +37,111 @@ namespace cs2313 {
         DRIVE_SCHEDULER_CLOOK
     };
 
+    struct drive_options {
+        drive_io_backend backend = DRIVE_BACKEND_MMAP;
+        bool zerocopy = false; // send multi-sector reads straight from the mapped image (mmap backend only)
+        bool sparse = false; // grow the image on demand and answer never-written sectors without touching it
+        bool write_through = false; // writes are durable before they are acknowledged
+        drive_timing timing; // the per-cylinder seek cost is taken from the constructor
+        // A request older than this is served ahead of the sweep (0: never); on the drive clock
+        uint64_t read_expire_ns = 500'000'000;
+        uint64_t write_expire_ns = 5'000'000'000;
+        uint64_t cache_tracks = 0; // track buffer, whole tracks read ahead on a miss (0: no cache)
+        uint64_t write_buffer_sectors = 0; // writes acknowledged from the track buffer (not with write_through)
+        bool destage_on_idle = true; // otherwise buffered writes only go out when the buffer is full or flushed
+        bool checksums = false; // keep a CRC-32C per sector next to the image (a stale table is removed without)
+        // Advertised to clients, which split larger requests and keep fewer outstanding (0: no limit)
+        uint64_t max_transfer_sectors = 0;
+        uint32_t queue_depth = 0;
+    };
+
+    struct drive_deadline {
+        uint64_t expire_ns_;
+        uint64_t seq_;
+        uint64_t cylinder_;
+    };
+
+    struct drive_zerocopy_send {
+        uint32_t first_id_, last_id_; // notification ids of the send calls
+        uint32_t remaining_; // notifications still to come
+        uint64_t offset_, size_; // range of the image pinned by the send
+    };
+
+    struct drive_connection {
+        server_connection_socket_handle socket_;
+        std::mutex write_mutex_;
+        std::thread receiver_thread_;
+        std::atomic<bool> closed_;
+        std::atomic<bool> batch_completions_; // acknowledgements may be sent as IO_INSTR_COMPLETE_BATCH
+
+        // owned by the magnetic head thread
+        bool zerocopy_;
+        uint32_t zerocopy_next_id_;
+        std::deque<drive_zerocopy_send> zerocopy_pending_;
+
+        explicit drive_connection(server_connection_socket_handle &&socket):
+            socket_(std::move(socket)),
+            closed_(false),
+            batch_completions_(false),
+            zerocopy_(false),
+            zerocopy_next_id_(0) {}
+
+        drive_connection(const drive_connection &) = delete;
+
+        drive_connection &operator=(const drive_connection &) = delete;
+    };
+
     struct drive_sector_transaction {
         uint64_t sector_offset_;
+        uint64_t sectors_;
         char *data_;
         uint32_t tid_;
         io_instr instr_;
+        uint64_t seq_; // arrival order, for barriers
+        io_priority priority_;
+        bool checksum_; // the read reply carries checksums; a write carries them after its data
+        std::shared_ptr<drive_connection> connection_; // where the reply goes
 
-        drive_sector_transaction(const io_instr instr, const uint32_t tid, const uint64_t sector_offset, const size_t data_size):
+        drive_sector_transaction(const io_instr instr, const uint32_t tid, const uint64_t sector_offset, const size_t data_size,
+                                 std::shared_ptr<drive_connection> connection, const uint64_t sectors = 1,
+                                 const io_priority priority = IO_PRIORITY_NORMAL, const bool checksum = false):
             sector_offset_(sector_offset),
-            data_(new char[data_size]),
+            sectors_(sectors),
+            data_(data_size ? drive_data_alloc(data_size) : nullptr),
             tid_(tid),
-            instr_(instr) {}
+            instr_(instr),
+            seq_(0),
+            priority_(priority),
+            checksum_(checksum),
+            connection_(std::move(connection)) {}
 
-        ~drive_sector_transaction() { delete[] data_; }
+        ~drive_sector_transaction() { drive_data_free(data_); }
 
         drive_sector_transaction(drive_sector_transaction &&other) noexcept:
             sector_offset_(other.sector_offset_),
+            sectors_(other.sectors_),
             data_(other.data_),
             tid_(other.tid_),
-            instr_(other.instr_) {
+            instr_(other.instr_),
+            seq_(other.seq_),
+            priority_(other.priority_),
+            checksum_(other.checksum_),
+            connection_(std::move(other.connection_)) {
             other.data_ = nullptr;
         }
 
         drive_sector_transaction &operator=(drive_sector_transaction &&other) noexcept {
             if (this != &other) {
-                delete[] data_;
+                drive_data_free(data_);
                 sector_offset_ = other.sector_offset_;
+                sectors_ = other.sectors_;
                 data_ = other.data_;
                 tid_ = other.tid_;
                 instr_ = other.instr_;
+                seq_ = other.seq_;
+                priority_ = other.priority_;
+                checksum_ = other.checksum_;
+                connection_ = std::move(other.connection_);
                 other.data_ = nullptr;
             }
             return *this;
@@ -73,17 +160,28 @@ namespace cs2313 {
                       //const drive_scheduler scheduler,
                       const uint64_t sim_move_cost_us,
                       const char *path,
-                      const uint16_t bind_port) :
+                      const uint16_t bind_port,
+                      const drive_options &options = {}) :
             cylinders_(cylinders),
             sectors_per_cylinder_(sectors_per_cylinder),
             bytes_per_sector_(bytes_per_sector),
-            scheduler_(DRIVE_SCHEDULER_SSTF), // unused yet
-            sim_move_cost_us_(sim_move_cost_us),
+            scheduler_(DRIVE_SCHEDULER_SSTF),
+            options_(options),
+            model_(with_move_cost(options.timing, sim_move_cost_us), sectors_per_cylinder),
+            clock_(options.timing.virtual_clock),
+            stats_{},
+            cache_(options.cache_tracks, options.write_through ? 0 : options.write_buffer_sectors,
+                   sectors_per_cylinder, bytes_per_sector, options.backend != DRIVE_BACKEND_MMAP),
+            destage_requested_(false),
+            granule_bits_(0),
+            written_bitmap_(nullptr),
             server_socket_(bind_port),
-            receiver_loop_(false)
-        // magnetic_head_sig_continue_(false),
-        // magnetic_head_sig_term_(false)
-        {
+            receiver_loop_(false),
+            magnetic_head_sig_continue_(false),
+            magnetic_head_sig_term_(false),
+            magnetic_head_busy_(false),
+            submit_seq_(0),
+            meta_over_write_(0) {
 
             if (power_of_2(bytes_per_sector_) == -1)
                 throw except(ERROR_VIRTUAL_DRIVE_INVALID_ARGS, "Invalid virtual drive arguments: sector size not power-of-2 aligned");
@@ -104,52 +202,108 @@ namespace cs2313 {
             addr_size_ = sectors_per_cylinder_ * cylinders_;
             sector_addr_bitmask_ = sectors_per_cylinder_ - 1;
             sector_addr_bits_ = power_of_2(sectors_per_cylinder_);
+            granule_bits_ = std::max(power_of_2(bytes_per_sector_), power_of_2(SPARSE_GRANULE));
 
             file_fd_ = open(path, O_RDWR | O_CREAT, 0666);
             if (file_fd_ < 0) {
                 throw except(errno, ERROR_VIRTUAL_DRIVE_FILE_CREATE, "Failed to create virtual drive file");
             }
 
-            if (lseek(file_fd_, disk_size_ - 1, SEEK_SET) == -1) {
-                close(file_fd_);
-                throw except(errno, ERROR_VIRTUAL_DRIVE_FILE_CREATE, "Failed to create virtual drive file");
-            }
+            if (options_.sparse) {
+                // Only the logical size is set; blocks are allocated by the host FS as sectors get written
+                struct stat st;
+                if (fstat(file_fd_, &st) != 0 || (static_cast<uint64_t>(st.st_size) < disk_size_ && ftruncate(file_fd_, disk_size_) != 0)) {
+                    close(file_fd_);
+                    throw except(errno, ERROR_VIRTUAL_DRIVE_FILE_CREATE, "Failed to create virtual drive file");
+                }
+                written_bitmap_ = static_cast<uint64_t *>(calloc(((disk_size_ >> granule_bits_) + 63) / 64, sizeof(uint64_t)));
+                if (!written_bitmap_) {
+                    close(file_fd_);
+                    throw except(ERROR_VIRTUAL_DRIVE_FILE_CREATE, "Failed to allocate the sparse map of the virtual drive");
+                }
+                sparse_scan();
+            } else if (struct stat st; fstat(file_fd_, &st) != 0 || static_cast<uint64_t>(st.st_size) < disk_size_) {
+                // an existing image keeps its last byte
+                if (lseek(file_fd_, disk_size_ - 1, SEEK_SET) == -1) {
+                    close(file_fd_);
+                    throw except(errno, ERROR_VIRTUAL_DRIVE_FILE_CREATE, "Failed to create virtual drive file");
+                }
 
-            char char_empty = 0;
-            if (write(file_fd_, &char_empty, 1) != 1) {
-                close(file_fd_);
-                throw except(errno, ERROR_VIRTUAL_DRIVE_FILE_CREATE, "Failed to create virtual drive file");
+                char char_empty = 0;
+                if (write(file_fd_, &char_empty, 1) != 1) {
+                    close(file_fd_);
+                    throw except(errno, ERROR_VIRTUAL_DRIVE_FILE_CREATE, "Failed to create virtual drive file");
+                }
             }
 
-            file_data_ = static_cast<char *>(mmap(nullptr, disk_size_, PROT_READ | PROT_WRITE, MAP_SHARED, file_fd_, 0));
-
-            if (file_data_ == MAP_FAILED) {
+            try {
+                switch (options_.backend) {
+                    case DRIVE_BACKEND_MMAP:
+                        backend_ = std::make_unique<mmap_drive_backend>(file_fd_, disk_size_);
+                        break;
+                    case DRIVE_BACKEND_PREAD:
+                        backend_ = std::make_unique<pread_drive_backend>(file_fd_);
+                        break;
+                    case DRIVE_BACKEND_URING:
+                        backend_ = std::make_unique<uring_drive_backend>(file_fd_, path, bytes_per_sector_);
+                        break;
+                }
+            } catch (except &) {
+                free(written_bitmap_);
                 close(file_fd_);
-                throw except(errno, ERROR_VIRTUAL_DRIVE_MMAP, "Failed to map virtual drive file to memory");
+                throw;
             }
+            file_data_ = backend_->mapped();
 
-            // todo paging & lazy expansion
+            if (options_.checksums) {
+                try {
+                    checksums_ = std::make_unique<drive_checksum_table>(path, file_fd_, addr_size_, bytes_per_sector_);
+                } catch (except &) {
+                    backend_.reset();
+                    free(written_bitmap_);
+                    close(file_fd_);
+                    throw;
+                }
+            } else {
+                drive_checksum_table::remove(path);
+            }
         }
 
         void start() {
             if (!receiver_loop_.load()) {
                 receiver_loop_.store(true);
-                receiver_thread_ = std::thread(&virtual_drive::request_receiver, this); // TODO except
+                magnetic_head_thread_ = std::thread(&virtual_drive::virtual_magnetic_head, this);
+                receiver_thread_ = std::thread(&virtual_drive::connection_acceptor, this); // TODO except
             }
         }
 
+        drive_stats stats() {
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            return stats_;
+        }
+
         void wait() {
             if (receiver_thread_.joinable())
                 receiver_thread_.join();
         }
 
         ~virtual_drive() {
-            if (receiver_loop_.load()) {
-                receiver_loop_.store(false);
-                if (receiver_thread_.joinable())
-                    receiver_thread_.join();
+            stop();
+            if (receiver_thread_.joinable())
+                receiver_thread_.join();
+            std::vector<std::shared_ptr<drive_connection> > connections;
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex_);
+                connections.swap(connections_);
             }
-            munmap(file_data_, disk_size_);
+            for (auto &c: connections) // not under the lock, a receiver may still be in stop()
+                if (c->receiver_thread_.joinable())
+                    c->receiver_thread_.join();
+            if (magnetic_head_thread_.joinable())
+                magnetic_head_thread_.join();
+            backend_.reset();
+            checksums_.reset();
+            free(written_bitmap_);
             close(file_fd_);
         }
 
@@ -163,44 +317,265 @@ namespace cs2313 {
         uint64_t sector_no(const uint64_t addr) const { return addr & sector_addr_bitmask_; }
 
         drive_scheduler scheduler_;
-        uint64_t sim_move_cost_us_;
+        drive_options options_;
+
+        // owned by the magnetic head thread, except for the statistics
+        drive_model model_;
+        drive_clock clock_;
+        drive_stats stats_;
+        std::mutex stats_mutex_;
+
+        static drive_timing with_move_cost(drive_timing timing, const uint64_t sim_move_cost_us) {
+            timing.seek_per_cylinder_ns = sim_move_cost_us * 1000;
+            return timing;
+        }
+
+        // Moves the head over the given distance on the simulated clock
+        void seek(const uint64_t cylinders) {
+            if (!cylinders)
+                return;
+            uint64_t ns = model_.seek_time(cylinders);
+            clock_.advance(ns);
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            stats_.seek_cylinders += cylinders;
+            stats_.service_ns += ns;
+        }
+
+        // Requests served from the track cache take no mechanical time
+        void count_hit(const uint64_t requests, const uint64_t sectors) {
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            stats_.requests += requests;
+            stats_.sectors += sectors;
+            stats_.cache_hits += requests;
+        }
+
+        // Brings the head from cylinder_from to the first sector of the run and transfers it
+        void simulate(const uint64_t addr, const uint64_t sectors, const uint64_t requests, const uint64_t cylinder_from) {
+            const uint64_t crossed = cylinder_no(addr + sectors - 1) - cylinder_no(addr);
+            seek(dist(cylinder_from, cylinder_no(addr)));
+            uint64_t ns = model_.access_time(clock_.now(), sector_no(addr), sectors, crossed);
+            clock_.advance(ns);
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            stats_.requests += requests;
+            stats_.sectors += sectors;
+            stats_.seek_cylinders += crossed;
+            stats_.service_ns += ns;
+            stats_.clock_ns = clock_.now();
+        }
 
         int file_fd_;
-        char *file_data_;
+        std::unique_ptr<drive_backend> backend_;
+        char *file_data_; // nullptr unless the backend maps the image
+        std::unique_ptr<drive_checksum_table> checksums_; // updated by the head thread as writes are acknowledged
+
+        // Owned by the magnetic head thread. Holds data only when the image is not mapped; with the
+        // mapping it only decides what costs mechanical time
+        drive_track_cache cache_;
+        bool destage_requested_; // by flush(), under list_mutex_
+
+        void cache_invalidate(const uint64_t addr, const uint64_t sectors) {
+            for (uint64_t a = addr; a < addr + sectors; a = (cylinder_no(a) + 1) << sector_addr_bits_)
+                cache_.invalidate(cylinder_no(a), sector_no(a), std::min(addr + sectors - a, sectors_per_cylinder_ - sector_no(a)));
+        }
+
+        // Writes the buffered sectors (of one cylinder, or all of them) to the media as part of the batch
+        void destage(std::vector<drive_io> &batch, std::vector<char *> &buffers, uint64_t &cylinder_pos,
+                     const uint64_t only_cylinder = UINT64_MAX) {
+            cache_.destage([&](const uint64_t cylinder, const uint64_t sector, const uint64_t sectors, const char *data) {
+                uint64_t addr = (cylinder << sector_addr_bits_) | sector;
+                simulate(addr, sectors, 0, cylinder_pos);
+                cylinder_pos = cylinder;
+                {
+                    std::lock_guard<std::mutex> lock(stats_mutex_);
+                    stats_.destaged_sectors += sectors;
+                }
+                if (file_data_)
+                    return;
+                char *copy = drive_data_alloc(sectors * bytes_per_sector_); // the track may change again before the transfer
+                memcpy(copy, data, sectors * bytes_per_sector_);
+                buffers.push_back(copy);
+                batch.push_back({true, addr * bytes_per_sector_, sectors * bytes_per_sector_, copy});
+            }, only_cylinder);
+        }
+
+        uint64_t destage_all(uint64_t cylinder_pos) {
+            std::vector<drive_io> batch;
+            std::vector<char *> buffers;
+            destage(batch, buffers, cylinder_pos);
+            backend_->transfer(batch);
+            for (char *buffer: buffers)
+                drive_data_free(buffer);
+            return cylinder_pos;
+        }
+
+        // Sparse mode: one bit per granule (host FS block) telling whether it has ever been written
+        static constexpr uint64_t SPARSE_GRANULE = 0x1000;
+        int granule_bits_;
+        uint64_t *written_bitmap_;
+
+        void sparse_mark(const uint64_t begin_granule, const uint64_t end_granule, const bool written) {
+            for (uint64_t g = begin_granule; g < end_granule; ++g) {
+                if (written)
+                    written_bitmap_[g >> 6] |= 1ULL << (g & 63);
+                else
+                    written_bitmap_[g >> 6] &= ~(1ULL << (g & 63));
+            }
+        }
+
+        void sparse_set_written(const uint64_t offset, const uint64_t size) {
+            if (written_bitmap_)
+                sparse_mark(offset >> granule_bits_, ((offset + size - 1) >> granule_bits_) + 1, true);
+        }
+
+        bool sparse_written(const uint64_t offset, const uint64_t size) const {
+            if (!written_bitmap_)
+                return true;
+            for (uint64_t g = offset >> granule_bits_; g <= (offset + size - 1) >> granule_bits_; ++g)
+                if ((written_bitmap_[g >> 6] >> (g & 63)) & 1)
+                    return true;
+            return false;
+        }
+
+        // Rebuilds the bitmap from the data / hole layout of an existing image
+        void sparse_scan() {
+            off_t pos = 0;
+            while (static_cast<uint64_t>(pos) < disk_size_) {
+                off_t data = lseek(file_fd_, pos, SEEK_DATA);
+                if (data < 0)
+                    break; // ENXIO: only holes are left
+                off_t hole = lseek(file_fd_, data, SEEK_HOLE);
+                if (hole < 0 || static_cast<uint64_t>(hole) > disk_size_)
+                    hole = static_cast<off_t>(disk_size_);
+                sparse_set_written(data, hole - data);
+                pos = hole;
+            }
+        }
+
+        // Deallocates the range from the image; the host FS zeroes the partially covered blocks itself
+        void discard(const uint64_t offset, const uint64_t size) {
+            if (fallocate(file_fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) != 0) {
+                zero_fill(offset, size); // no hole punching on the host FS
+                return;
+            }
+            if (written_bitmap_) {
+                const uint64_t granule = 1ULL << granule_bits_;
+                uint64_t begin = (offset + granule - 1) >> granule_bits_, end = (offset + size) >> granule_bits_;
+                if (begin < end)
+                    sparse_mark(begin, end, false);
+            }
+        }
+
+        void zero_fill(const uint64_t offset, const uint64_t size) {
+            if (!size || !sparse_written(offset, size))
+                return;
+            char *zeros = drive_data_alloc(size);
+            memset(zeros, 0, size);
+            backend_->write(offset, size, zeros);
+            drive_data_free(zeros);
+        }
 
         server_socket_handle server_socket_;
-        server_connection_socket_handle connection_socket_;
-        std::mutex socket_write_mutex_;
+
+        // Each client connection has its own receiver thread; all of them feed the same waiting list,
+        // so requests from different connections are scheduled together by the magnetic head
+        std::vector<std::shared_ptr<drive_connection> > connections_;
+        std::mutex connections_mutex_;
 
         std::atomic<bool> receiver_loop_;
         std::thread receiver_thread_;
 
-        // std::mutex magnetic_head_wake_mutex_;
-        // std::condition_variable magnetic_head_wake_cv_;
-        // bool magnetic_head_sig_continue_;
-        // bool magnetic_head_sig_term_;
-        // std::thread magnetic_head_thread_;
+        std::mutex magnetic_head_wake_mutex_;
+        std::condition_variable magnetic_head_wake_cv_;
+        bool magnetic_head_sig_continue_;
+        bool magnetic_head_sig_term_;
+        std::thread magnetic_head_thread_;
 
-        // std::map<uint64_t, std::vector<drive_sector_transaction> > waiting_list_;
-        // std::mutex list_mutex_;
+        std::map<uint64_t, std::vector<drive_sector_transaction> > waiting_list_;
+        std::mutex list_mutex_;
+        std::condition_variable list_idle_cv_;
+        bool magnetic_head_busy_;
 
-        void request_receiver() {
+        uint64_t submit_seq_;
+        std::set<uint64_t> pending_seqs_; // transactions queued or being served
 
-            uint8_t instr;
-            uint32_t tid;
-            uint64_t addr;
+        // Deadline FIFOs in arrival order (reads, writes), as in the Linux deadline scheduler; entries
+        // of transactions served in the meantime are dropped lazily when they reach the front
+        std::deque<drive_deadline> deadline_fifo_[2];
+        std::map<uint64_t, uint32_t> meta_cylinders_; // queued IO_PRIORITY_META transactions per cylinder
+        uint32_t meta_over_write_; // metadata picks in a row while a write had expired
 
-            uint64_t prev_cylinder_no = 0;
+        static constexpr uint32_t META_OVER_WRITE_MAX = 4;
 
-            auto dist = [](const uint64_t a, const uint64_t b)-> uint64_t {
-                if (a > b)
-                    return a - b;
-                return b - a;
+        // Picks a cylinder to serve ahead of the scheduler: an expired read first, then the nearest
+        // metadata request, then an expired write. An expired write waits for META_OVER_WRITE_MAX
+        // metadata picks at most, so a stream of them cannot starve it. Returns waiting_list_.end()
+        // if there is none
+        std::map<uint64_t, std::vector<drive_sector_transaction> >::iterator overdue(const uint64_t cylinder_pos) {
+            const uint64_t now = clock_.now();
+            auto expired = [this, now](std::deque<drive_deadline> &fifo) {
+                while (!fifo.empty() && !pending_seqs_.contains(fifo.front().seq_))
+                    fifo.pop_front();
+                return !fifo.empty() && fifo.front().expire_ns_ <= now;
             };
+            if (expired(deadline_fifo_[0]))
+                return waiting_list_.find(deadline_fifo_[0].front().cylinder_);
+            const bool write_expired = expired(deadline_fifo_[1]);
+            if (!meta_cylinders_.empty() && (!write_expired || meta_over_write_ < META_OVER_WRITE_MAX)) {
+                meta_over_write_ = write_expired ? meta_over_write_ + 1 : 0;
+                auto it = meta_cylinders_.lower_bound(cylinder_pos);
+                if (it == meta_cylinders_.end() || (it != meta_cylinders_.begin() && cylinder_pos - std::prev(it)->first < it->first - cylinder_pos))
+                    it = std::prev(it);
+                return waiting_list_.find(it->first);
+            }
+            meta_over_write_ = 0;
+            if (write_expired)
+                return waiting_list_.find(deadline_fifo_[1].front().cylinder_);
+            return waiting_list_.end();
+        }
+
+        // Waits until every transaction received before this call has been served,
+        // then makes the range (or the whole image if sectors == 0) durable
+        void flush(const uint64_t addr, const uint64_t sectors) {
+            {
+                std::unique_lock<std::mutex> lock(list_mutex_);
+                const uint64_t barrier = submit_seq_;
+                list_idle_cv_.wait(lock, [this, barrier] { return pending_seqs_.empty() || *pending_seqs_.begin() >= barrier; });
+                if (cache_.buffering()) { // the head thread owns the write buffer
+                    destage_requested_ = true;
+                    {
+                        std::lock_guard<std::mutex> wake_lock(magnetic_head_wake_mutex_);
+                        magnetic_head_sig_continue_ = true;
+                    }
+                    magnetic_head_wake_cv_.notify_one();
+                    list_idle_cv_.wait(lock, [this] { return !destage_requested_; });
+                }
+            }
+            if (sectors)
+                backend_->flush(addr * bytes_per_sector_, sectors * bytes_per_sector_);
+            else
+                backend_->flush(0, disk_size_);
+            if (checksums_)
+                checksums_->sync();
+        }
 
+        void stop() {
+            receiver_loop_.store(false);
+            {
+                std::lock_guard<std::mutex> lock(magnetic_head_wake_mutex_);
+                magnetic_head_sig_term_ = true;
+            }
+            magnetic_head_wake_cv_.notify_all();
+            server_socket_.interrupt();
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            for (auto &c: connections_)
+                c->socket_.interrupt();
+        }
+
+        void connection_acceptor() {
             while (receiver_loop_.load(std::memory_order_acquire)) {
+                server_connection_socket_handle socket;
                 try {
-                    connection_socket_ = server_socket_.accept();
+                    socket = server_socket_.accept();
                 } catch (except &e) {
                     if (e.error_code() == ERROR_SOCKET_TERMINATED) {
                         receiver_loop_.store(false);
@@ -208,214 +583,732 @@ namespace cs2313 {
                     }
                     throw;
                 }
+                if (!receiver_loop_.load(std::memory_order_acquire))
+                    return;
 
-                while (receiver_loop_.load(std::memory_order_acquire)) {
-                    try {
-                        connection_socket_.recv(instr);
-                        connection_socket_.recv(tid);
-                        switch (instr) {
-                            case IO_INSTR_READ: {
-                                connection_socket_.recv(addr);
-                                // drive_sector_transaction transaction(instr, tid, sector_no(addr), bytes_per_sector_); //
-                                // {
-                                //     std::lock_guard<std::mutex> lock(list_mutex_);
-                                //     waiting_list_[cylinder_no(addr)].emplace_back(std::move(transaction));
-                                // } todo async
-                                if (prev_cylinder_no != cylinder_no(addr))
-                                    usleep(dist(prev_cylinder_no, cylinder_no(addr)) * sim_move_cost_us_);
-                                prev_cylinder_no = cylinder_no(addr); //
-                                {
-                                    std::lock_guard<std::mutex> lock(socket_write_mutex_);
-                                    connection_socket_.send(instr);
-                                    connection_socket_.send(tid);
-                                    connection_socket_.send_raw(file_data_ + addr * bytes_per_sector_, bytes_per_sector_);
-                                }
-                                // todo addr check
+                std::lock_guard<std::mutex> lock(connections_mutex_);
+                std::erase_if(connections_, [](const std::shared_ptr<drive_connection> &c) {
+                    if (!c->closed_.load(std::memory_order_acquire))
+                        return false;
+                    if (c->receiver_thread_.joinable())
+                        c->receiver_thread_.join();
+                    return true;
+                });
+                auto connection = std::make_shared<drive_connection>(std::move(socket));
+                if (options_.zerocopy && file_data_)
+                    connection->zerocopy_ = connection->socket_.enable_zerocopy();
+                connection->receiver_thread_ = std::thread(&virtual_drive::request_receiver, this, connection);
+                connections_.push_back(std::move(connection));
+            }
+        }
+
+        void enqueue(drive_sector_transaction &&transaction, const uint64_t cylinder) {
+            const bool read = transaction.instr_ == IO_INSTR_READ || transaction.instr_ == IO_INSTR_READ_RANGE;
+            const uint64_t expire = read ? options_.read_expire_ns : options_.write_expire_ns;
+            {
+                std::lock_guard<std::mutex> lock(list_mutex_);
+                transaction.seq_ = submit_seq_++;
+                pending_seqs_.insert(transaction.seq_);
+                if (expire)
+                    deadline_fifo_[read ? 0 : 1].push_back({clock_.now() + expire, transaction.seq_, cylinder});
+                if (transaction.priority_ == IO_PRIORITY_META)
+                    ++meta_cylinders_[cylinder];
+                waiting_list_[cylinder].emplace_back(std::move(transaction));
+            }
+            {
+                std::lock_guard<std::mutex> lock(magnetic_head_wake_mutex_);
+                magnetic_head_sig_continue_ = true;
+            }
+            magnetic_head_wake_cv_.notify_one();
+        }
+
+        static void reply(drive_connection &connection, const io_instr instr, const uint32_t tid,
+                          const char *data = nullptr, const size_t data_size = 0, const std::vector<uint32_t> &checksums = {}) {
+            std::lock_guard<std::mutex> lock(connection.write_mutex_);
+            try {
+                connection.socket_.send(instr);
+                connection.socket_.send(tid);
+                if (data)
+                    connection.socket_.send_raw(data, data_size);
+                if (!checksums.empty())
+                    connection.socket_.send_raw(reinterpret_cast<const char *>(checksums.data()), checksums.size() * sizeof(uint32_t));
+            } catch (except &e) {
+                // the client has gone away; its receiver thread cleans up
+                if (e.error_code() != ERROR_SOCKET_CLOSED_BY_REMOTE && e.error_code() != ERROR_SOCKET_TERMINATED)
+                    throw;
+            }
+        }
+
+        // Write data is followed by its checksums when the frame carries them or the table keeps them
+        uint64_t write_data_size(const uint64_t sectors, const bool checksum) const {
+            return sectors * bytes_per_sector_ + (checksum || checksums_ ? sectors * sizeof(uint32_t) : 0);
+        }
+
+        // A request the drive serves: sectors > 0, all inside the image, and for a transfer no more
+        // than max_transfer_sectors. Anything else is answered with IO_INSTR_ADDR_ERROR
+        bool valid_range(const uint64_t addr, const uint64_t sectors, const bool transfer) const {
+            if (sectors == 0 || addr >= addr_size_ || sectors > addr_size_ - addr)
+                return false;
+            return !transfer || !options_.max_transfer_sectors || sectors <= options_.max_transfer_sectors;
+        }
+
+        // Reads past the data of a rejected write, so the next request is found; false if it claims
+        // more than the image holds, and the connection can no longer be followed
+        bool skip_write_data(server_connection_socket_handle &socket, const uint64_t sectors, const bool checksum) const {
+            if (sectors > addr_size_)
+                return false;
+            char scratch[0x10000];
+            for (uint64_t left = sectors * (bytes_per_sector_ + (checksum ? sizeof(uint32_t) : 0)); left > 0;) {
+                const uint64_t n = std::min<uint64_t>(left, sizeof(scratch));
+                socket.recv_raw(scratch, n);
+                left -= n;
+            }
+            return true;
+        }
+
+        // Receives the data of a write, and its checksums if the frame carries them; false if they do
+        // not match the data. With the table, the checksums are kept after the data for the acknowledgement
+        bool receive_write_data(server_connection_socket_handle &socket, drive_sector_transaction &transaction) const {
+            const uint64_t size = transaction.sectors_ * bytes_per_sector_;
+            socket.recv_raw(transaction.data_, size);
+            if (!transaction.checksum_ && !checksums_)
+                return true;
+            uint32_t *sums = reinterpret_cast<uint32_t *>(transaction.data_ + size);
+            if (transaction.checksum_)
+                socket.recv_raw(reinterpret_cast<char *>(sums), transaction.sectors_ * sizeof(uint32_t));
+            for (uint64_t i = 0; i < transaction.sectors_; ++i) {
+                uint32_t sum = crc32c(transaction.data_ + i * bytes_per_sector_, bytes_per_sector_);
+                if (transaction.checksum_ && sum != sums[i])
+                    return false;
+                sums[i] = sum;
+            }
+            return true;
+        }
+
+        // What a checksummed read reply carries: the stored checksums, or those of the data sent
+        std::vector<uint32_t> read_checksums(const uint64_t addr, const uint64_t sectors, const char *data) const {
+            std::vector<uint32_t> sums(sectors);
+            if (checksums_)
+                std::copy_n(checksums_->get(addr), sectors, sums.begin());
+            else if (data)
+                crc32c_sectors(data, sectors, bytes_per_sector_, sums.data());
+            else
+                std::ranges::fill(sums, crc32c(std::vector<char>(bytes_per_sector_, 0).data(), bytes_per_sector_));
+            return sums;
+        }
+
+        void request_receiver(std::shared_ptr<drive_connection> connection) {
+
+            uint8_t instr;
+            uint32_t tid;
+            uint64_t addr;
+
+            server_connection_socket_handle &socket = connection->socket_;
+
+            while (receiver_loop_.load(std::memory_order_acquire)) {
+                try {
+                    socket.recv(instr);
+                    socket.recv(tid);
+                    io_priority priority = IO_PRIORITY_NORMAL;
+                    if (instr & IO_INSTR_PRIORITY_FLAG) {
+                        instr &= ~IO_INSTR_PRIORITY_FLAG;
+                        socket.recv(priority);
+                    }
+                    const bool checksum = instr & IO_INSTR_CHECKSUM_FLAG;
+                    instr &= ~IO_INSTR_CHECKSUM_FLAG;
+                    switch (instr) {
+                        case IO_INSTR_READ: {
+                            socket.recv(addr);
+                            if (!valid_range(addr, 1, true)) {
+                                reply(*connection, IO_INSTR_ADDR_ERROR, tid);
+                                break;
                             }
-                            break;
-                            case IO_INSTR_WRITE: {
-                                connection_socket_.recv(addr);
-                                // drive_sector_transaction transaction(instr, tid, sector_no(addr), bytes_per_sector_);
-                                // connection_socket_.recv_raw(transaction.data_, bytes_per_sector_); //
-                                // {
-                                //     std::lock_guard<std::mutex> lock(list_mutex_);
-                                //     waiting_list_[cylinder_no(addr)].emplace_back(std::move(transaction));
-                                // } todo async
-                                if (prev_cylinder_no != cylinder_no(addr))
-                                    usleep(dist(prev_cylinder_no, cylinder_no(addr)) * sim_move_cost_us_);
-                                connection_socket_.recv_raw(file_data_ + addr * bytes_per_sector_, bytes_per_sector_);
-                                prev_cylinder_no = cylinder_no(addr); //
-                                {
-                                    std::lock_guard<std::mutex> lock(socket_write_mutex_);
-                                    connection_socket_.send(instr);
-                                    connection_socket_.send(tid);
-                                }
+                            enqueue(drive_sector_transaction(instr, tid, sector_no(addr), 0, connection, 1, priority, checksum), cylinder_no(addr));
+                        }
+                        break;
+                        case IO_INSTR_WRITE: {
+                            socket.recv(addr);
+                            if (!valid_range(addr, 1, true)) {
+                                skip_write_data(socket, 1, checksum);
+                                reply(*connection, IO_INSTR_ADDR_ERROR, tid);
+                                break;
                             }
-                            break;
-                            case IO_INSTR_GET_DESC: {
-                                std::lock_guard<std::mutex> lock(socket_write_mutex_);
-                                connection_socket_.send(instr);
-                                connection_socket_.send(tid);
-                                connection_socket_.send(disk_description{cylinders_, sectors_per_cylinder_, bytes_per_sector_});
+                            drive_sector_transaction transaction(instr, tid, sector_no(addr), write_data_size(1, checksum), connection, 1, priority, checksum);
+                            if (receive_write_data(socket, transaction))
+                                enqueue(std::move(transaction), cylinder_no(addr));
+                            else
+                                reply(*connection, IO_INSTR_CHECKSUM_ERROR, tid);
+                        }
+                        break;
+                        case IO_INSTR_READ_RANGE: {
+                            uint64_t sectors;
+                            socket.recv(addr);
+                            socket.recv(sectors);
+                            if (!valid_range(addr, sectors, true)) {
+                                reply(*connection, IO_INSTR_ADDR_ERROR, tid);
+                                break;
+                            }
+                            enqueue(drive_sector_transaction(instr, tid, sector_no(addr), 0, connection, sectors, priority, checksum), cylinder_no(addr));
+                        }
+                        break;
+                        case IO_INSTR_WRITE_RANGE: {
+                            uint64_t sectors;
+                            socket.recv(addr);
+                            socket.recv(sectors);
+                            if (!valid_range(addr, sectors, true)) {
+                                const bool in_step = skip_write_data(socket, sectors, checksum);
+                                reply(*connection, IO_INSTR_ADDR_ERROR, tid);
+                                if (!in_step)
+                                    socket.interrupt();
+                                break;
+                            }
+                            drive_sector_transaction transaction(instr, tid, sector_no(addr), write_data_size(sectors, checksum), connection, sectors, priority, checksum);
+                            if (receive_write_data(socket, transaction))
+                                enqueue(std::move(transaction), cylinder_no(addr));
+                            else
+                                reply(*connection, IO_INSTR_CHECKSUM_ERROR, tid);
+                        }
+                        break;
+                        case IO_INSTR_TRIM: {
+                            uint64_t sectors;
+                            socket.recv(addr);
+                            socket.recv(sectors);
+                            if (!valid_range(addr, sectors, false)) {
+                                reply(*connection, IO_INSTR_ADDR_ERROR, tid);
+                                break;
+                            }
+                            enqueue(drive_sector_transaction(instr, tid, sector_no(addr), 0, connection, sectors, priority), cylinder_no(addr));
+                        }
+                        break;
+                        case IO_INSTR_COMPLETE_BATCH: {
+                            connection->batch_completions_.store(true, std::memory_order_release);
+                            reply(*connection, instr, tid);
+                        }
+                        break;
+                        case IO_INSTR_GET_STATS: {
+                            drive_stats current = stats();
+                            std::lock_guard<std::mutex> lock(connection->write_mutex_);
+                            socket.send(instr);
+                            socket.send(tid);
+                            socket.send(current);
+                        }
+                        break;
+                        case IO_INSTR_GET_CAPS: {
+                            io_capabilities caps{
+                                IO_PROTOCOL_VERSION,
+                                IO_FEATURE_RANGE | IO_FEATURE_TRIM | IO_FEATURE_FLUSH | IO_FEATURE_STATS
+                                | IO_FEATURE_BATCH_COMPLETIONS | IO_FEATURE_PRIORITY | IO_FEATURE_CHECKSUMS
+                                | (checksums_ ? IO_FEATURE_CHECKSUM_TABLE : 0),
+                                options_.max_transfer_sectors, options_.queue_depth, 0
+                            };
+                            std::lock_guard<std::mutex> lock(connection->write_mutex_);
+                            socket.send(instr);
+                            socket.send(tid);
+                            socket.send(caps);
+                        }
+                        break;
+                        case IO_INSTR_GET_DESC: {
+                            std::lock_guard<std::mutex> lock(connection->write_mutex_);
+                            socket.send(instr);
+                            socket.send(tid);
+                            socket.send(disk_description{cylinders_, sectors_per_cylinder_, bytes_per_sector_});
+                        }
+                        break;
+                        case IO_INSTR_FLUSH: {
+                            uint64_t sectors;
+                            socket.recv(addr);
+                            socket.recv(sectors);
+                            flush(addr, sectors);
+                            reply(*connection, instr, tid);
+                        }
+                        break;
+                        case IO_INSTR_SHUTDOWN: {
+                            // requests queued before the shutdown are still served
+                            receiver_loop_.store(false); {
+                                std::unique_lock<std::mutex> lock(list_mutex_);
+                                list_idle_cv_.wait(lock, [this] { return waiting_list_.empty() && !magnetic_head_busy_; });
+                            }
+                            flush(0, 0); // buffered writes included
+                            reply(*connection, instr, tid);
+                            stop();
+                        }
+                        break;
+                        default:
+                            break; // todo throw
+                    }
+                } catch (except &e) {
+                    if (e.error_code() == ERROR_SOCKET_CLOSED_BY_REMOTE || e.error_code() == ERROR_SOCKET_TERMINATED)
+                        break;
+                    throw;
+                }
+            }
+            connection->closed_.store(true, std::memory_order_release);
+        }
+
+        static constexpr uint64_t ZEROCOPY_MIN_BYTES = 0x4000; // below this, pinning pages costs more than copying
+        static constexpr int ZEROCOPY_REAP_TIMEOUT_MS = 10;
+
+        // connections with zero-copy sends in flight, owned by the magnetic head thread
+        std::vector<std::shared_ptr<drive_connection> > zerocopy_connections_;
+
+        static bool is_read(const io_instr instr) { return instr == IO_INSTR_READ || instr == IO_INSTR_READ_RANGE; }
+
+        static bool is_write(const io_instr instr) { return instr == IO_INSTR_WRITE || instr == IO_INSTR_WRITE_RANGE; }
+
+        struct drive_completions {
+            std::shared_ptr<drive_connection> connection_;
+            io_instr instr_; // of the first acknowledged transaction
+            std::vector<uint32_t> tids_;
+        };
+
+        // Transactions [first_, last_) of a batch: reads or writes of consecutive sectors, or a single TRIM
+        struct drive_run {
+            size_t first_, last_;
+            uint64_t addr_, sectors_;
+        };
+
+        // Serving in address order lets requests that arrived interleaved merge into runs.
+        // Only done when no write or TRIM overlaps another request, so the result is unchanged
+        static void sort_by_address(std::vector<drive_sector_transaction> &transaction_list) {
+            auto by_offset = [](const drive_sector_transaction &a, const drive_sector_transaction &b) { return a.sector_offset_ < b.sector_offset_; };
+            if (std::ranges::is_sorted(transaction_list, by_offset))
+                return;
+            std::vector<const drive_sector_transaction *> sorted;
+            for (auto &t: transaction_list)
+                sorted.push_back(&t);
+            std::ranges::sort(sorted, [](auto *a, auto *b) { return a->sector_offset_ < b->sector_offset_; });
+            bool modified = false;
+            for (size_t i = 0; i < sorted.size(); ++i) {
+                modified |= !is_read(sorted[i]->instr_);
+                if (modified && i && sorted[i - 1]->sector_offset_ + sorted[i - 1]->sectors_ > sorted[i]->sector_offset_)
+                    return;
+            }
+            std::ranges::stable_sort(transaction_list, by_offset);
+        }
+
+        static std::vector<drive_run> split_runs(const std::vector<drive_sector_transaction> &transaction_list, const uint64_t base) {
+            std::vector<drive_run> runs;
+            for (size_t i = 0; i < transaction_list.size(); ++i) {
+                const drive_sector_transaction &t = transaction_list[i];
+                if (!runs.empty() && t.instr_ != IO_INSTR_TRIM) {
+                    drive_run &run = runs.back();
+                    const io_instr prev = transaction_list[run.last_ - 1].instr_;
+                    if (((is_read(prev) && is_read(t.instr_)) || (is_write(prev) && is_write(t.instr_)))
+                        && run.addr_ + run.sectors_ == (base | t.sector_offset_)) {
+                        run.last_ = i + 1;
+                        run.sectors_ += t.sectors_;
+                        continue;
+                    }
+                }
+                runs.push_back({i, i + 1, base | t.sector_offset_, t.sectors_});
+            }
+            return runs;
+        }
+
+        // Serves the transactions picked for the cylinder the head is on, in one backend batch with
+        // one transfer per run of consecutive sectors; returns where the head ends up
+        uint64_t service(std::vector<drive_sector_transaction> &transaction_list, uint64_t cylinder_pos) {
+            const uint64_t batch_cylinder = cylinder_pos;
+            const uint64_t base = batch_cylinder << sector_addr_bits_;
+            sort_by_address(transaction_list);
+            const std::vector<drive_run> runs = split_runs(transaction_list, base);
+
+            std::vector<drive_io> batch;
+            std::vector<char *> run_buffers; // merged runs, when the image is not mapped
+            std::vector<const char *> read_data(transaction_list.size(), nullptr); // nullptr: answered from zeros
+            std::vector<std::pair<uint64_t, const char *> > fills; // tracks read ahead into the cache
+            auto transfer = [&] {
+                backend_->transfer(batch);
+                for (auto &[cylinder, data]: fills)
+                    cache_.fill(cylinder, data);
+                fills.clear();
+            };
+
+            for (auto &run: runs) {
+                drive_sector_transaction &head = transaction_list[run.first_];
+                uint64_t offset = run.addr_ * bytes_per_sector_, size = run.sectors_ * bytes_per_sector_;
+                const uint64_t cylinder = cylinder_no(run.addr_), sector = sector_no(run.addr_);
+                const bool one_track = cylinder_no(run.addr_ + run.sectors_ - 1) == cylinder;
+
+                if (is_read(head.instr_)) {
+                    char *data = file_data_ ? file_data_ + offset : nullptr;
+                    bool cached = false;
+                    if (cache_.enabled() && one_track && cache_.contains(cylinder, sector, run.sectors_)) {
+                        if (!file_data_) {
+                            run_buffers.push_back(data = drive_data_alloc(size));
+                            cache_.read(cylinder, sector, run.sectors_, data);
+                        }
+                        cached = true;
+                        count_hit(run.last_ - run.first_, run.sectors_);
+                    } else if (cache_.enabled() && one_track) {
+                        // the media has to be up to date for this track, then the rest of it is read ahead
+                        destage(batch, run_buffers, cylinder_pos, cylinder);
+                        simulate(run.addr_, sectors_per_cylinder_ - sector, run.last_ - run.first_, cylinder_pos);
+                        cylinder_pos = cylinder;
+                        uint64_t track_offset = (cylinder << sector_addr_bits_) * bytes_per_sector_;
+                        if (file_data_) {
+                            cache_.fill(cylinder, nullptr);
+                        } else {
+                            char *track = drive_data_alloc(sectors_per_cylinder_ * bytes_per_sector_);
+                            run_buffers.push_back(track);
+                            batch.push_back({false, track_offset, sectors_per_cylinder_ * bytes_per_sector_, track});
+                            fills.emplace_back(cylinder, track);
+                            data = track + (offset - track_offset);
+                            cached = true; // holes read back as zeros
+                        }
+                    } else {
+                        if (cache_.enabled())
+                            destage(batch, run_buffers, cylinder_pos);
+                        simulate(run.addr_, run.sectors_, run.last_ - run.first_, cylinder_pos); // a run spanning cylinders sweeps the head along
+                        cylinder_pos = cylinder_no(run.addr_ + run.sectors_ - 1);
+                        if (!file_data_ && sparse_written(offset, size)) {
+                            run_buffers.push_back(data = drive_data_alloc(size));
+                            batch.push_back({false, offset, size, data});
+                        }
+                    }
+                    for (size_t i = run.first_; i < run.last_; ++i) {
+                        uint64_t t_offset = (base | transaction_list[i].sector_offset_) * bytes_per_sector_;
+                        if (data && (cached || sparse_written(t_offset, transaction_list[i].sectors_ * bytes_per_sector_)))
+                            read_data[i] = data + (t_offset - offset);
+                    }
+                } else if (is_write(head.instr_)) {
+                    char *data = head.data_;
+                    if (!file_data_ && run.last_ - run.first_ > 1) {
+                        run_buffers.push_back(data = drive_data_alloc(size));
+                        for (size_t i = run.first_, pos = 0; i < run.last_; pos += transaction_list[i++].sectors_ * bytes_per_sector_)
+                            memcpy(data + pos, transaction_list[i].data_, transaction_list[i].sectors_ * bytes_per_sector_);
+                    }
+                    if (one_track && cache_.buffering()) {
+                        bool buffered = cache_.write(cylinder, sector, run.sectors_, data);
+                        if (!buffered && cache_.dirty()) {
+                            destage(batch, run_buffers, cylinder_pos);
+                            buffered = cache_.write(cylinder, sector, run.sectors_, data);
+                        }
+                        if (buffered) {
+                            count_hit(run.last_ - run.first_, run.sectors_);
+                            sparse_set_written(offset, size);
+                            continue; // acknowledged from the buffer; the mapping is still written as replies go out
+                        }
+                    }
+                    simulate(run.addr_, run.sectors_, run.last_ - run.first_, cylinder_pos);
+                    cylinder_pos = cylinder_no(run.addr_ + run.sectors_ - 1);
+                    std::erase_if(fills, [&](auto &f) { return f.first >= cylinder && f.first <= cylinder_pos; }); // read ahead too early
+                    if (one_track)
+                        cache_.update(cylinder, sector, run.sectors_, data);
+                    else
+                        cache_invalidate(run.addr_, run.sectors_);
+                    if (file_data_)
+                        continue; // the mapping is written in order as replies go out
+                    batch.push_back({true, offset, size, data});
+                    sparse_set_written(offset, size);
+                } else if (head.instr_ == IO_INSTR_TRIM) {
+                    if (!file_data_) {
+                        transfer();
+                        batch.clear();
+                        discard(offset, size);
+                    }
+                    cache_invalidate(run.addr_, run.sectors_);
+                }
+            }
+
+            transfer();
+            if (options_.write_through && !file_data_ && std::ranges::any_of(batch, &drive_io::write_))
+                backend_->flush(0, disk_size_); // one fdatasync covers the whole batch
+
+            // acknowledgements to connections that take them batched, sent after the loop
+            std::vector<drive_completions> completions;
+            auto acknowledge = [&completions](drive_sector_transaction &t) {
+                if (!t.connection_->batch_completions_.load(std::memory_order_acquire)) {
+                    reply(*t.connection_, t.instr_, t.tid_);
+                    return;
+                }
+                auto it = std::ranges::find(completions, t.connection_, &drive_completions::connection_);
+                if (it == completions.end())
+                    it = completions.insert(it, {t.connection_, t.instr_, {}});
+                it->tids_.push_back(t.tid_);
+            };
+
+            for (auto &run: runs) {
+                for (size_t i = run.first_; i < run.last_; ++i) {
+                    drive_sector_transaction &t = transaction_list[i];
+                    uint64_t offset = (base | t.sector_offset_) * bytes_per_sector_;
+                    uint64_t size = t.sectors_ * bytes_per_sector_;
+                    switch (t.instr_) {
+                        case IO_INSTR_READ:
+                        case IO_INSTR_READ_RANGE: {
+                            std::vector<uint32_t> sums;
+                            if (t.checksum_)
+                                sums = read_checksums(base | t.sector_offset_, t.sectors_, read_data[i]);
+                            if (!read_data[i])
+                                reply_zeros(*t.connection_, t.instr_, t.tid_, size, sums);
+                            else if (file_data_ && t.connection_->zerocopy_ && size >= ZEROCOPY_MIN_BYTES)
+                                reply_zerocopy(t.connection_, t.instr_, t.tid_, offset, size, sums);
+                            else
+                                reply(*t.connection_, t.instr_, t.tid_, read_data[i], size, sums);
+                        }
+                        break;
+                        case IO_INSTR_WRITE:
+                        case IO_INSTR_WRITE_RANGE:
+                            if (checksums_)
+                                checksums_->set(base | t.sector_offset_, t.sectors_, reinterpret_cast<const uint32_t *>(t.data_ + size));
+                            if (file_data_) {
+                                zerocopy_wait(offset, size);
+                                backend_->write(offset, size, t.data_);
+                                sparse_set_written(offset, size);
+                                if (options_.write_through && i + 1 == run.last_)
+                                    backend_->flush(run.addr_ * bytes_per_sector_, run.sectors_ * bytes_per_sector_);
                             }
+                            acknowledge(t);
                             break;
-                            case IO_INSTR_SHUTDOWN: {
-                                // todo async
-                                receiver_loop_.store(false); {
-                                    std::lock_guard<std::mutex> lock(socket_write_mutex_);
-                                    connection_socket_.send(instr);
-                                    connection_socket_.send(tid);
-                                }
+                        case IO_INSTR_TRIM:
+                            if (checksums_)
+                                checksums_->set_zero(base | t.sector_offset_, t.sectors_);
+                            if (file_data_) {
+                                zerocopy_wait(offset, size);
+                                discard(offset, size);
                             }
+                            acknowledge(t);
                             break;
-                            default:
-                                break; // todo throw
-                        }
-                    } catch (except &e) {
-                        if (e.error_code() == ERROR_SOCKET_CLOSED_BY_REMOTE) {
-                            // std::lock_guard<std::mutex> lock(list_mutex_);
-                            // waiting_list_.clear();
+                        default:
                             break;
-                        }
-                        throw;
                     }
                 }
             }
+
+            for (auto &c: completions)
+                reply_completions(c);
+            for (char *buffer: run_buffers)
+                drive_data_free(buffer);
+            return cylinder_pos;
+        }
+
+        // One frame acknowledging several WRITE / WRITE_RANGE / TRIM transactions:
+        // instr, tid = 0, count (u32), then count tids. A lone acknowledgement goes out as a plain reply
+        static void reply_completions(const drive_completions &c) {
+            const std::vector<uint32_t> &tids = c.tids_;
+            drive_connection &connection = *c.connection_;
+            if (tids.size() == 1) {
+                reply(connection, c.instr_, tids[0]);
+                return;
+            }
+            std::lock_guard<std::mutex> lock(connection.write_mutex_);
+            try {
+                connection.socket_.send(IO_INSTR_COMPLETE_BATCH);
+                connection.socket_.send(static_cast<uint32_t>(0));
+                connection.socket_.send(static_cast<uint32_t>(tids.size()));
+                connection.socket_.send_raw(reinterpret_cast<const char *>(tids.data()), tids.size() * sizeof(uint32_t));
+            } catch (except &e) {
+                if (e.error_code() != ERROR_SOCKET_CLOSED_BY_REMOTE && e.error_code() != ERROR_SOCKET_TERMINATED)
+                    throw;
+            }
+        }
+
+        static uint64_t dist(const uint64_t a, const uint64_t b) {
+            if (a > b)
+                return a - b;
+            return b - a;
+        }
+
+        static void reply_zeros(drive_connection &connection, const io_instr instr, const uint32_t tid, uint64_t size,
+                                const std::vector<uint32_t> &checksums = {}) {
+            static const char zero_page[0x1000] = {};
+            std::lock_guard<std::mutex> lock(connection.write_mutex_);
+            try {
+                connection.socket_.send(instr);
+                connection.socket_.send(tid);
+                for (; size; size -= std::min<uint64_t>(size, sizeof(zero_page)))
+                    connection.socket_.send_raw(zero_page, std::min<uint64_t>(size, sizeof(zero_page)));
+                if (!checksums.empty())
+                    connection.socket_.send_raw(reinterpret_cast<const char *>(checksums.data()), checksums.size() * sizeof(uint32_t));
+            } catch (except &e) {
+                if (e.error_code() != ERROR_SOCKET_CLOSED_BY_REMOTE && e.error_code() != ERROR_SOCKET_TERMINATED)
+                    throw;
+            }
+        }
+
+        void reply_zerocopy(const std::shared_ptr<drive_connection> &connection, const io_instr instr, const uint32_t tid,
+                            const uint64_t offset, const uint64_t size, const std::vector<uint32_t> &checksums = {}) {
+            uint32_t calls = 0; //
+            {
+                std::lock_guard<std::mutex> lock(connection->write_mutex_);
+                try {
+                    connection->socket_.send(instr);
+                    connection->socket_.send(tid);
+                    calls = connection->socket_.send_raw_zerocopy(file_data_ + offset, size);
+                    if (!checksums.empty())
+                        connection->socket_.send_raw(reinterpret_cast<const char *>(checksums.data()), checksums.size() * sizeof(uint32_t));
+                } catch (except &e) {
+                    if (e.error_code() != ERROR_SOCKET_CLOSED_BY_REMOTE && e.error_code() != ERROR_SOCKET_TERMINATED)
+                        throw;
+                }
+            }
+            if (calls) {
+                if (connection->zerocopy_pending_.empty())
+                    zerocopy_connections_.push_back(connection);
+                connection->zerocopy_pending_.push_back({connection->zerocopy_next_id_, connection->zerocopy_next_id_ + calls - 1, calls, offset, size});
+                connection->zerocopy_next_id_ += calls;
+            }
+            zerocopy_reap(*connection, 0);
+        }
+
+        bool zerocopy_reap(drive_connection &connection, const int timeout_ms) {
+            return connection.socket_.reap_zerocopy(timeout_ms, [&connection](const uint32_t lo, const uint32_t hi) {
+                for (auto &p: connection.zerocopy_pending_) {
+                    uint32_t first = std::max(lo, p.first_id_), last = std::min(hi, p.last_id_);
+                    if (first <= last)
+                        p.remaining_ -= last - first + 1;
+                }
+                std::erase_if(connection.zerocopy_pending_, [](const drive_zerocopy_send &p) { return p.remaining_ == 0; });
+            });
+        }
+
+        // Blocks until no in-flight zero-copy send still references [offset, offset + size) of the image
+        void zerocopy_wait(const uint64_t offset, const uint64_t size) {
+            for (auto &c: zerocopy_connections_) {
+                auto overlapped = [&c, offset, size] {
+                    for (auto &p: c->zerocopy_pending_)
+                        if (p.offset_ < offset + size && offset < p.offset_ + p.size_)
+                            return true;
+                    return false;
+                };
+                while (overlapped()) {
+                    if (!zerocopy_reap(*c, ZEROCOPY_REAP_TIMEOUT_MS) && c->closed_.load(std::memory_order_acquire))
+                        c->zerocopy_pending_.clear(); // pages stay pinned by the kernel, nobody reads them any more
+                }
+            }
+            std::erase_if(zerocopy_connections_, [](const std::shared_ptr<drive_connection> &c) { return c->zerocopy_pending_.empty(); });
         }
 
-        // todo async scheduler
-
-        // void virtual_magnetic_head() {
-        //     uint64_t cylinder_pos = 0;
-        //     enum { MOVE_UP, MOVE_DOWN } current_direction = MOVE_UP; // for SCAN and LOOK only
-        //     while (true) {
-        //         {
-        //             std::unique_lock<std::mutex> lock(magnetic_head_wake_mutex_);
-        //             if (magnetic_head_sig_term_)
-        //                 break;
-        //             magnetic_head_sig_continue_ = false;
-        //             bool idle_flag; //
-        //             {
-        //                 std::lock_guard<std::mutex> list_lock(list_mutex_);
-        //                 idle_flag = waiting_list_.empty();
-        //             }
-        //             if (idle_flag)
-        //                 magnetic_head_wake_cv_.wait(lock, [this] { return magnetic_head_sig_continue_ || magnetic_head_sig_term_; });
-        //             if (magnetic_head_sig_term_)
-        //                 break;
-        //         }
-        //
-        //         std::vector<drive_sector_transaction> transaction_list;
-        //         uint64_t move_dist = 0; //
-        //         {
-        //             std::lock_guard<std::mutex> list_lock(list_mutex_);
-        //             if (waiting_list_.empty())
-        //                 continue;
-        //             auto it = waiting_list_.lower_bound(cylinder_pos);
-        //             if (it != waiting_list_.end() && it->first == cylinder_pos) {
-        //                 move_dist = 0;
-        //             } else {
-        //                 switch (scheduler_) {
-        //                     case DRIVE_SCHEDULER_SSTF:
-        //                         if (it == waiting_list_.begin()) {
-        //                             move_dist = it->first - cylinder_pos;
-        //                         } else if (it == waiting_list_.end()) {
-        //                             it = std::prev(it);
-        //                             move_dist = cylinder_pos - it->first;
-        //                         } else {
-        //                             auto prev = std::prev(it);
-        //                             if (cylinder_pos - prev->first < it->first - cylinder_pos) {
-        //                                 it = prev;
-        //                                 move_dist = cylinder_pos - it->first;
-        //                             } else {
-        //                                 move_dist = it->first - cylinder_pos;
-        //                             }
-        //                         }
-        //                         break;
-        //                     case DRIVE_SCHEDULER_SCAN:
-        //                     case DRIVE_SCHEDULER_LOOK:
-        //                         if (current_direction == MOVE_UP) {
-        //                             if (it == waiting_list_.end()) {
-        //                                 current_direction = MOVE_DOWN;
-        //                                 it = std::prev(it);
-        //                                 if (scheduler_ == DRIVE_SCHEDULER_SCAN)
-        //                                     move_dist = cylinders_ * 2LL - 2LL - cylinder_pos - it->first;
-        //                                 else
-        //                                     move_dist = cylinder_pos - it->first;
-        //                             } else {
-        //                                 move_dist = it->first - cylinder_pos;
-        //                             }
-        //                         } else { // MOVE_DOWN
-        //                             if (it == waiting_list_.begin()) {
-        //                                 current_direction = MOVE_UP;
-        //                                 if (scheduler_ == DRIVE_SCHEDULER_SCAN)
-        //                                     move_dist = cylinder_pos + it->first;
-        //                                 else
-        //                                     move_dist = it->first - cylinder_pos;
-        //                             } else {
-        //                                 it = std::prev(it);
-        //                                 move_dist = cylinder_pos - it->first;
-        //                             }
-        //                         }
-        //                         break;
-        //                     case DRIVE_SCHEDULER_CSCAN:
-        //                     case DRIVE_SCHEDULER_CLOOK:
-        //                         if (it == waiting_list_.end()) {
-        //                             it = waiting_list_.begin();
-        //                             if (scheduler_ == DRIVE_SCHEDULER_CSCAN)
-        //                                 move_dist = cylinders_ * 2LL - 2LL - cylinder_pos + it->first;
-        //                             else
-        //                                 move_dist = cylinder_pos - it->first;
-        //                         } else {
-        //                             move_dist = it->first - cylinder_pos;
-        //                         }
-        //                         break;
-        //                 }
-        //             }
-        //             cylinder_pos = it->first;
-        //             transaction_list = std::move(it->second);
-        //             waiting_list_.erase(it);
-        //         }
-        //         if (move_dist)
-        //             usleep(move_dist * sim_move_cost_us_);
-        //
-        //         // The connection socket is initialized when transactions can be received
-        //
-        //         try {
-        //             for (auto &t: transaction_list) { // todo thread pool
-        //                 switch (t.instr_) {
-        //                     case IO_INSTR_READ:
-        //                         uint64_t offset = ((cylinder_pos << sector_addr_bits_) | t.sector_offset_) * bytes_per_sector_;
-        //                         memcpy(t.data_, file_data_ + offset, bytes_per_sector_); // todo will be used. don't optimize
-        //                         {
-        //                             std::lock_guard<std::mutex> socket_lock(socket_write_mutex_);
-        //
-        //                         }
-        //                         break;
-        //                     case IO_INSTR_WRITE:
-        //                         break;
-        //                     default:
-        //                         break;
-        //                 }
-        //             }
-        //         } catch (except &e) {
-        //             if (e.error_code() == ERROR_SOCKET_CLOSED_BY_REMOTE) {
-        //                 std::lock_guard<std::mutex> lock(list_mutex_);
-        //                 waiting_list_.clear();
-        //                 continue;
-        //             }
-        //             if (e.error_code() == ERROR_SOCKET_TERMINATED) {
-        //                 std::lock_guard<std::mutex> lock(list_mutex_);
-        //                 waiting_list_.clear();
-        //                 break;
-        //             }
-        //             throw;
-        //         }
-        //
-        //
-        //     }
-        //
-        // }
+        void virtual_magnetic_head() {
+            uint64_t cylinder_pos = 0;
+            enum { MOVE_UP, MOVE_DOWN } current_direction = MOVE_UP; // for SCAN and LOOK only
+            while (true) {
+                if (cache_.buffering()) {
+                    bool requested, idle;
+                    {
+                        std::lock_guard<std::mutex> list_lock(list_mutex_);
+                        requested = destage_requested_;
+                        idle = waiting_list_.empty();
+                    }
+                    if (requested || (idle && options_.destage_on_idle))
+                        cylinder_pos = destage_all(cylinder_pos);
+                    if (requested) {
+                        {
+                            std::lock_guard<std::mutex> list_lock(list_mutex_);
+                            destage_requested_ = false;
+                        }
+                        list_idle_cv_.notify_all();
+                    }
+                }
+                {
+                    std::unique_lock<std::mutex> lock(magnetic_head_wake_mutex_);
+                    if (magnetic_head_sig_term_)
+                        break;
+                    magnetic_head_sig_continue_ = false;
+                    bool idle_flag; //
+                    {
+                        std::lock_guard<std::mutex> list_lock(list_mutex_);
+                        idle_flag = waiting_list_.empty() && !destage_requested_;
+                    }
+                    if (idle_flag)
+                        magnetic_head_wake_cv_.wait(lock, [this] { return magnetic_head_sig_continue_ || magnetic_head_sig_term_; });
+                    if (magnetic_head_sig_term_)
+                        break;
+                }
+
+                std::vector<drive_sector_transaction> transaction_list;
+                uint64_t move_dist = 0; //
+                {
+                    std::lock_guard<std::mutex> list_lock(list_mutex_);
+                    if (waiting_list_.empty())
+                        continue;
+                    auto it = overdue(cylinder_pos);
+                    if (it != waiting_list_.end()) {
+                        move_dist = dist(cylinder_pos, it->first);
+                    } else if (it = waiting_list_.lower_bound(cylinder_pos); it != waiting_list_.end() && it->first == cylinder_pos) {
+                        move_dist = 0;
+                    } else {
+                        switch (scheduler_) {
+                            case DRIVE_SCHEDULER_SSTF:
+                                if (it == waiting_list_.begin()) {
+                                    move_dist = it->first - cylinder_pos;
+                                } else if (it == waiting_list_.end()) {
+                                    it = std::prev(it);
+                                    move_dist = cylinder_pos - it->first;
+                                } else {
+                                    auto prev = std::prev(it);
+                                    if (cylinder_pos - prev->first < it->first - cylinder_pos) {
+                                        it = prev;
+                                        move_dist = cylinder_pos - it->first;
+                                    } else {
+                                        move_dist = it->first - cylinder_pos;
+                                    }
+                                }
+                                break;
+                            case DRIVE_SCHEDULER_SCAN:
+                            case DRIVE_SCHEDULER_LOOK:
+                                if (current_direction == MOVE_UP) {
+                                    if (it == waiting_list_.end()) {
+                                        current_direction = MOVE_DOWN;
+                                        it = std::prev(it);
+                                        if (scheduler_ == DRIVE_SCHEDULER_SCAN)
+                                            move_dist = cylinders_ * 2LL - 2LL - cylinder_pos - it->first;
+                                        else
+                                            move_dist = cylinder_pos - it->first;
+                                    } else {
+                                        move_dist = it->first - cylinder_pos;
+                                    }
+                                } else { // MOVE_DOWN
+                                    if (it == waiting_list_.begin()) {
+                                        current_direction = MOVE_UP;
+                                        if (scheduler_ == DRIVE_SCHEDULER_SCAN)
+                                            move_dist = cylinder_pos + it->first;
+                                        else
+                                            move_dist = it->first - cylinder_pos;
+                                    } else {
+                                        it = std::prev(it);
+                                        move_dist = cylinder_pos - it->first;
+                                    }
+                                }
+                                break;
+                            case DRIVE_SCHEDULER_CSCAN:
+                            case DRIVE_SCHEDULER_CLOOK:
+                                if (it == waiting_list_.end()) {
+                                    it = waiting_list_.begin();
+                                    if (scheduler_ == DRIVE_SCHEDULER_CSCAN)
+                                        move_dist = cylinders_ * 2LL - 2LL - cylinder_pos + it->first;
+                                    else
+                                        move_dist = cylinder_pos - it->first;
+                                } else {
+                                    move_dist = it->first - cylinder_pos;
+                                }
+                                break;
+                        }
+                    }
+                    cylinder_pos = it->first;
+                    transaction_list = std::move(it->second);
+                    waiting_list_.erase(it);
+                    meta_cylinders_.erase(cylinder_pos);
+                    magnetic_head_busy_ = true;
+                }
+                seek(move_dist);
+
+                cylinder_pos = service(transaction_list, cylinder_pos); // todo thread pool
+
+                {
+                    std::lock_guard<std::mutex> list_lock(list_mutex_);
+                    magnetic_head_busy_ = false;
+                    for (auto &t: transaction_list)
+                        pending_seqs_.erase(t.seq_);
+                }
+                list_idle_cv_.notify_all();
+            }
+            {
+                std::lock_guard<std::mutex> list_lock(list_mutex_);
+                destage_requested_ = false; // nothing is going to serve it any more
+            }
+            list_idle_cv_.notify_all();
+        }
     };
 }
 
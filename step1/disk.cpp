@@ -11,6 +11,7 @@ int main(int argc, char *argv[]) {
     uint64_t delay_us = 0;
     uint16_t port = 0;
     std::string filename;
+    cs2313::drive_options options;
 
     using cs2313::is_uint;
 
@@ -36,6 +37,70 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
             port = static_cast<uint16_t>(arg_port);
+        } else if (arg == "-m" && i + 1 < argc) {
+            ++i;
+            std::string backend = argv[i];
+            if (backend == "mmap") {
+                options.backend = cs2313::DRIVE_BACKEND_MMAP;
+            } else if (backend == "pread") {
+                options.backend = cs2313::DRIVE_BACKEND_PREAD;
+            } else if (backend == "uring") {
+                options.backend = cs2313::DRIVE_BACKEND_URING;
+            } else {
+                std::cout << "Unknown I/O backend: " << backend << " (expected mmap, pread or uring)\n";
+                return 1;
+            }
+        } else if (arg == "-w" && i + 1 < argc) {
+            ++i;
+            std::string mode = argv[i];
+            if (mode == "through") {
+                options.write_through = true;
+            } else if (mode == "back") {
+                options.write_through = false;
+            } else {
+                std::cout << "Unknown write mode: " << mode << " (expected through or back)\n";
+                return 1;
+            }
+        } else if (arg == "-t" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            options.timing.seek_settle_ns = std::stoull(argv[i]) * 1000;
+        } else if (arg == "-r" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            options.timing.rpm = std::stoull(argv[i]);
+        } else if (arg == "-x" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            options.timing.transfer_ns_per_sector = std::stoull(argv[i]);
+        } else if (arg == "-C" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            options.cache_tracks = std::stoull(argv[i]);
+        } else if (arg == "-B" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            options.write_buffer_sectors = std::stoull(argv[i]);
+        } else if (arg == "-T" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            options.max_transfer_sectors = std::stoull(argv[i]);
+        } else if (arg == "-Q" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            options.queue_depth = std::stoul(argv[i]);
+        } else if (arg == "-D" && i + 1 < argc) {
+            ++i;
+            std::string policy = argv[i];
+            if (policy == "idle") {
+                options.destage_on_idle = true;
+            } else if (policy == "full") {
+                options.destage_on_idle = false;
+            } else {
+                std::cout << "Unknown destage policy: " << policy << " (expected idle or full)\n";
+                return 1;
+            }
+        } else if (arg == "-V") {
+            options.timing.virtual_clock = true;
+        } else if (arg == "-S") {
+            options.sparse = true;
+        } else if (arg == "-z") {
+            options.zerocopy = true;
+        } else if (arg == "-k") {
+            options.checksums = true;
         } else if (arg[0] != '-') {
             filename = argv[i];
         } else {
@@ -45,7 +110,7 @@ int main(int argc, char *argv[]) {
     }
 
     if (cylinders == 0 || sectors_per_cylinder == 0 || port == 0 || filename.empty()) {
-        std::cout << "Usage: disk filename -c cylinders -s sectors_per_cylinder [-b bytes_per_sector=256] [-d delay_us=0] -p port \n";
+        std::cout << "Usage: disk filename -c cylinders -s sectors_per_cylinder [-b bytes_per_sector=256] [-d delay_us=0] [-t settle_us=0] [-r rpm=0] [-x transfer_ns=0] [-V] [-C cache_tracks=0] [-B write_buffer_sectors=0] [-D idle|full] [-T max_transfer_sectors=0] [-Q queue_depth=0] [-m mmap|pread|uring] [-w through|back] [-z] [-S] [-k] -p port \n";
         return 1;
     }
     if (filename.size() < 4 || filename.compare(filename.size() - 4, 4, ".raw") != 0) {
@@ -54,10 +119,16 @@ int main(int argc, char *argv[]) {
 
     try {
 
-        cs2313::virtual_drive drive(cylinders, sectors_per_cylinder, bytes_per_sector, delay_us, filename.c_str(), port);
+        cs2313::virtual_drive drive(cylinders, sectors_per_cylinder, bytes_per_sector, delay_us, filename.c_str(), port, options);
         drive.start();
         drive.wait();
 
+        cs2313::drive_stats stats = drive.stats();
+        std::cout << stats.requests << " requests, " << stats.sectors << " sectors, "
+                  << stats.seek_cylinders << " cylinders sought, "
+                  << stats.service_ns / 1000 << " us simulated service time, "
+                  << stats.cache_hits << " cache hits, " << stats.destaged_sectors << " sectors destaged\n";
+
     } catch (cs2313::except &e) {
         std::cout << "[ERROR] " << e;
     }
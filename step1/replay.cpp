@@ -0,0 +1,114 @@
+#include <iostream>
+#include <iomanip>
+#include <memory>
+
+#include "../src/io_trace.h"
+#include "../src/disk_client.h"
+#include "../src/ram_disk.h"
+#include "../src/utils/misc.h"
+
+static void print_latency(const char *name, std::vector<uint64_t> &latency_ns) {
+    if (latency_ns.empty())
+        return;
+    std::ranges::sort(latency_ns);
+    auto percentile = [&latency_ns](const double p) {
+        return latency_ns[std::min(latency_ns.size() - 1, static_cast<size_t>(p * static_cast<double>(latency_ns.size())))] / 1000.0;
+    };
+    std::cout << std::setw(6) << name << std::setw(10) << latency_ns.size()
+              << std::setw(12) << percentile(0.5) << std::setw(12) << percentile(0.9)
+              << std::setw(12) << percentile(0.99) << std::setw(12) << percentile(0.999)
+              << std::setw(12) << latency_ns.back() / 1000.0 << "\n";
+}
+
+int main(int argc, char *argv[]) {
+
+    std::string trace;
+    uint64_t port = 0;
+    uint32_t connections = 1;
+    bool memory = false;
+    bool depth_given = false;
+    cs2313::io_replay_options options;
+
+    using cs2313::is_uint;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-p" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            port = std::stoull(argv[i]);
+            if (port < 1000 || port > 65535) {
+                std::cout << "Invalid port: " << port << " (expected 1000 - 65535)\n";
+                return 1;
+            }
+        } else if (arg == "-n" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            connections = std::stoul(argv[i]);
+        } else if (arg == "-q" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            options.queue_depth = std::stoul(argv[i]);
+            depth_given = true;
+        } else if (arg == "-t" && i + 1 < argc) {
+            ++i;
+            std::string timing = argv[i];
+            if (timing == "original") {
+                options.original_timing = true;
+            } else if (timing == "fast") {
+                options.original_timing = false;
+            } else {
+                std::cout << "Unknown timing: " << timing << " (expected original or fast)\n";
+                return 1;
+            }
+        } else if (arg == "-M") {
+            memory = true;
+        } else if (arg[0] != '-') {
+            trace = argv[i];
+        } else {
+            std::cout << "Unknown or malformed argument: " << arg << "\n";
+            return 1;
+        }
+    }
+
+    if (trace.empty() || (port == 0) == !memory || options.queue_depth == 0 || connections == 0) {
+        std::cout << "Usage: replay trace_file (-p disk_port [-n connections=1] | -M) [-t original|fast] [-q queue_depth] \n";
+        return 1;
+    }
+    if (options.original_timing && !depth_given)
+        options.queue_depth = 64; // enough in flight to keep up with the recorded arrivals
+
+    try {
+
+        cs2313::disk_description description;
+        std::vector<cs2313::io_trace_record> records = cs2313::io_trace_load(trace.c_str(), description);
+
+        std::unique_ptr<cs2313::storage_interface> storage;
+        if (memory) {
+            storage = std::make_unique<cs2313::ram_disk>(description.cylinders, description.sectors_per_cylinder, description.bytes_per_sector);
+        } else {
+            auto client = std::make_unique<cs2313::disk_client>("127.0.0.1", static_cast<uint16_t>(port), connections,
+                                                                 cs2313::DISK_CLIENT_ROUTE_LEAST_OUTSTANDING);
+            client->start_handler();
+            storage = std::move(client);
+        }
+
+        cs2313::io_replay_result result = cs2313::io_trace_replay(*storage, records, options);
+
+        double seconds = static_cast<double>(result.elapsed_ns) / 1e9;
+        size_t requests = result.read_latency_ns.size() + result.write_latency_ns.size() + result.other_latency_ns.size();
+        std::cout << std::fixed << std::setprecision(1)
+                  << requests << " requests in " << seconds * 1000 << " ms: "
+                  << static_cast<double>(requests) / seconds << " IOPS, "
+                  << static_cast<double>(result.bytes_read) / seconds / (1 << 20) << " MiB/s read, "
+                  << static_cast<double>(result.bytes_written) / seconds / (1 << 20) << " MiB/s written\n";
+        std::cout << std::setw(6) << "us" << std::setw(10) << "count" << std::setw(12) << "p50" << std::setw(12) << "p90"
+                  << std::setw(12) << "p99" << std::setw(12) << "p99.9" << std::setw(12) << "max" << "\n";
+        print_latency("read", result.read_latency_ns);
+        print_latency("write", result.write_latency_ns);
+        print_latency("other", result.other_latency_ns);
+
+    } catch (cs2313::except &e) {
+        std::cout << "[ERROR] " << e;
+        return 1;
+    }
+
+    return 0;
+}
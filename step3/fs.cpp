@@ -1,34 +1,103 @@
 #include <iostream>
 
 #include "../src/disk_client.h"
+#include "../src/io_trace.h"
+#include "../src/striped_storage.h"
+#include "../src/mirrored_storage.h"
+#include "../src/parity_storage.h"
 #include "../src/fs.h"
 #include "../src/fs_server.h"
 #include "../src/utils/misc.h"
 
 int main(int argc, char *argv[]) {
 
-    if (argc != 3 || !cs2313::is_uint(argv[1]) || !cs2313::is_uint(argv[2])) {
-        std::cout << "Usage: fs disk_port port \n";
+    uint32_t connections = 1;
+    cs2313::disk_client_routing routing = cs2313::DISK_CLIENT_ROUTE_TID;
+    bool checksums = false;
+    uint64_t stripe_unit = 8;
+    uint32_t raid_level = 0;
+    std::string trace;
+    std::vector<uint64_t> disk_ports;
+
+    using cs2313::is_uint;
+
+    bool args_valid = argc >= 3 && is_uint(argv[2]);
+    if (args_valid) {
+        // several disk ports separated by commas: an array of all of them
+        std::string ports = argv[1];
+        for (size_t begin = 0, end; args_valid && begin <= ports.size(); begin = end + 1) {
+            end = std::min(ports.find(',', begin), ports.size());
+            std::string port = ports.substr(begin, end - begin);
+            if (is_uint(port.c_str()))
+                disk_ports.push_back(std::stoull(port));
+            else
+                args_valid = false;
+        }
+    }
+    for (int i = 3; args_valid && i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            connections = std::stoul(argv[i]);
+        } else if (arg == "-l") {
+            routing = cs2313::DISK_CLIENT_ROUTE_LEAST_OUTSTANDING;
+        } else if (arg == "-k") {
+            checksums = true;
+        } else if (arg == "-r" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            raid_level = std::stoul(argv[i]);
+        } else if (arg == "-u" && i + 1 < argc && is_uint(argv[i + 1])) {
+            ++i;
+            stripe_unit = std::stoull(argv[i]);
+        } else if (arg == "-t" && i + 1 < argc) {
+            ++i;
+            trace = argv[i];
+        } else {
+            args_valid = false;
+        }
+    }
+
+    if (!args_valid || connections == 0 || (raid_level != 0 && raid_level != 1 && raid_level != 5 && raid_level != 6)) {
+        std::cout << "Usage: fs disk_port[,disk_port...] port [-n disk_connections=1] [-l] [-k] [-r 0|1|5|6] [-u stripe_unit_sectors=8] [-t trace_file] \n";
         return 1;
     }
 
-    uint64_t disk_port = std::stoull(argv[1]),
-             fs_port = std::stoull(argv[2]);
+    uint64_t fs_port = std::stoull(argv[2]);
     if (fs_port < 1000 || fs_port > 65535) {
         std::cout << "Invalid port: " << fs_port << " (expected 1000 - 65535)\n";
         return 1;
     }
-    if (disk_port < 1000 || disk_port > 65535) {
-        std::cout << "Invalid port: " << disk_port << " (expected 1000 - 65535)\n";
-        return 1;
+    for (uint64_t disk_port: disk_ports) {
+        if (disk_port < 1000 || disk_port > 65535) {
+            std::cout << "Invalid port: " << disk_port << " (expected 1000 - 65535)\n";
+            return 1;
+        }
     }
 
     try {
 
         {
-            cs2313::disk_client client("127.0.0.1", static_cast<uint16_t>(disk_port));
-            client.start_handler();
-            cs2313::file_system fs(client);
+            std::vector<std::unique_ptr<cs2313::disk_client>> clients;
+            std::vector<cs2313::storage_interface *> members;
+            for (uint64_t disk_port: disk_ports) {
+                clients.push_back(std::make_unique<cs2313::disk_client>("127.0.0.1", static_cast<uint16_t>(disk_port), connections, routing));
+                if (checksums && !clients.back()->enable_checksums())
+                    std::cout << "[WARNING] The disk on port " << disk_port << " does not support checksums\n";
+                clients.back()->start_handler();
+                members.push_back(clients.back().get());
+            }
+            std::unique_ptr<cs2313::storage_interface> array;
+            if (members.size() > 1 && raid_level == 0)
+                array = std::make_unique<cs2313::striped_storage>(members, stripe_unit);
+            else if (members.size() > 1 && raid_level == 1)
+                array = std::make_unique<cs2313::mirrored_storage>(members);
+            else if (members.size() > 1)
+                array = std::make_unique<cs2313::parity_storage>(members, stripe_unit, raid_level == 6);
+            cs2313::storage_interface *storage = array ? array.get() : members[0];
+            std::unique_ptr<cs2313::traced_storage> traced;
+            if (!trace.empty())
+                traced = std::make_unique<cs2313::traced_storage>(*storage, trace.c_str());
+            cs2313::file_system fs(traced ? *traced : *storage);
             cs2313::fs_server server(fs, fs_port);
             server.accept_connections();
         }